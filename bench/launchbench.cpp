@@ -0,0 +1,501 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Benchmarks rununiproc's launch path, using noop.exe from the same directory
+ * as the child:
+ *
+ *   latency [n]   Cold and warm launch latency over n launches each
+ *   batch [n]     Batch throughput of n commands at 1 to N slots
+ *   select [n]    SelectAffinity cost on simulated topologies of up to 256
+ *                 processors in several groups, over n selections
+ *   cmdline [n]   BuildCommandLine cost for large argv, over n builds
+ *
+ * Without a benchmark name, runs all of them with their default counts.
+ *
+ * Usage: launchbench [latency|batch|select|cmdline] [count]
+ */
+
+#include "Batch.h"
+#include "CpuSelection.h"
+#include "CpuSet.h"
+#include "Launcher.h"
+#include "Options.h"
+#include "Output.h"
+#include "Session.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace {
+
+double
+ElapsedUs(LARGE_INTEGER const& aStart, LARGE_INTEGER const& aEnd)
+{
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  return (aEnd.QuadPart - aStart.QuadPart) * 1000000.0 / freq.QuadPart;
+}
+
+void
+PrintSummary(wchar_t const* aName, std::vector<double>& aSamples)
+{
+  std::sort(aSamples.begin(), aSamples.end());
+  gStdout << L"  " << AlignLeft << SetWidth(28) << aName << AlignRight
+          << SetWidth(12) << aSamples.front()
+          << SetWidth(12) << aSamples[aSamples.size() / 2]
+          << SetWidth(12) << aSamples.back() << EndLine;
+}
+
+bool
+GetNoopPath(std::wstring& aPath)
+{
+  aPath.resize(MAX_PATH);
+  DWORD len = GetModuleFileName(nullptr, &aPath[0], MAX_PATH);
+  if (!len || len >= MAX_PATH) {
+    gStderr << L"GetModuleFileName failed" << EndLine;
+    return false;
+  }
+  aPath.resize(len);
+  aPath.resize(aPath.rfind(L'\\') + 1);
+  aPath += L"noop.exe";
+
+  if (GetFileAttributes(aPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
+    gStderr << L"Unable to find \"" << aPath << L"\"" << EndLine;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Launches aParams once, adding the time from starting to create the child
+ * until it was resumed to aResumeUs, and until it exited to aExitUs.
+ */
+bool
+TimeLaunch(LaunchParams const& aParams, std::vector<double>& aResumeUs,
+           std::vector<double>& aExitUs)
+{
+  LARGE_INTEGER start, resumed, exited;
+  QueryPerformanceCounter(&start);
+
+  PinnedChild child;
+  if (!CreatePinnedChild(aParams, child) || !ResumeChild(child)) {
+    return false;
+  }
+  QueryPerformanceCounter(&resumed);
+
+  WaitForSingleObject(child.mProcess.get(), INFINITE);
+  QueryPerformanceCounter(&exited);
+
+  aResumeUs.push_back(ElapsedUs(start, resumed));
+  aExitUs.push_back(ElapsedUs(start, exited));
+  return true;
+}
+
+/**
+ * Warm launches run noop.exe itself, whose image the system has already
+ * mapped. Cold launches each run a fresh copy of it, so that no image section
+ * is cached for them; the copy's file data is still in the file cache, since
+ * flushing that would require administrator rights.
+ */
+int
+BenchLatency(int aIterations)
+{
+  LaunchParams params;
+  if (!GetNoopPath(params.mExePath) ||
+      !BuildCommandLine(params.mExePath, 0, nullptr, params.mCmdLine)) {
+    return 1;
+  }
+
+  PROCESSOR_NUMBER cpu = {};
+  GetCurrentProcessorNumberEx(&cpu);
+  params.mAffinity.Add(cpu);
+
+  wchar_t dir[MAX_PATH + 1];
+  DWORD dirLen = GetTempPath(MAX_PATH + 1, dir);
+  if (!dirLen || dirLen > MAX_PATH) {
+    gStderr << L"GetTempPath failed" << EndLine;
+    return 1;
+  }
+
+  std::vector<double> coldResume, coldExit;
+  for (int i = 0; i < aIterations; ++i) {
+    wchar_t copy[MAX_PATH];
+    if (!GetTempFileName(dir, L"nop", 0, copy) ||
+        !CopyFile(params.mExePath.c_str(), copy, FALSE)) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to copy noop.exe, error code " << err << EndLine;
+      return 1;
+    }
+
+    LaunchParams coldParams = params;
+    coldParams.mExePath = copy;
+    bool const ok = TimeLaunch(coldParams, coldResume, coldExit);
+    DeleteFile(copy);
+    if (!ok) {
+      return 1;
+    }
+  }
+
+  // The first launch makes the image warm, and is not counted
+  std::vector<double> warmResume, warmExit;
+  if (!TimeLaunch(params, warmResume, warmExit)) {
+    return 1;
+  }
+  warmResume.clear();
+  warmExit.clear();
+  for (int i = 0; i < aIterations; ++i) {
+    if (!TimeLaunch(params, warmResume, warmExit)) {
+      return 1;
+    }
+  }
+
+  gStdout << L"Launch latency over " << aIterations << L" launches (us)"
+          << EndLine
+          << L"                                     min      median"
+             L"         max" << EndLine << SetFixed(1);
+  PrintSummary(L"cold, until resumed", coldResume);
+  PrintSummary(L"cold, until exited", coldExit);
+  PrintSummary(L"warm, until resumed", warmResume);
+  PrintSummary(L"warm, until exited", warmExit);
+  return 0;
+}
+
+/**
+ * Runs a batch of aCommands no-op commands at each number of slots from one up
+ * to the number of eligible processors, doubling each time.
+ */
+int
+BenchBatch(int aCommands)
+{
+  std::wstring noop;
+  LaunchSession session;
+  if (!GetNoopPath(noop) || !session.Init()) {
+    return 1;
+  }
+  CpuSet const& eligible = session.Eligible();
+
+  // A response file is just a temporary UTF-8 file that cleans up after
+  // itself
+  std::wstring lines;
+  for (int i = 0; i < aCommands; ++i) {
+    lines += L"\"" + noop + L"\"\n";
+  }
+  ResponseFile batchFile;
+  if (!batchFile.Write(lines)) {
+    return 1;
+  }
+
+  // Each command's exit code would otherwise be reported to stderr; the
+  // children need inheritable handles
+  SECURITY_ATTRIBUTES inheritable = { sizeof(inheritable), nullptr, TRUE };
+  UniqueHandle nul(CreateFile(L"NUL", GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              &inheritable, OPEN_EXISTING, 0, nullptr));
+  if (nul.get() == INVALID_HANDLE_VALUE) {
+    nul.release();
+    gStderr << L"Unable to open NUL" << EndLine;
+    return 1;
+  }
+
+  gStdout << L"Batch throughput over " << aCommands << L" commands"
+          << EndLine
+          << L"     slots     seconds   launches/s" << EndLine
+          << SetFixed(3);
+
+  size_t const maxSlots = eligible.Count();
+  for (size_t slots = 1; slots <= maxSlots;
+       slots = slots < maxSlots && slots * 2 > maxSlots ? maxSlots :
+                                                          slots * 2) {
+    Options options;
+    options.mBatchFile = batchFile.Path().c_str();
+    options.mSlots = slots;
+
+    HANDLE const stdErr = GetStdHandle(STD_ERROR_HANDLE);
+    SetStdHandle(STD_ERROR_HANDLE, nul.get());
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    int const result = RunBatch(session, options, eligible);
+    QueryPerformanceCounter(&end);
+    gStderr << Flush;
+    SetStdHandle(STD_ERROR_HANDLE, stdErr);
+
+    if (result) {
+      gStderr << L"The batch at " << slots << L" slots failed with code "
+              << result << EndLine;
+      return 1;
+    }
+
+    double const seconds = ElapsedUs(start, end) / 1000000.0;
+    gStdout << SetWidth(10) << slots << SetWidth(12) << seconds
+            << SetWidth(13) << aCommands / seconds << EndLine;
+
+    if (slots == maxSlots) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Builds a topology of aGroups groups of aCoresPerGroup cores with
+ * aThreadsPerCore logical processors each, an L3 cache for every
+ * aCoresPerL3 cores and a NUMA node for every group.
+ */
+bool
+InitSimulatedTopology(WORD aGroups, BYTE aCoresPerGroup,
+                      BYTE aThreadsPerCore, BYTE aCoresPerL3,
+                      Topology& aTopology)
+{
+  // Records are kept 8 byte aligned, as the system returns them
+  std::vector<ULONGLONG> records;
+  DWORD length = 0;
+  auto append = [&](LOGICAL_PROCESSOR_RELATIONSHIP aRelationship,
+                    DWORD aSize) {
+    aSize = (aSize + 7) & ~7;
+    records.resize((length + aSize) / 8);
+    auto info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(
+                  reinterpret_cast<char*>(records.data()) + length);
+    info->Relationship = aRelationship;
+    info->Size = aSize;
+    length += aSize;
+    return info;
+  };
+
+  BYTE const perGroup = aCoresPerGroup * aThreadsPerCore;
+  KAFFINITY const groupMask = perGroup >= 64 ? ~static_cast<KAFFINITY>(0) :
+                              (static_cast<KAFFINITY>(1) << perGroup) - 1;
+  KAFFINITY const coreMask = (static_cast<KAFFINITY>(1) << aThreadsPerCore) -
+                             1;
+
+  auto groups = append(RelationGroup,
+                       sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX) +
+                       (aGroups - 1) * sizeof(PROCESSOR_GROUP_INFO));
+  groups->Group.MaximumGroupCount = aGroups;
+  groups->Group.ActiveGroupCount = aGroups;
+  for (WORD group = 0; group < aGroups; ++group) {
+    PROCESSOR_GROUP_INFO& info = groups->Group.GroupInfo[group];
+    info.MaximumProcessorCount = perGroup;
+    info.ActiveProcessorCount = perGroup;
+    info.ActiveProcessorMask = groupMask;
+  }
+
+  for (WORD group = 0; group < aGroups; ++group) {
+    for (BYTE core = 0; core < aCoresPerGroup; ++core) {
+      auto info = append(RelationProcessorCore,
+                         sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX));
+      info->Processor.Flags = aThreadsPerCore > 1 ? LTP_PC_SMT : 0;
+      info->Processor.GroupCount = 1;
+      info->Processor.GroupMask[0].Group = group;
+      info->Processor.GroupMask[0].Mask = coreMask <<
+                                          (core * aThreadsPerCore);
+    }
+
+    for (BYTE core = 0; core < aCoresPerGroup; core += aCoresPerL3) {
+      BYTE const threads = aCoresPerL3 * aThreadsPerCore;
+      auto info = append(RelationCache,
+                         sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX));
+      info->Cache.Level = 3;
+      info->Cache.CacheSize = 32 * 1024 * 1024;
+      info->Cache.Type = CacheUnified;
+      info->Cache.GroupMask.Group = group;
+      info->Cache.GroupMask.Mask =
+        (threads >= 64 ? ~static_cast<KAFFINITY>(0) :
+                         (static_cast<KAFFINITY>(1) << threads) - 1) <<
+        (core * aThreadsPerCore);
+    }
+
+    auto node = append(RelationNumaNode,
+                       sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX));
+    node->NumaNode.NodeNumber = group;
+    node->NumaNode.GroupMask.Group = group;
+    node->NumaNode.GroupMask.Mask = groupMask;
+  }
+
+  return aTopology.InitFromInformation(records.data(), length);
+}
+
+int
+BenchSelect(int aIterations)
+{
+  struct
+  {
+    wchar_t const* mName;
+    WORD mGroups;
+    BYTE mCoresPerGroup;
+    BYTE mThreadsPerCore;
+    BYTE mCoresPerL3;
+  } const topologies[] = {
+    { L"16 CPUs, 1 group", 1, 8, 2, 8 },
+    { L"64 CPUs, 1 group", 1, 32, 2, 8 },
+    { L"256 CPUs, 4 groups", 4, 32, 2, 8 },
+    { L"256 CPUs, 8 groups, no SMT", 8, 32, 1, 16 },
+  };
+
+  struct
+  {
+    wchar_t const* mPlacement;
+    wchar_t const* mCpus;
+  } const requests[] = {
+    { L"first", L"1" },
+    { L"core,avoid-cpu0", L"1" },
+    { L"first", L"8cores@l3" },
+    { L"first", L"32@numa" },
+  };
+
+  gStdout << L"CPU selection over " << aIterations
+          << L" selections (ns per selection)" << EndLine << SetFixed(1);
+
+  for (auto const& simulated : topologies) {
+    Topology topology;
+    if (!InitSimulatedTopology(simulated.mGroups, simulated.mCoresPerGroup,
+                               simulated.mThreadsPerCore,
+                               simulated.mCoresPerL3, topology)) {
+      return 1;
+    }
+    CpuSet const eligible = topology.AllProcessors();
+
+    gStdout << simulated.mName << EndLine;
+    for (auto const& request : requests) {
+      PlacementPolicy policy;
+      CpuSpec spec;
+      if (!ParsePlacement(request.mPlacement, policy) ||
+          !ParseCpuSpec(request.mCpus, spec)) {
+        return 1;
+      }
+
+      std::wstring const name = std::wstring(request.mPlacement) +
+                                L" --cpus=" + request.mCpus;
+      if (!CanSatisfyAffinity(topology, eligible, policy, spec)) {
+        gStdout << L"  " << AlignLeft << SetWidth(28) << name << AlignRight
+                << SetWidth(12) << L"n/a" << EndLine;
+        continue;
+      }
+
+      LARGE_INTEGER start, end;
+      QueryPerformanceCounter(&start);
+      for (int i = 0; i < aIterations; ++i) {
+        CpuSet affinity;
+        if (!SelectAffinity(topology, eligible, policy, spec, affinity)) {
+          return 1;
+        }
+      }
+      QueryPerformanceCounter(&end);
+
+      gStdout << L"  " << AlignLeft << SetWidth(28) << name << AlignRight
+              << SetWidth(12) << ElapsedUs(start, end) * 1000.0 / aIterations
+              << EndLine;
+    }
+  }
+
+  return 0;
+}
+
+int
+BenchCommandLine(int aIterations)
+{
+  struct
+  {
+    wchar_t const* mName;
+    int mCount;
+    // Repeated to make up each argument
+    wchar_t const* mPattern;
+    size_t mLength;
+  } const shapes[] = {
+    { L"10 plain arguments", 10, L"abcdefgh", 16 },
+    { L"1000 plain arguments", 1000, L"abcdefgh", 24 },
+    { L"1000 with spaces", 1000, L"ab cd ef", 24 },
+    { L"500 with quotes", 500, L"a\\\\\"b c\\", 32 },
+  };
+
+  std::wstring const exePath(L"C:\\Program Files\\rununiproc\\noop.exe");
+
+  gStdout << L"Command line building over " << aIterations
+          << L" builds (us per build)" << EndLine << SetFixed(2);
+
+  for (auto const& shape : shapes) {
+    std::wstring arg;
+    while (arg.size() < shape.mLength) {
+      arg += shape.mPattern;
+    }
+    arg.resize(shape.mLength);
+
+    std::vector<std::wstring> args(shape.mCount, arg);
+    std::vector<wchar_t*> argv;
+    for (std::wstring& item : args) {
+      argv.push_back(&item[0]);
+    }
+
+    std::wstring cmdLine;
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < aIterations; ++i) {
+      if (!BuildCommandLine(exePath, shape.mCount, argv.data(), cmdLine)) {
+        return 1;
+      }
+    }
+    QueryPerformanceCounter(&end);
+
+    gStdout << L"  " << AlignLeft << SetWidth(28) << shape.mName
+            << AlignRight << SetWidth(12)
+            << ElapsedUs(start, end) / aIterations << L" ("
+            << cmdLine.size() << L" characters)" << EndLine;
+  }
+
+  return 0;
+}
+
+} // anonymous namespace
+
+int
+wmain(int argc, wchar_t* argv[])
+{
+  struct
+  {
+    wchar_t const* mName;
+    int (*mRun)(int);
+    int mDefaultCount;
+  } const benchmarks[] = {
+    { L"latency", BenchLatency, 100 },
+    { L"batch", BenchBatch, 256 },
+    { L"select", BenchSelect, 100000 },
+    { L"cmdline", BenchCommandLine, 1000 },
+  };
+
+  wchar_t const* only = argc > 1 ? argv[1] : nullptr;
+  int const count =
+    argc > 2 ? static_cast<int>(wcstol(argv[2], nullptr, 10)) : 0;
+  bool known = !only;
+  for (auto const& benchmark : benchmarks) {
+    known = known || !wcscmp(only, benchmark.mName);
+  }
+  if (!known || argc > 3 || (argc > 2 && count <= 0)) {
+    gStderr << L"Usage: " << argv[0]
+            << L" [latency|batch|select|cmdline] [count]" << EndLine;
+    return 1;
+  }
+
+  for (auto const& benchmark : benchmarks) {
+    if (only && wcscmp(only, benchmark.mName)) {
+      continue;
+    }
+    int const result = benchmark.mRun(count ? count :
+                                              benchmark.mDefaultCount);
+    if (result) {
+      return result;
+    }
+  }
+
+  return 0;
+}
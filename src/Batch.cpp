@@ -0,0 +1,462 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Batch.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <wchar.h>
+#include <windows.h>
+
+#include "CpuReservation.h"
+#include "CpuSelection.h"
+#include "CpuSets.h"
+#include "Isolation.h"
+#include "JobStats.h"
+#include "Launcher.h"
+#include "Output.h"
+#include "ProcessTree.h"
+#include "ProcessorLoad.h"
+#include "StdioRelay.h"
+#include "Timings.h"
+#include "TraceSession.h"
+#include "UniqueHandle.h"
+
+struct BatchEntry
+{
+  std::wstring mLine;
+  LaunchParams mParams;
+  DWORD mExitCode = 1;
+  // When the child was resumed, for --stats
+  LONGLONG mStartTime = 0;
+};
+
+/**
+ * Reads aPath (or stdin when aPath is "-") as UTF-8 and returns its non-blank
+ * lines, skipping those that begin with '#'.
+ */
+static bool
+ReadBatchFile(wchar_t const* aPath, std::vector<std::wstring>& aLines)
+{
+  UniqueHandle file;
+  HANDLE input;
+  if (!wcscmp(aPath, L"-")) {
+    input = GetStdHandle(STD_INPUT_HANDLE);
+  } else {
+    file.reset(CreateFile(aPath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (file.get() == INVALID_HANDLE_VALUE) {
+      file.release();
+      DWORD err = GetLastError();
+      gStderr << L"Unable to open batch file \"" << aPath
+              << L"\", error code " << err << EndLine;
+      return false;
+    }
+    input = file.get();
+  }
+
+  std::string bytes;
+  char buf[4096];
+  DWORD bytesRead;
+  while (ReadFile(input, buf, sizeof(buf), &bytesRead, nullptr) && bytesRead) {
+    bytes.append(buf, bytesRead);
+  }
+
+  // Skip a UTF-8 byte order mark
+  size_t start = 0;
+  if (!bytes.compare(0, 3, "\xEF\xBB\xBF")) {
+    start = 3;
+  }
+
+  std::wstring text;
+  if (bytes.size() > start) {
+    int srcLen = static_cast<int>(bytes.size() - start);
+    int len = MultiByteToWideChar(CP_UTF8, 0, bytes.data() + start, srcLen,
+                                  nullptr, 0);
+    if (!len) {
+      DWORD err = GetLastError();
+      gStderr << L"Batch file is not valid UTF-8, error code " << err
+              << EndLine;
+      return false;
+    }
+    text.resize(len);
+    MultiByteToWideChar(CP_UTF8, 0, bytes.data() + start, srcLen, &text[0],
+                        len);
+  }
+
+  wchar_t const kWhitespace[] = L" \t\r";
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find(L'\n', pos);
+    if (end == std::wstring::npos) {
+      end = text.size();
+    }
+
+    std::wstring line(text, pos, end - pos);
+    pos = end + 1;
+
+    size_t first = line.find_first_not_of(kWhitespace);
+    if (first == std::wstring::npos || line[first] == L'#') {
+      continue;
+    }
+    size_t last = line.find_last_not_of(kWhitespace);
+    aLines.push_back(line.substr(first, last - first + 1));
+  }
+
+  return true;
+}
+
+/**
+ * Splits a batch line into the program to launch and the verbatim remainder
+ * of the line, which becomes the program's arguments.
+ */
+static void
+SplitBatchLine(std::wstring const& aLine, std::wstring& aProgram,
+               std::wstring& aArgs)
+{
+  size_t end;
+  if (aLine[0] == L'"') {
+    end = aLine.find(L'"', 1);
+    aProgram = aLine.substr(1, end == std::wstring::npos ? end : end - 1);
+    if (end != std::wstring::npos) {
+      ++end;
+    }
+  } else {
+    end = aLine.find_first_of(L" \t");
+    aProgram = aLine.substr(0, end);
+  }
+
+  size_t argsStart = end == std::wstring::npos ? end :
+                     aLine.find_first_not_of(L" \t", end);
+  aArgs = argsStart == std::wstring::npos ? std::wstring() :
+          aLine.substr(argsStart);
+}
+
+static bool
+PrepareEntry(BatchEntry& aEntry, PathCache* aCache)
+{
+  std::wstring program, args;
+  SplitBatchLine(aEntry.mLine, program, args);
+  if (!ResolveExecutable(program.c_str(), aEntry.mParams.mExePath, aCache)) {
+    return false;
+  }
+
+  // Batch lines are command lines already, so their arguments are passed on
+  // as written
+  std::wstring& cmdLine = aEntry.mParams.mCmdLine;
+  cmdLine.clear();
+  cmdLine.reserve(aEntry.mParams.mExePath.size() + 3 + args.size());
+  cmdLine += L'"';
+  cmdLine += aEntry.mParams.mExePath;
+  cmdLine += L'"';
+  if (!args.empty()) {
+    cmdLine += L' ';
+    cmdLine += args;
+  }
+
+  if (cmdLine.size() >= kMaxCommandLineLen) {
+    gStderr << L"Command line is too long for CreateProcess" << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * A worker slot: a processor that successive batch commands are pinned to, so
+ * that each command inherits a cache warmed by its predecessor.
+ */
+struct Slot
+{
+  CpuSet mAffinity;
+  CpuSet mOccupied;
+  PinnedChild mChild;
+  size_t mEntry = 0;
+  bool mBusy = false;
+};
+
+int
+RunBatch(LaunchSession& aSession, Options const& aOptions,
+         CpuSet const& aEligible)
+{
+  Topology const& topology = aSession.GetTopology();
+
+  std::vector<std::wstring> lines;
+  if (!ReadBatchFile(aOptions.mBatchFile, lines)) {
+    return 1;
+  }
+
+  if (lines.empty()) {
+    gStderr << L"Batch contains no commands." << EndLine;
+    return 1;
+  }
+
+  PathCache* pathCache = aOptions.mPathCache ? aSession.GetPathCache() :
+                         nullptr;
+
+  // By default, run everything at once if there are enough processors, and
+  // otherwise run as many slots as the eligible processors can accommodate.
+  size_t const maxSlots = aOptions.mSlots ? aOptions.mSlots : lines.size();
+
+  UniqueHandle port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0,
+                                           1));
+  if (!port) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateIoCompletionPort failed with error code " << err
+            << EndLine;
+    return 1;
+  }
+
+  // The claims live until we return, while the session keeps the table
+  // itself open for later launches
+  CpuReservation* reservation = nullptr;
+  ClaimReleaser releaser;
+  if (aOptions.mReserve) {
+    reservation = aSession.GetReservation();
+    releaser.mReservation = reservation;
+    if (!reservation) {
+      return 1;
+    }
+  }
+
+  // Sample once up front rather than once per slot
+  PlacementPolicy const& policy = aOptions.mPlacement;
+  ProcessorLoad load;
+  if (policy.mLoadWindowMs &&
+      !load.Sample(topology, policy.mLoadWindowMs)) {
+    return 1;
+  }
+
+  std::vector<Slot> slots;
+  CpuSet available(aEligible);
+  while (slots.size() < maxSlots) {
+    if (!aOptions.mSlots && !slots.empty() &&
+        !CanSatisfyAffinity(topology, available, policy, aOptions.mCpus)) {
+      break;
+    }
+
+    Slot slot;
+    if (aOptions.mReserve && slots.empty()) {
+      if (!reservation->SelectAndClaim(topology, available, policy,
+                                      aOptions.mCpus, slot.mAffinity,
+                                      &load)) {
+        return 1;
+      }
+    } else if (aOptions.mReserve) {
+      // Waiting while holding claims could deadlock against another batch
+      // doing the same, so only the first slot may wait for processors.
+      bool claimed;
+      if (!reservation->TrySelectAndClaim(topology, available, policy,
+                                         aOptions.mCpus, slot.mAffinity,
+                                         claimed, &load)) {
+        return 1;
+      }
+      if (!claimed) {
+#if defined(DEBUG)
+        gStdout << L"No more unreserved CPUs; running " << slots.size()
+                << L" slots" << EndLine;
+#endif
+        break;
+      }
+    } else if (!SelectAffinity(topology, available, policy, aOptions.mCpus,
+                               slot.mAffinity, &load)) {
+      return 1;
+    }
+
+    slot.mOccupied = OccupiedProcessors(topology, policy, slot.mAffinity);
+    slot.mOccupied.ForEach([&](PROCESSOR_NUMBER const& aOccupied) {
+      available.Remove(aOccupied);
+    });
+    slots.push_back(std::move(slot));
+  }
+
+  CpuSet reserved;
+  for (Slot const& slot : slots) {
+    reserved |= slot.mAffinity;
+  }
+
+  CpuSetReservation cpuSetReservation;
+  if (aOptions.mReserveCpuSets && !aOptions.mIsolate &&
+      !cpuSetReservation.Apply(reserved)) {
+    return 1;
+  }
+
+  Isolation isolation;
+  if (aOptions.mIsolate && !isolation.Apply(topology, reserved)) {
+    return 1;
+  }
+
+  // Each child's output is tagged with its index, like its exit code
+  StdioRelay relay;
+  if (aOptions.mRelay &&
+      !relay.Start(topology, reserved, aOptions.mRelayFile)) {
+    return 1;
+  }
+
+  std::vector<BatchEntry> entries(lines.size());
+  size_t nextEntry = 0;
+  size_t busySlots = 0;
+
+  // Launches queued commands into aSlotIndex until one starts or the queue
+  // runs dry.
+  auto startNext = [&](size_t aSlotIndex) {
+    Slot& slot = slots[aSlotIndex];
+    while (nextEntry < entries.size()) {
+      size_t index = nextEntry++;
+      BatchEntry& entry = entries[index];
+      entry.mLine = lines[index];
+
+      entry.mParams.mAffinity = slot.mAffinity;
+      entry.mParams.mBackend = aOptions.mBackend;
+      entry.mParams.mControls = aOptions.mControls;
+      if (aOptions.mNumaMemory) {
+        entry.mParams.mPreferredNode = PreferredNumaNode(topology,
+                                                         slot.mAffinity);
+      }
+      entry.mParams.mCompletionPort = port.get();
+      entry.mParams.mCompletionKey = aSlotIndex;
+
+      PinnedChild child;
+      RelayPipes pipes;
+      bool launched =
+        PrepareEntry(entry, pathCache) &&
+        (!aOptions.mRelay ||
+         relay.Connect(std::to_wstring(index), entry.mParams, pipes)) &&
+        CreatePinnedChild(entry.mParams, child);
+      pipes = RelayPipes();
+      if (launched) {
+        entry.mStartTime = StatsTimestamp();
+        launched = ResumeChild(child);
+      }
+      if (!launched) {
+        gStderr << L"[" << index << L"] not launched: " << entry.mLine
+                << EndLine;
+        continue;
+      }
+
+#if defined(DEBUG)
+      gStdout << L"[" << index << L"] pinned to CPUs "
+              << slot.mAffinity.ToString() << EndLine;
+#endif
+
+      slot.mChild = std::move(child);
+      slot.mEntry = index;
+      slot.mBusy = true;
+      ++busySlots;
+      return;
+    }
+  };
+
+  // Reports are collected so that a stats file holds all of them
+  std::wstring statsReport;
+
+  auto finish = [&](size_t aSlotIndex) {
+    gTimings.Mark(LaunchPhase::WaitWakeup);
+    Slot& slot = slots[aSlotIndex];
+    BatchEntry& entry = entries[slot.mEntry];
+    slot.mBusy = false;
+    --busySlots;
+    GetChildExitCode(slot.mChild, entry.mExitCode);
+    JobStats stats;
+    if (aOptions.mStats != StatsFormat::None &&
+        QueryJobStats(slot.mChild.mJob.get(), entry.mStartTime,
+                      StatsTimestamp(), stats)) {
+      statsReport += FormatJobStats(stats, aOptions.mStats, slot.mEntry,
+                                    entry.mLine.c_str());
+    }
+    slot.mChild = PinnedChild();
+    gStderr << L"[" << slot.mEntry << L"] exit code " << entry.mExitCode
+            << L": " << entry.mLine << EndLine;
+    gTimings.Mark(LaunchPhase::Exit);
+    startNext(aSlotIndex);
+  };
+
+  TraceSession trace;
+  if (aOptions.mTraceFile && !trace.Start(aOptions.mTraceFile)) {
+    return 1;
+  }
+
+  // With --wait-tree a slot is busy until every process in its job has
+  // exited; otherwise, or if the job cannot be queried, until the child
+  // itself has
+  auto isDone = [&](Slot const& aSlot) {
+    bool empty;
+    if (aOptions.mWaitTree && QueryJobEmpty(aSlot.mChild.mJob.get(), empty)) {
+      return empty;
+    }
+    return WaitForSingleObject(aSlot.mChild.mProcess.get(), 0) ==
+           WAIT_OBJECT_0;
+  };
+
+  for (size_t i = 0; i < slots.size(); ++i) {
+    startNext(i);
+  }
+
+  while (busySlots) {
+    DWORD message;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped;
+    if (!GetQueuedCompletionStatus(port.get(), &message, &key, &overlapped,
+                                   kJobPollIntervalMs)) {
+      if (overlapped || GetLastError() != WAIT_TIMEOUT) {
+        DWORD err = GetLastError();
+        gStderr << L"GetQueuedCompletionStatus failed with error code "
+                << err << EndLine;
+        return 1;
+      }
+
+      for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i].mBusy && isDone(slots[i])) {
+          finish(i);
+        }
+      }
+      continue;
+    }
+
+    if (aOptions.mWaitTree) {
+      // A slot's previous job may have been found empty by polling before its
+      // notification arrived, so check that it is really the current job
+      if (message == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO &&
+          key < slots.size() && slots[key].mBusy && isDone(slots[key])) {
+        WaitForSingleObject(slots[key].mChild.mProcess.get(), INFINITE);
+        finish(key);
+      }
+      continue;
+    }
+
+    // For process messages, the "overlapped" pointer is really the pid. Stale
+    // messages from a slot's previous job are weeded out by the pid check.
+    DWORD pid = static_cast<DWORD>(reinterpret_cast<ULONG_PTR>(overlapped));
+    if ((message == JOB_OBJECT_MSG_EXIT_PROCESS ||
+         message == JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS) &&
+        key < slots.size() && slots[key].mBusy &&
+        slots[key].mChild.mPid == pid) {
+      // The notification can beat the process handle being signalled
+      WaitForSingleObject(slots[key].mChild.mProcess.get(), INFINITE);
+      finish(key);
+    }
+  }
+
+  relay.Stop();
+  trace.Stop();
+
+  if (aOptions.mIsolate && isolation.Stop()) {
+    statsReport += isolation.FormatReport(aOptions.mStats);
+  }
+  if (!statsReport.empty()) {
+    WriteStatsReport(aOptions.mStatsFile, statsReport);
+  }
+
+  for (BatchEntry const& entry : entries) {
+    if (entry.mExitCode) {
+      return static_cast<int>(entry.mExitCode);
+    }
+  }
+
+  return 0;
+}
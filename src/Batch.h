@@ -0,0 +1,28 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Batch_h
+#define rununiproc_Batch_h
+
+#include "CpuSet.h"
+#include "Options.h"
+#include "Session.h"
+
+/**
+ * Runs every command line listed in aOptions.mBatchFile, each in its own job,
+ * and reports the exit code of each child to stderr. Commands are queued onto
+ * aOptions.mSlots worker slots (by default, as many as there are commands or
+ * as fit on the eligible processors, whichever is fewer), each pinned to its
+ * own processors from aEligible as described by aOptions.mCpus; a slot starts
+ * its next command as soon as its current one exits. The path cache and
+ * reservation table are aSession's. Returns the exit code for rununiproc
+ * itself: zero if every child succeeded, otherwise the first failure in batch
+ * order.
+ */
+int RunBatch(LaunchSession& aSession, Options const& aOptions,
+             CpuSet const& aEligible);
+
+#endif // rununiproc_Batch_h
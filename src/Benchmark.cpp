@@ -0,0 +1,387 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <wchar.h>
+
+#include "JobStats.h"
+#include "Output.h"
+#include "ProcessTree.h"
+#include "Timings.h"
+
+namespace {
+
+struct RunSample
+{
+  // From the start of the run until the child's main thread was resumed
+  double mLaunchMs;
+  double mWallMs;
+  double mCpuMs;
+};
+
+struct Summary
+{
+  double mMin = 0.0;
+  double mMedian = 0.0;
+  double mP95 = 0.0;
+  double mMean = 0.0;
+  double mStdDev = 0.0;
+};
+
+/**
+ * Returns the aFraction quantile of the sorted aValues, interpolating between
+ * neighbouring values.
+ */
+double
+Quantile(std::vector<double> const& aValues, double aFraction)
+{
+  double const position = aFraction * (aValues.size() - 1);
+  size_t const lower = static_cast<size_t>(position);
+  if (lower + 1 >= aValues.size()) {
+    return aValues.back();
+  }
+  double const weight = position - lower;
+  return aValues[lower] * (1.0 - weight) + aValues[lower + 1] * weight;
+}
+
+Summary
+Summarize(std::vector<double> aValues)
+{
+  Summary result;
+  if (aValues.empty()) {
+    return result;
+  }
+
+  std::sort(aValues.begin(), aValues.end());
+  result.mMin = aValues.front();
+  result.mMedian = Quantile(aValues, 0.5);
+  result.mP95 = Quantile(aValues, 0.95);
+
+  double sum = 0.0;
+  for (double value : aValues) {
+    sum += value;
+  }
+  result.mMean = sum / aValues.size();
+
+  if (aValues.size() > 1) {
+    double squares = 0.0;
+    for (double value : aValues) {
+      squares += (value - result.mMean) * (value - result.mMean);
+    }
+    result.mStdDev = std::sqrt(squares / (aValues.size() - 1));
+  }
+
+  return result;
+}
+
+/**
+ * Removes the samples whose wall time lies more than 1.5 interquartile ranges
+ * outside the first or third quartile. Returns the number removed.
+ */
+size_t
+DropOutliers(std::vector<RunSample>& aSamples)
+{
+  if (aSamples.size() < 4) {
+    return 0;
+  }
+
+  std::vector<double> wall;
+  for (RunSample const& sample : aSamples) {
+    wall.push_back(sample.mWallMs);
+  }
+  std::sort(wall.begin(), wall.end());
+
+  double const q1 = Quantile(wall, 0.25);
+  double const q3 = Quantile(wall, 0.75);
+  double const low = q1 - 1.5 * (q3 - q1);
+  double const high = q3 + 1.5 * (q3 - q1);
+
+  size_t const before = aSamples.size();
+  aSamples.erase(std::remove_if(aSamples.begin(), aSamples.end(),
+                                [&](RunSample const& aSample) {
+                                  return aSample.mWallMs < low ||
+                                         aSample.mWallMs > high;
+                                }),
+                 aSamples.end());
+  return before - aSamples.size();
+}
+
+std::wstring
+FormatSummary(SummaryFormat aFormat, std::vector<RunSample> const& aSamples,
+              size_t aDropped)
+{
+  std::vector<double> launch;
+  std::vector<double> wall;
+  std::vector<double> cpu;
+  for (RunSample const& sample : aSamples) {
+    launch.push_back(sample.mLaunchMs);
+    wall.push_back(sample.mWallMs);
+    cpu.push_back(sample.mCpuMs);
+  }
+
+  struct
+  {
+    wchar_t const* mName;
+    Summary mSummary;
+  } const metrics[] = {
+    { L"launch_ms", Summarize(launch) },
+    { L"wall_ms", Summarize(wall) },
+    { L"cpu_ms", Summarize(cpu) },
+  };
+
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  switch (aFormat) {
+    case SummaryFormat::Csv:
+      stream << L"metric,runs,dropped,min,median,p95,mean,stddev\n";
+      for (auto const& metric : metrics) {
+        Summary const& s = metric.mSummary;
+        stream << metric.mName << L',' << aSamples.size() << L','
+               << aDropped << L',' << s.mMin << L',' << s.mMedian << L','
+               << s.mP95 << L',' << s.mMean << L',' << s.mStdDev << L"\n";
+      }
+      break;
+    case SummaryFormat::Json:
+      stream << L"{\"runs\":" << aSamples.size() << L",\"dropped\":"
+             << aDropped;
+      for (auto const& metric : metrics) {
+        Summary const& s = metric.mSummary;
+        stream << L",\"" << metric.mName << L"\":{\"min\":" << s.mMin
+               << L",\"median\":" << s.mMedian << L",\"p95\":" << s.mP95
+               << L",\"mean\":" << s.mMean << L",\"stddev\":" << s.mStdDev
+               << L'}';
+      }
+      stream << L",\"samples\":[";
+      for (size_t i = 0; i < aSamples.size(); ++i) {
+        stream << (i ? L"," : L"") << L"{\"launch_ms\":"
+               << aSamples[i].mLaunchMs << L",\"wall_ms\":"
+               << aSamples[i].mWallMs << L",\"cpu_ms\":"
+               << aSamples[i].mCpuMs << L'}';
+      }
+      stream << L"]}\n";
+      break;
+    default:
+      stream << aSamples.size() << L" runs";
+      if (aDropped) {
+        stream << L" (" << aDropped << L" outliers dropped)";
+      }
+      stream << L"\n";
+      stream << L"              min      median         p95        mean"
+                L"      stddev\n";
+      for (auto const& metric : metrics) {
+        Summary const& s = metric.mSummary;
+        stream << AlignLeft << SetWidth(10) << metric.mName << AlignRight
+               << SetWidth(12) << s.mMin << SetWidth(12) << s.mMedian
+               << SetWidth(12) << s.mP95 << SetWidth(12) << s.mMean
+               << SetWidth(12) << s.mStdDev << L"\n";
+      }
+      break;
+  }
+
+  return stream.str();
+}
+
+/**
+ * Children for upcoming runs, each already created suspended in its own
+ * pinned job, so that a run only has to resume one. Children still in the
+ * pool when it is destroyed are killed along with their jobs.
+ */
+class ChildPool
+{
+public:
+  ChildPool(LaunchParams const& aParams, StdioRelay* aRelay)
+    : mParams(aParams)
+    , mRelay(aRelay)
+  {
+  }
+
+  ~ChildPool()
+  {
+    for (Entry& entry : mEntries) {
+      TerminateJobObject(entry.mChild.mJob.get(), 1);
+    }
+  }
+
+  ChildPool(ChildPool const&) = delete;
+  ChildPool& operator=(ChildPool const&) = delete;
+
+  /**
+   * Creates children until aCount are waiting. Reports any failure to stderr
+   * and returns false.
+   */
+  bool Fill(size_t aCount)
+  {
+    while (mEntries.size() < aCount) {
+      mEntries.emplace_back();
+      if (!Create(mEntries.back())) {
+        mEntries.pop_back();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Hands out the oldest waiting child, creating one if none is waiting,
+   * along with the key that its job posts its messages under. Reports any
+   * failure to stderr and returns false.
+   */
+  bool Take(PinnedChild& aChild, ULONG_PTR& aCompletionKey)
+  {
+    if (!Fill(1)) {
+      return false;
+    }
+    aChild = std::move(mEntries.front().mChild);
+    aCompletionKey = mEntries.front().mCompletionKey;
+    mEntries.pop_front();
+    return true;
+  }
+
+private:
+  struct Entry
+  {
+    PinnedChild mChild;
+    ULONG_PTR mCompletionKey = 0;
+  };
+
+  bool Create(Entry& aEntry)
+  {
+    // Each child's job posts under its own key, so that a late notification
+    // from an earlier run cannot end a later one
+    LaunchParams params = mParams;
+    params.mCompletionKey = ++mLastKey;
+
+    RelayPipes pipes;
+    if (mRelay && !mRelay->Connect(std::wstring(), params, pipes)) {
+      return false;
+    }
+
+    // The child has its own copies of the pipes once it exists
+    aEntry.mCompletionKey = params.mCompletionKey;
+    return CreatePinnedChild(params, aEntry.mChild);
+  }
+
+  LaunchParams const& mParams;
+  StdioRelay* mRelay;
+  std::deque<Entry> mEntries;
+  ULONG_PTR mLastKey = 0;
+};
+
+} // anonymous namespace
+
+bool
+ParseSummaryFormat(wchar_t const* aSpec, SummaryFormat& aFormat)
+{
+  if (!wcscmp(aSpec, L"text")) {
+    aFormat = SummaryFormat::Text;
+  } else if (!wcscmp(aSpec, L"csv")) {
+    aFormat = SummaryFormat::Csv;
+  } else if (!wcscmp(aSpec, L"json")) {
+    aFormat = SummaryFormat::Json;
+  } else {
+    gStderr << L"Unknown summary format \"" << aSpec << L"\""
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+int
+RunRepeated(RepeatOptions const& aOptions, LaunchParams const& aParams,
+            wchar_t const* aReportPath, StdioRelay* aRelay)
+{
+  std::vector<RunSample> samples;
+  samples.reserve(aOptions.mRuns);
+
+  size_t const totalRuns = aOptions.mWarmup + aOptions.mRuns;
+  // The executable and command line were resolved once, up front; each run
+  // only pays for its own job and process, or with a pool, not even that
+  ChildPool pool(aParams, aRelay);
+  for (size_t run = 0; run < totalRuns; ++run) {
+    // Topped up between runs, so that creating children neither delays a
+    // run's launch nor competes with a run in progress
+    if (!pool.Fill(std::min(aOptions.mPrewarm, totalRuns - run))) {
+      return 1;
+    }
+
+    LONGLONG const launchTime = StatsTimestamp();
+    PinnedChild child;
+    ULONG_PTR completionKey;
+    if (!pool.Take(child, completionKey)) {
+      return 1;
+    }
+
+    LONGLONG const startTime = StatsTimestamp();
+    if (!ResumeChild(child)) {
+      return 1;
+    }
+    LONGLONG const resumeTime = StatsTimestamp();
+
+    if (aParams.mCompletionPort &&
+        !WaitForEmptyJob(child.mJob.get(), aParams.mCompletionPort,
+                         completionKey, nullptr)) {
+      return 1;
+    }
+
+    if (WaitForSingleObject(child.mProcess.get(), INFINITE) !=
+        WAIT_OBJECT_0) {
+      DWORD err = GetLastError();
+      gStderr << L"WaitForSingleObject failed with error code " << err
+              << EndLine;
+      return 1;
+    }
+    LONGLONG const endTime = StatsTimestamp();
+    gTimings.Mark(LaunchPhase::WaitWakeup);
+
+    DWORD exitCode = 0;
+    GetChildExitCode(child, exitCode);
+    gTimings.Mark(LaunchPhase::Exit);
+    if (exitCode) {
+      gStderr << L"Run " << run << L" exited with code " << exitCode
+              << EndLine;
+      return static_cast<int>(exitCode);
+    }
+
+    JobStats stats;
+    if (!QueryJobStats(child.mJob.get(), startTime, endTime, stats)) {
+      return 1;
+    }
+
+    if (run < aOptions.mWarmup) {
+      continue;
+    }
+
+    JOBOBJECT_BASIC_ACCOUNTING_INFORMATION const& basic =
+      stats.mAccounting.BasicInfo;
+    RunSample sample;
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    sample.mLaunchMs = static_cast<double>(resumeTime - launchTime) * 1000.0 /
+                       static_cast<double>(frequency.QuadPart);
+    sample.mWallMs = stats.mWallMs;
+    sample.mCpuMs = static_cast<double>(basic.TotalUserTime.QuadPart +
+                                        basic.TotalKernelTime.QuadPart) /
+                    10000.0;
+    samples.push_back(sample);
+  }
+
+  size_t dropped = aOptions.mDropOutliers ? DropOutliers(samples) : 0;
+  if (!WriteStatsReport(aReportPath,
+                        FormatSummary(aOptions.mFormat, samples, dropped))) {
+    return 1;
+  }
+
+  return 0;
+}
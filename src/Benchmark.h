@@ -0,0 +1,59 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Benchmark_h
+#define rununiproc_Benchmark_h
+
+#include <stddef.h>
+
+#include "Launcher.h"
+#include "StdioRelay.h"
+
+enum class SummaryFormat
+{
+  Text,
+  Csv,
+  Json
+};
+
+/**
+ * How to repeat a command, as specified by --repeat and friends.
+ */
+struct RepeatOptions
+{
+  // The number of measured runs; zero runs the command once, unmeasured
+  size_t mRuns = 0;
+  // Runs to discard before measuring, to warm caches and the file system
+  size_t mWarmup = 0;
+  // Discard measured runs whose wall time lies outside Tukey's fences
+  bool mDropOutliers = false;
+  // Children to keep created, suspended and pinned ahead of their runs, so
+  // that starting a run only resumes one
+  size_t mPrewarm = 0;
+  SummaryFormat mFormat = SummaryFormat::Text;
+};
+
+/**
+ * Parses a --summary= value: text, csv or json. Reports any failure to stderr
+ * and returns false.
+ */
+bool ParseSummaryFormat(wchar_t const* aSpec, SummaryFormat& aFormat);
+
+/**
+ * Launches aParams aOptions.mWarmup + aOptions.mRuns times in succession, each
+ * run in a fresh job on the same processors, and then writes a summary of the
+ * measured runs' launch, wall clock and CPU times to aReportPath, or to stderr
+ * if it is null. Stops at the first run that fails. Returns the exit code for
+ * rununiproc itself: zero if every run succeeded, otherwise the exit code of
+ * the failing run. When aParams has a completion port, each run lasts until
+ * every process in its job has exited. When aRelay is given, every run's
+ * output is relayed through it. With aOptions.mPrewarm, the children for the
+ * next runs are created between runs rather than when each run starts.
+ */
+int RunRepeated(RepeatOptions const& aOptions, LaunchParams const& aParams,
+                wchar_t const* aReportPath, StdioRelay* aRelay = nullptr);
+
+#endif // rununiproc_Benchmark_h
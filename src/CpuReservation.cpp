@@ -0,0 +1,262 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CpuReservation.h"
+
+#include "Output.h"
+
+// Windows supports at most 32 processor groups
+static WORD const kMaxGroups = 32;
+static DWORD const kRetryIntervalMs = 50;
+
+// Bump the version suffix whenever the layout of Table changes. The global
+// table is preferred, so that launches in every session see each other's
+// claims, but creating it needs SeCreateGlobalPrivilege.
+static wchar_t const* const kSectionNames[] = {
+  L"Global\\rununiproc.CpuReservations.1",
+  L"Local\\rununiproc.CpuReservations.1"
+};
+
+struct CpuReservation::Table
+{
+  // Zero when free, otherwise the owner's token. Sections are zero-filled
+  // when created, so no initialization is necessary.
+  LONG64 volatile mOwners[kMaxGroups * MAXIMUM_PROC_PER_GROUP];
+};
+
+/**
+ * Tokens combine the owner's pid with the low half of its creation time so
+ * that a recycled pid is not mistaken for the original owner.
+ */
+bool
+CpuReservation::GetOwnerToken(HANDLE aProcess, DWORD aPid, LONG64& aToken)
+{
+  FILETIME creationTime, exitTime, kernelTime, userTime;
+  if (!GetProcessTimes(aProcess, &creationTime, &exitTime, &kernelTime,
+                       &userTime)) {
+    return false;
+  }
+
+  aToken = static_cast<LONG64>(
+    (static_cast<ULONGLONG>(creationTime.dwLowDateTime) << 32) | aPid);
+  return true;
+}
+
+CpuReservation::~CpuReservation()
+{
+  Release();
+}
+
+bool
+CpuReservation::Open()
+{
+  if (!GetOwnerToken(GetCurrentProcess(), GetCurrentProcessId(), mToken)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetProcessTimes failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  for (wchar_t const* name : kSectionNames) {
+    mSection.reset(CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                     PAGE_READWRITE, 0, sizeof(Table), name));
+    if (mSection || GetLastError() != ERROR_ACCESS_DENIED) {
+      break;
+    }
+  }
+  if (!mSection) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to open CPU reservation table, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  mTable.reset(reinterpret_cast<Table*>(
+    MapViewOfFile(mSection.get(), FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Table))));
+  if (!mTable) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to map CPU reservation table, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+LONG64 volatile*
+CpuReservation::SlotFor(Table* aTable, PROCESSOR_NUMBER const& aCpu)
+{
+  if (aCpu.Group >= kMaxGroups) {
+    return nullptr;
+  }
+  return &aTable->mOwners[aCpu.Group * MAXIMUM_PROC_PER_GROUP + aCpu.Number];
+}
+
+bool
+CpuReservation::IsOwnerAlive(LONG64 aToken)
+{
+  DWORD pid = static_cast<DWORD>(aToken & 0xFFFFFFFF);
+  UniqueHandle process(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION |
+                                   SYNCHRONIZE, FALSE, pid));
+  if (!process) {
+    // If we may not look at it, it exists; err on the side of leaving the
+    // claim alone.
+    return GetLastError() != ERROR_INVALID_PARAMETER;
+  }
+
+  if (WaitForSingleObject(process.get(), 0) == WAIT_OBJECT_0) {
+    return false;
+  }
+
+  LONG64 token;
+  return !GetOwnerToken(process.get(), pid, token) || token == aToken;
+}
+
+void
+CpuReservation::RemoveClaimed(CpuSet& aSet)
+{
+  CpuSet candidates(aSet);
+  candidates.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    LONG64 volatile* slot = SlotFor(mTable.get(), aCpu);
+    if (!slot) {
+      return;
+    }
+
+    LONG64 owner = *slot;
+    if (!owner) {
+      return;
+    }
+
+    if (owner != mToken && !IsOwnerAlive(owner)) {
+      // Only reclaim the slot if it still belongs to the dead owner
+      InterlockedCompareExchange64(slot, 0, owner);
+      if (!*slot) {
+        return;
+      }
+    }
+
+    aSet.Remove(aCpu);
+  });
+}
+
+bool
+CpuReservation::Claim(CpuSet const& aSet)
+{
+  CpuSet claimed;
+  bool ok = true;
+  aSet.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    if (!ok) {
+      return;
+    }
+    LONG64 volatile* slot = SlotFor(mTable.get(), aCpu);
+    if (slot && InterlockedCompareExchange64(slot, mToken, 0)) {
+      ok = false;
+      return;
+    }
+    claimed.Add(aCpu);
+  });
+
+  if (!ok) {
+    // Roll back the partial claim
+    claimed.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+      LONG64 volatile* slot = SlotFor(mTable.get(), aCpu);
+      if (slot) {
+        InterlockedCompareExchange64(slot, 0, mToken);
+      }
+    });
+    return false;
+  }
+
+  mClaimed |= claimed;
+  return true;
+}
+
+void
+CpuReservation::Release()
+{
+  Release(mClaimed);
+}
+
+void
+CpuReservation::Release(CpuSet const& aSet)
+{
+  if (!mTable) {
+    return;
+  }
+
+  CpuSet released(aSet);
+  released &= mClaimed;
+  released.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    LONG64 volatile* slot = SlotFor(mTable.get(), aCpu);
+    if (slot) {
+      InterlockedCompareExchange64(slot, 0, mToken);
+    }
+    mClaimed.Remove(aCpu);
+  });
+}
+
+bool
+CpuReservation::TrySelectAndClaim(Topology const& aTopology,
+                                  CpuSet const& aEligible,
+                                  PlacementPolicy const& aPolicy,
+                                  CpuSpec const& aCpuSpec,
+                                  CpuSet& aAffinity,
+                                  bool& aClaimed,
+                                  ProcessorLoad const* aLoad)
+{
+  aClaimed = false;
+
+  CpuSet available(aEligible);
+  RemoveClaimed(available);
+
+  // Another instance may claim part of our pick before we do; keep choosing
+  // from what is left until a claim sticks or nothing suitable is left.
+  while (CanSatisfyAffinity(aTopology, available, aPolicy, aCpuSpec)) {
+    if (!SelectAffinity(aTopology, available, aPolicy, aCpuSpec, aAffinity,
+                        aLoad)) {
+      return false;
+    }
+
+    if (Claim(OccupiedProcessors(aTopology, aPolicy, aAffinity))) {
+      aClaimed = true;
+      return true;
+    }
+
+    RemoveClaimed(available);
+  }
+
+  return true;
+}
+
+bool
+CpuReservation::SelectAndClaim(Topology const& aTopology,
+                               CpuSet const& aEligible,
+                               PlacementPolicy const& aPolicy,
+                               CpuSpec const& aCpuSpec,
+                               CpuSet& aAffinity,
+                               ProcessorLoad const* aLoad)
+{
+  // Report an impossible request now rather than waiting for it forever
+  if (!CanSatisfyAffinity(aTopology, aEligible, aPolicy, aCpuSpec)) {
+    return SelectAffinity(aTopology, aEligible, aPolicy, aCpuSpec, aAffinity);
+  }
+
+  for (;;) {
+    bool claimed;
+    if (!TrySelectAndClaim(aTopology, aEligible, aPolicy, aCpuSpec, aAffinity,
+                           claimed, aLoad)) {
+      return false;
+    }
+    if (claimed) {
+      return true;
+    }
+
+#if defined(DEBUG)
+    gStdout << L"All eligible CPUs are reserved; waiting" << EndLine;
+#endif
+    Sleep(kRetryIntervalMs);
+  }
+}
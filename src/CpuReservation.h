@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_CpuReservation_h
+#define rununiproc_CpuReservation_h
+
+#include <windows.h>
+
+#include "CpuSelection.h"
+#include "CpuSet.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+/**
+ * Coordinates CPU choices between rununiproc instances on the same machine.
+ *
+ * Every instance maps the same named section, which holds one owner slot per
+ * logical processor. It lives in the global namespace when the instance may
+ * create or open it there, so that every session shares it; otherwise it
+ * falls back to the instance's own session, and only coordinates with the
+ * instances there. A slot is claimed by compare-and-swapping it from zero to
+ * a token identifying the owning process, so no lock or daemon is needed.
+ * Claims are dropped when this object is destroyed, and claims held by
+ * processes that have since died are reclaimed by whichever instance next
+ * finds them.
+ */
+class CpuReservation
+{
+public:
+  CpuReservation() = default;
+  ~CpuReservation();
+
+  CpuReservation(CpuReservation const&) = delete;
+  CpuReservation& operator=(CpuReservation const&) = delete;
+
+  /**
+   * Opens (or creates) the shared reservation table. Reports any failure to
+   * stderr and returns false.
+   */
+  bool Open();
+
+  /**
+   * Chooses processors from aEligible as described by aCpuSpec and aPolicy
+   * that no other live instance has claimed, and claims them. When aPolicy
+   * asks for whole cores, every sibling of the chosen processors is claimed as
+   * well. Waits for claims to be released if nothing suitable is free. aLoad
+   * is passed through to SelectAffinity. Reports any failure to stderr and
+   * returns false.
+   */
+  bool SelectAndClaim(Topology const& aTopology, CpuSet const& aEligible,
+                      PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec,
+                      CpuSet& aAffinity, ProcessorLoad const* aLoad = nullptr);
+
+  /**
+   * Like SelectAndClaim, but never waits: when nothing suitable is free it
+   * sets aClaimed to false and returns true. Callers that already hold claims
+   * use this so that two instances can never each wait on the other's.
+   */
+  bool TrySelectAndClaim(Topology const& aTopology, CpuSet const& aEligible,
+                         PlacementPolicy const& aPolicy,
+                         CpuSpec const& aCpuSpec, CpuSet& aAffinity,
+                         bool& aClaimed,
+                         ProcessorLoad const* aLoad = nullptr);
+
+  /**
+   * Drops every claim that this object holds.
+   */
+  void Release();
+
+  /**
+   * Drops this object's claims on the members of aSet.
+   */
+  void Release(CpuSet const& aSet);
+
+  /**
+   * Tokens identify a process, aProcess with pid aPid, in shared memory in a
+   * way that survives pid reuse; they are never zero. Returns false if the
+   * process's creation time cannot be queried.
+   */
+  static bool GetOwnerToken(HANDLE aProcess, DWORD aPid, LONG64& aToken);
+
+  /**
+   * Returns false only when the process that aToken identifies has exited.
+   */
+  static bool IsOwnerAlive(LONG64 aToken);
+
+private:
+  struct Table;
+
+  static LONG64 volatile* SlotFor(Table* aTable, PROCESSOR_NUMBER const& aCpu);
+
+  /**
+   * Removes from aSet every processor claimed by a live instance.
+   */
+  void RemoveClaimed(CpuSet& aSet);
+
+  /**
+   * Atomically claims all of aSet, or nothing if any member is already taken.
+   */
+  bool Claim(CpuSet const& aSet);
+
+  UniqueHandle mSection;
+  MappedViewPtr<Table> mTable;
+  LONG64 mToken = 0;
+  CpuSet mClaimed;
+};
+
+#endif // rununiproc_CpuReservation_h
@@ -0,0 +1,600 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CpuSelection.h"
+
+#include "Output.h"
+#include "ProcessorLoad.h"
+
+#include <string>
+#include <vector>
+
+#include <wchar.h>
+
+static DWORD const kDefaultLoadWindowMs = 100;
+static DWORD const kMaxLoadWindowMs = 10000;
+
+static bool
+ParseIndex(wchar_t const* aText, int& aIndex)
+{
+  wchar_t* end = nullptr;
+  unsigned long value = wcstoul(aText, &end, 10);
+  if (end == aText || *end || value > 0xFFFF) {
+    return false;
+  }
+  aIndex = static_cast<int>(value);
+  return true;
+}
+
+bool
+ParsePlacement(wchar_t const* aSpec, PlacementPolicy& aPolicy)
+{
+  std::wstring spec(aSpec);
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t end = spec.find(L',', start);
+    if (end == std::wstring::npos) {
+      end = spec.size();
+    }
+
+    std::wstring term(spec, start, end - start);
+    if (term == L"first") {
+      // The default; nothing to refine
+    } else if (term == L"core") {
+      aPolicy.mWholeCore = true;
+    } else if (term == L"avoid-cpu0") {
+      aPolicy.mAvoidCpuZero = true;
+    } else if (!term.compare(0, 3, L"l3:")) {
+      if (!ParseIndex(term.c_str() + 3, aPolicy.mL3Domain)) {
+        gStderr << L"Invalid L3 domain in placement \"" << term << L"\""
+                << EndLine;
+        return false;
+      }
+    } else if (!term.compare(0, 5, L"numa:")) {
+      if (!ParseIndex(term.c_str() + 5, aPolicy.mNumaNode)) {
+        gStderr << L"Invalid NUMA node in placement \"" << term << L"\""
+                << EndLine;
+        return false;
+      }
+    } else if (term == L"idle") {
+      aPolicy.mLoadWindowMs = kDefaultLoadWindowMs;
+    } else if (!term.compare(0, 5, L"idle:")) {
+      int windowMs;
+      if (!ParseIndex(term.c_str() + 5, windowMs) || !windowMs ||
+          static_cast<DWORD>(windowMs) > kMaxLoadWindowMs) {
+        gStderr << L"Invalid sampling window in placement \"" << term
+                << L"\"" << EndLine;
+        return false;
+      }
+      aPolicy.mLoadWindowMs = windowMs;
+    } else {
+      gStderr << L"Unknown placement \"" << term << L"\"" << EndLine;
+      return false;
+    }
+
+    start = end + 1;
+  }
+
+  return true;
+}
+
+bool
+ParseCoreClass(wchar_t const* aSpec, CoreClass& aCoreClass)
+{
+  if (!wcscmp(aSpec, L"performance")) {
+    aCoreClass = CoreClass::Performance;
+  } else if (!wcscmp(aSpec, L"efficiency")) {
+    aCoreClass = CoreClass::Efficiency;
+  } else if (!wcscmp(aSpec, L"any")) {
+    aCoreClass = CoreClass::Any;
+  } else {
+    gStderr << L"Unknown core class \"" << aSpec << L"\"" << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+void
+RestrictToCoreClass(Topology const& aTopology, CoreClass aCoreClass,
+                    CpuSet& aEligible)
+{
+  if (aCoreClass == CoreClass::Any || !aTopology.MaxEfficiencyClass()) {
+    return;
+  }
+
+  // Choose among the classes that we may actually run on, so that a process
+  // already confined to efficiency cores still has somewhere to go
+  bool found = false;
+  BYTE chosen = 0;
+  for (Core const& core : aTopology.Cores()) {
+    CpuSet usable = core.mProcessors;
+    usable &= aEligible;
+    if (usable.IsEmpty()) {
+      continue;
+    }
+    bool const better = aCoreClass == CoreClass::Performance ?
+                        core.mEfficiencyClass > chosen :
+                        core.mEfficiencyClass < chosen;
+    if (!found || better) {
+      chosen = core.mEfficiencyClass;
+      found = true;
+    }
+  }
+
+  if (found) {
+    aEligible &= aTopology.EfficiencyClassProcessors(chosen);
+  }
+}
+
+bool
+GetEligibleProcessors(Topology const& aTopology, CpuSet& aEligible)
+{
+  DWORD_PTR processAffinityMask;
+  DWORD_PTR systemAffinityMask;
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask,
+                              &systemAffinityMask)) {
+    gStderr << L"Unable to obtain our CPU affinity mask." << EndLine;
+    return false;
+  }
+
+  GROUP_AFFINITY threadAffinity;
+  if (!GetThreadGroupAffinity(GetCurrentThread(), &threadAffinity)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetThreadGroupAffinity failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  // GetProcessAffinityMask only describes our primary group (and returns zero
+  // for both masks once we have threads in several groups). If whoever started
+  // us restricted our affinity, honour that and stay within our group.
+  // Otherwise every active processor in every group is fair game.
+  if (processAffinityMask != systemAffinityMask) {
+    aEligible = CpuSet();
+    aEligible.SetGroupMask(threadAffinity.Group,
+                           processAffinityMask &
+                             aTopology.ActiveMask(threadAffinity.Group));
+  } else {
+    aEligible = aTopology.AllProcessors();
+  }
+
+  if (aEligible.IsEmpty()) {
+    gStderr << L"CPU affinity mask is zero?!" << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Returns true when every logical processor of aCore is in aCandidates.
+ */
+static bool
+IsWholeCoreAvailable(Core const& aCore, CpuSet const& aCandidates)
+{
+  CpuSet shared(aCore.mProcessors);
+  shared &= aCandidates;
+  return !shared.IsEmpty() && shared.Count() == aCore.mProcessors.Count();
+}
+
+/**
+ * Narrows aCandidates to the processors that aPolicy's restrictions permit.
+ * On failure, aFailure describes the restriction that could not be met.
+ */
+static bool
+NarrowCandidates(Topology const& aTopology, PlacementPolicy const& aPolicy,
+                 CpuSet& aCandidates, wchar_t const*& aFailure)
+{
+  if (aPolicy.mNumaNode >= 0) {
+    aCandidates &= aTopology.NumaNodeProcessors(aPolicy.mNumaNode);
+    if (aCandidates.IsEmpty()) {
+      aFailure = L"No eligible CPU on the requested NUMA node.";
+      return false;
+    }
+  }
+
+  if (aPolicy.mL3Domain >= 0) {
+    aCandidates &= aTopology.L3Domain(aPolicy.mL3Domain);
+    if (aCandidates.IsEmpty()) {
+      aFailure = L"No eligible CPU in the requested L3 domain.";
+      return false;
+    }
+  }
+
+  if (aPolicy.mAvoidCpuZero) {
+    PROCESSOR_NUMBER cpuZero = {};
+    CpuSet withoutCpuZero(aCandidates);
+    withoutCpuZero.Remove(cpuZero);
+    if (!withoutCpuZero.IsEmpty()) {
+      aCandidates = withoutCpuZero;
+    }
+  }
+
+  if (aPolicy.mWholeCore) {
+    // Only keep cores whose siblings are all candidates too, so that nothing
+    // we are barred from shares the core.
+    CpuSet wholeCores;
+    for (Core const& core : aTopology.Cores()) {
+      if (IsWholeCoreAvailable(core, aCandidates)) {
+        wholeCores |= core.mProcessors;
+      }
+    }
+    aCandidates = wholeCores;
+    if (aCandidates.IsEmpty()) {
+      aFailure = L"No eligible CPU has a physical core to itself.";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+CanSatisfyPlacement(Topology const& aTopology, CpuSet const& aEligible,
+                    PlacementPolicy const& aPolicy)
+{
+  CpuSet candidates(aEligible);
+  wchar_t const* failure = nullptr;
+  return NarrowCandidates(aTopology, aPolicy, candidates, failure);
+}
+
+bool
+SelectProcessor(Topology const& aTopology, CpuSet const& aEligible,
+                PlacementPolicy const& aPolicy, PROCESSOR_NUMBER& aCpu,
+                ProcessorLoad const* aLoad)
+{
+  CpuSet candidates(aEligible);
+  wchar_t const* failure = nullptr;
+  if (!NarrowCandidates(aTopology, aPolicy, candidates, failure)) {
+    gStderr << failure << EndLine;
+    return false;
+  }
+
+  ProcessorLoad sample;
+  bool const loadAware = !!aPolicy.mLoadWindowMs;
+  if (loadAware && !aLoad) {
+    if (!sample.Sample(aTopology, aPolicy.mLoadWindowMs)) {
+      return false;
+    }
+    aLoad = &sample;
+  }
+
+  if (aPolicy.mWholeCore) {
+    // Without load information we take the first whole core; otherwise the
+    // one with the least total load.
+    Core const* bestCore = nullptr;
+    double bestLoad = 0.0;
+    for (Core const& core : aTopology.Cores()) {
+      if (!IsWholeCoreAvailable(core, candidates)) {
+        continue;
+      }
+      if (!loadAware) {
+        bestCore = &core;
+        break;
+      }
+      double coreLoad = 0.0;
+      core.mProcessors.ForEach([&](PROCESSOR_NUMBER const& aSibling) {
+        coreLoad += aLoad->Busy(aSibling);
+      });
+      if (!bestCore || coreLoad < bestLoad) {
+        bestCore = &core;
+        bestLoad = coreLoad;
+      }
+    }
+
+    if (bestCore) {
+      candidates = bestCore->mProcessors;
+    }
+  }
+  // Scan the candidate set for the first available CPU
+  if (!candidates.First(aCpu)) {
+    gStderr << L"No eligible CPU could be selected." << EndLine;
+    return false;
+  }
+
+  if (loadAware) {
+    // Ties go to the lowest numbered processor
+    double bestLoad = aLoad->Busy(aCpu);
+    candidates.ForEach([&](PROCESSOR_NUMBER const& aCandidate) {
+      double candidateLoad = aLoad->Busy(aCandidate);
+      if (candidateLoad < bestLoad) {
+        aCpu = aCandidate;
+        bestLoad = candidateLoad;
+      }
+    });
+  }
+
+  return true;
+}
+
+CpuSet
+OccupiedProcessors(Topology const& aTopology, PlacementPolicy const& aPolicy,
+                   CpuSet const& aAffinity)
+{
+  if (!aPolicy.mWholeCore) {
+    return aAffinity;
+  }
+
+  CpuSet occupied(aAffinity);
+  aAffinity.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    Core const* core = aTopology.CoreOf(aCpu);
+    if (core) {
+      occupied |= core->mProcessors;
+    }
+  });
+  return occupied;
+}
+
+void
+KeepThreadOff(HANDLE aThread, Topology const& aTopology, CpuSet const& aAvoid)
+{
+  CpuSet others = aTopology.AllProcessors();
+  aAvoid.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    Core const* core = aTopology.CoreOf(aCpu);
+    if (core) {
+      for (WORD group = 0; group < others.GroupCount(); ++group) {
+        others.SetGroupMask(group, others.GroupMask(group) &
+                                   ~core->mProcessors.GroupMask(group));
+      }
+    }
+    others.Remove(aCpu);
+  });
+
+  for (WORD group = 0; group < others.GroupCount(); ++group) {
+    if (!others.GroupMask(group)) {
+      continue;
+    }
+
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = group;
+    affinity.Mask = others.GroupMask(group);
+    if (!SetThreadGroupAffinity(aThread, &affinity, nullptr)) {
+      DWORD err = GetLastError();
+      gStderr << L"SetThreadGroupAffinity failed with error code " << err
+              << EndLine;
+    }
+    return;
+  }
+}
+
+int
+PreferredNumaNode(Topology const& aTopology, CpuSet const& aAffinity)
+{
+  if (aTopology.NumaNodes().size() < 2) {
+    return -1;
+  }
+
+  int bestNode = -1;
+  unsigned int bestCount = 0;
+  for (NumaNode const& node : aTopology.NumaNodes()) {
+    CpuSet shared(node.mProcessors);
+    shared &= aAffinity;
+    unsigned int count = shared.Count();
+    if (count > bestCount) {
+      bestNode = static_cast<int>(node.mNumber);
+      bestCount = count;
+    }
+  }
+
+  return bestNode;
+}
+
+static bool
+ParseCpuList(wchar_t const* aList, CpuSet& aCpus)
+{
+  wchar_t const* cur = aList;
+  for (;;) {
+    wchar_t* end = nullptr;
+    unsigned long group = 0;
+    unsigned long first = wcstoul(cur, &end, 10);
+    if (end == cur) {
+      return false;
+    }
+    if (*end == L':') {
+      group = first;
+      cur = end + 1;
+      first = wcstoul(cur, &end, 10);
+      if (end == cur) {
+        return false;
+      }
+    }
+
+    unsigned long last = first;
+    if (*end == L'-') {
+      cur = end + 1;
+      last = wcstoul(cur, &end, 10);
+      if (end == cur) {
+        return false;
+      }
+    }
+
+    if (group > 0xFFFF || first > last || last >= MAXIMUM_PROC_PER_GROUP) {
+      return false;
+    }
+
+    for (unsigned long i = first; i <= last; ++i) {
+      PROCESSOR_NUMBER cpu = {};
+      cpu.Group = static_cast<WORD>(group);
+      cpu.Number = static_cast<BYTE>(i);
+      aCpus.Add(cpu);
+    }
+
+    if (!*end) {
+      return true;
+    }
+    if (*end != L',') {
+      return false;
+    }
+    cur = end + 1;
+  }
+}
+
+bool
+ParseCpuSpec(wchar_t const* aSpec, CpuSpec& aCpuSpec)
+{
+  aCpuSpec = CpuSpec();
+
+  if (!wcsncmp(aSpec, L"list:", 5)) {
+    if (!ParseCpuList(aSpec + 5, aCpuSpec.mExplicit)) {
+      gStderr << L"Invalid CPU list \"" << aSpec + 5 << L"\""
+              << EndLine;
+      return false;
+    }
+    return true;
+  }
+
+  wchar_t* end = nullptr;
+  unsigned long count = wcstoul(aSpec, &end, 10);
+  if (end == aSpec || !count || count > 0xFFFF) {
+    gStderr << L"Invalid CPU count in \"" << aSpec << L"\"" << EndLine;
+    return false;
+  }
+  aCpuSpec.mCount = count;
+
+  std::wstring rest(end);
+  if (!rest.compare(0, 5, L"cores")) {
+    aCpuSpec.mWholeCores = true;
+    rest.erase(0, 5);
+  }
+
+  if (rest == L"@l3") {
+    aCpuSpec.mDomain = CpuSpec::Domain::L3;
+  } else if (rest == L"@numa") {
+    aCpuSpec.mDomain = CpuSpec::Domain::Numa;
+  } else if (!rest.empty()) {
+    gStderr << L"Invalid CPU specification \"" << aSpec << L"\""
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Picks aCpuSpec.mCount members from aCandidates. When aLoad is null and the
+ * policy is load-aware, this only checks feasibility.
+ */
+static bool
+SelectFromDomain(Topology const& aTopology, CpuSet const& aCandidates,
+                 PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec,
+                 CpuSet& aAffinity, ProcessorLoad const* aLoad)
+{
+  PlacementPolicy policy(aPolicy);
+  if (aCpuSpec.mWholeCores) {
+    policy.mWholeCore = true;
+  }
+  if (!aLoad) {
+    policy.mLoadWindowMs = 0;
+  }
+
+  CpuSet remaining(aCandidates);
+  CpuSet affinity;
+  for (unsigned int i = 0; i < aCpuSpec.mCount; ++i) {
+    PROCESSOR_NUMBER cpu;
+    if (!CanSatisfyPlacement(aTopology, remaining, policy) ||
+        !SelectProcessor(aTopology, remaining, policy, cpu, aLoad)) {
+      return false;
+    }
+
+    CpuSet single;
+    single.Add(cpu);
+    CpuSet occupied = OccupiedProcessors(aTopology, policy, single);
+    occupied.ForEach([&](PROCESSOR_NUMBER const& aOccupied) {
+      remaining.Remove(aOccupied);
+    });
+    affinity |= aCpuSpec.mWholeCores ? occupied : single;
+  }
+
+  aAffinity = affinity;
+  return true;
+}
+
+static bool
+SelectAffinityImpl(Topology const& aTopology, CpuSet const& aEligible,
+                   PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec,
+                   CpuSet& aAffinity, ProcessorLoad const* aLoad,
+                   bool aReport)
+{
+  if (!aCpuSpec.mExplicit.IsEmpty()) {
+    CpuSet permitted(aCpuSpec.mExplicit);
+    permitted &= aEligible;
+    if (permitted.Count() != aCpuSpec.mExplicit.Count()) {
+      if (aReport) {
+        gStderr << L"CPU list " << aCpuSpec.mExplicit.ToString()
+                << L" is not within the eligible CPUs "
+                << aEligible.ToString() << EndLine;
+      }
+      return false;
+    }
+    aAffinity = aCpuSpec.mExplicit;
+    return true;
+  }
+
+  std::vector<CpuSet> domains;
+  switch (aCpuSpec.mDomain) {
+    case CpuSpec::Domain::L3:
+      for (Cache const& cache : aTopology.Caches()) {
+        if (cache.mLevel == 3) {
+          domains.push_back(cache.mProcessors);
+        }
+      }
+      break;
+    case CpuSpec::Domain::Numa:
+      for (NumaNode const& node : aTopology.NumaNodes()) {
+        domains.push_back(node.mProcessors);
+      }
+      break;
+    default:
+      domains.push_back(aEligible);
+      break;
+  }
+
+  // The first domain that can accommodate the whole set wins
+  for (CpuSet const& domain : domains) {
+    CpuSet candidates(domain);
+    candidates &= aEligible;
+    if (SelectFromDomain(aTopology, candidates, aPolicy, aCpuSpec, aAffinity,
+                         aLoad)) {
+      return true;
+    }
+  }
+
+  if (aReport) {
+    gStderr << L"Unable to find " << aCpuSpec.mCount
+            << (aCpuSpec.mWholeCores ? L" whole cores" : L" CPUs")
+            << (aCpuSpec.mDomain == CpuSpec::Domain::Any ? L"" :
+                   L" within one domain")
+            << L" that satisfy the placement policy." << EndLine;
+  }
+  return false;
+}
+
+bool
+CanSatisfyAffinity(Topology const& aTopology, CpuSet const& aEligible,
+                   PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec)
+{
+  CpuSet affinity;
+  return SelectAffinityImpl(aTopology, aEligible, aPolicy, aCpuSpec, affinity,
+                            nullptr, false);
+}
+
+bool
+SelectAffinity(Topology const& aTopology, CpuSet const& aEligible,
+               PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec,
+               CpuSet& aAffinity, ProcessorLoad const* aLoad)
+{
+  ProcessorLoad sample;
+  if (aPolicy.mLoadWindowMs && !aLoad) {
+    if (!sample.Sample(aTopology, aPolicy.mLoadWindowMs)) {
+      return false;
+    }
+    aLoad = &sample;
+  }
+
+  return SelectAffinityImpl(aTopology, aEligible, aPolicy, aCpuSpec, aAffinity,
+                            aLoad, true);
+}
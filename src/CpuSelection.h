@@ -0,0 +1,173 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_CpuSelection_h
+#define rununiproc_CpuSelection_h
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "Topology.h"
+
+class ProcessorLoad;
+
+/**
+ * Refinements to apply when choosing a processor, as specified by
+ * --placement=. Terms are comma separated and may be combined:
+ *
+ *   first       Lowest numbered eligible processor (the default)
+ *   core        A physical core none of whose SMT siblings are ineligible;
+ *               the child gets the core's first logical processor
+ *   avoid-cpu0  Skip CPU 0 of group 0, where interrupts and DPCs tend to land,
+ *               unless it is the only choice left
+ *   l3:<n>      Restrict to processors sharing the n-th L3 cache
+ *   numa:<n>    Restrict to processors on NUMA node n
+ *   idle[:<ms>] Sample per-processor utilization over a window of ms
+ *               milliseconds (100 by default) and take the least loaded
+ *               candidate; combined with "core", the least loaded core
+ */
+struct PlacementPolicy
+{
+  bool mWholeCore = false;
+  bool mAvoidCpuZero = false;
+  int mL3Domain = -1;
+  int mNumaNode = -1;
+  // Zero unless load-aware selection was requested
+  DWORD mLoadWindowMs = 0;
+};
+
+/**
+ * Parses a --placement= value. Reports any failure to stderr and returns
+ * false.
+ */
+bool ParsePlacement(wchar_t const* aSpec, PlacementPolicy& aPolicy);
+
+/**
+ * How many processors to pin a child to, as specified by --cpus=:
+ *
+ *   <n>             n logical processors chosen according to the placement
+ *                   policy (1 by default)
+ *   <n>cores        n physical cores, including all of their SMT siblings
+ *
+ * Either form may be suffixed with @l3 or @numa to keep the whole set within a
+ * single L3 domain or NUMA node. Alternatively,
+ *
+ *   list:<items>    Exactly the given processors, where items are comma
+ *                   separated [<group>:]<first>[-<last>] runs and the group
+ *                   defaults to 0
+ */
+struct CpuSpec
+{
+  enum class Domain
+  {
+    Any,
+    L3,
+    Numa
+  };
+
+  unsigned int mCount = 1;
+  bool mWholeCores = false;
+  Domain mDomain = Domain::Any;
+  // When non-empty, used verbatim instead of selecting processors
+  CpuSet mExplicit;
+};
+
+/**
+ * Parses a --cpus= value. Reports any failure to stderr and returns false.
+ */
+bool ParseCpuSpec(wchar_t const* aSpec, CpuSpec& aCpuSpec);
+
+/**
+ * Which kind of core to run on when the processor is hybrid, as specified by
+ * --core-class=.
+ */
+enum class CoreClass
+{
+  // The highest efficiency class among the eligible cores (the default)
+  Performance,
+  // The lowest efficiency class among the eligible cores
+  Efficiency,
+  // Every eligible core
+  Any
+};
+
+/**
+ * Parses a --core-class= value: performance, efficiency or any. Reports any
+ * failure to stderr and returns false.
+ */
+bool ParseCoreClass(wchar_t const* aSpec, CoreClass& aCoreClass);
+
+/**
+ * Narrows aEligible to the processors of the requested core class. This has no
+ * effect on machines where every core has the same efficiency class.
+ */
+void RestrictToCoreClass(Topology const& aTopology, CoreClass aCoreClass,
+                         CpuSet& aEligible);
+
+/**
+ * Computes the set of processors that we are permitted to pin a child to.
+ * Reports any failure to stderr and returns false.
+ */
+bool GetEligibleProcessors(Topology const& aTopology, CpuSet& aEligible);
+
+/**
+ * Returns true if SelectProcessor would find a processor in aEligible that
+ * meets aPolicy's restrictions. Does not report anything.
+ */
+bool CanSatisfyPlacement(Topology const& aTopology, CpuSet const& aEligible,
+                         PlacementPolicy const& aPolicy);
+
+/**
+ * Chooses a single processor from aEligible according to aPolicy. When aPolicy
+ * is load-aware, aLoad supplies a previously taken sample; if it is null, a
+ * fresh sample is taken. Reports any failure to stderr and returns false.
+ */
+bool SelectProcessor(Topology const& aTopology, CpuSet const& aEligible,
+                     PlacementPolicy const& aPolicy, PROCESSOR_NUMBER& aCpu,
+                     ProcessorLoad const* aLoad = nullptr);
+
+/**
+ * Returns the processors that a child pinned to aAffinity under aPolicy
+ * occupies: every core that aAffinity touches when aPolicy asks for whole
+ * cores, otherwise just aAffinity.
+ */
+CpuSet OccupiedProcessors(Topology const& aTopology,
+                          PlacementPolicy const& aPolicy,
+                          CpuSet const& aAffinity);
+
+/**
+ * Confines aThread, one of our own, to the first processor group with
+ * processors outside every core that aAvoid touches, so that our helper
+ * threads stay off a child's cores and their SMT siblings. Failures are
+ * reported to stderr but leave the thread running wherever it may.
+ */
+void KeepThreadOff(HANDLE aThread, Topology const& aTopology,
+                   CpuSet const& aAvoid);
+
+/**
+ * Returns the number of the NUMA node holding most of aAffinity, or -1 if the
+ * machine only has one node and there is nothing to choose.
+ */
+int PreferredNumaNode(Topology const& aTopology, CpuSet const& aAffinity);
+
+/**
+ * Returns true if SelectAffinity would succeed. Does not sample load or report
+ * anything.
+ */
+bool CanSatisfyAffinity(Topology const& aTopology, CpuSet const& aEligible,
+                        PlacementPolicy const& aPolicy,
+                        CpuSpec const& aCpuSpec);
+
+/**
+ * Chooses the set of processors described by aCpuSpec from aEligible, picking
+ * each member according to aPolicy. aLoad is treated as in SelectProcessor.
+ * Reports any failure to stderr and returns false.
+ */
+bool SelectAffinity(Topology const& aTopology, CpuSet const& aEligible,
+                    PlacementPolicy const& aPolicy, CpuSpec const& aCpuSpec,
+                    CpuSet& aAffinity, ProcessorLoad const* aLoad = nullptr);
+
+#endif // rununiproc_CpuSelection_h
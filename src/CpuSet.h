@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_CpuSet_h
+#define rununiproc_CpuSet_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include <intrin.h>
+#if defined(_M_X64)
+#pragma intrinsic(_BitScanForward64)
+#define CPU_BITSCANFORWARD _BitScanForward64
+#else
+#pragma intrinsic(_BitScanForward)
+#define CPU_BITSCANFORWARD _BitScanForward
+#endif
+
+/**
+ * A set of logical processors that may span several processor groups. Each
+ * group is represented by a full KAFFINITY mask, so processor numbers up to
+ * MAXIMUM_PROC_PER_GROUP - 1 are handled in every group.
+ */
+class CpuSet
+{
+public:
+  CpuSet() = default;
+
+  static KAFFINITY Bit(BYTE aNumber)
+  {
+    return static_cast<KAFFINITY>(1) << aNumber;
+  }
+
+  WORD GroupCount() const
+  {
+    return static_cast<WORD>(mMasks.size());
+  }
+
+  KAFFINITY GroupMask(WORD aGroup) const
+  {
+    return aGroup < mMasks.size() ? mMasks[aGroup] : 0;
+  }
+
+  void SetGroupMask(WORD aGroup, KAFFINITY aMask)
+  {
+    if (aGroup >= mMasks.size()) {
+      mMasks.resize(aGroup + 1, 0);
+    }
+    mMasks[aGroup] = aMask;
+  }
+
+  void Add(PROCESSOR_NUMBER const& aCpu)
+  {
+    SetGroupMask(aCpu.Group, GroupMask(aCpu.Group) | Bit(aCpu.Number));
+  }
+
+  void Remove(PROCESSOR_NUMBER const& aCpu)
+  {
+    if (aCpu.Group < mMasks.size()) {
+      mMasks[aCpu.Group] &= ~Bit(aCpu.Number);
+    }
+  }
+
+  bool Contains(PROCESSOR_NUMBER const& aCpu) const
+  {
+    return !!(GroupMask(aCpu.Group) & Bit(aCpu.Number));
+  }
+
+  bool IsEmpty() const
+  {
+    for (KAFFINITY mask : mMasks) {
+      if (mask) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned int Count() const
+  {
+    unsigned int count = 0;
+    for (KAFFINITY mask : mMasks) {
+      // Avoid __popcnt64: it emits POPCNT, which older CPUs do not support
+      for (; mask; mask &= mask - 1) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  CpuSet& operator&=(CpuSet const& aOther)
+  {
+    for (WORD group = 0; group < GroupCount(); ++group) {
+      mMasks[group] &= aOther.GroupMask(group);
+    }
+    return *this;
+  }
+
+  CpuSet& operator|=(CpuSet const& aOther)
+  {
+    for (WORD group = 0; group < aOther.GroupCount(); ++group) {
+      SetGroupMask(group, GroupMask(group) | aOther.GroupMask(group));
+    }
+    return *this;
+  }
+
+  /**
+   * Returns the lowest numbered processor in the lowest numbered group that
+   * is a member of this set.
+   */
+  bool First(PROCESSOR_NUMBER& aCpu) const
+  {
+    for (WORD group = 0; group < GroupCount(); ++group) {
+      unsigned long index;
+      if (CPU_BITSCANFORWARD(&index, mMasks[group])) {
+        aCpu = {};
+        aCpu.Group = group;
+        aCpu.Number = static_cast<BYTE>(index);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Invokes aFunc with a PROCESSOR_NUMBER for each member of the set, in
+   * ascending order.
+   */
+  template <typename F>
+  void ForEach(F&& aFunc) const
+  {
+    for (WORD group = 0; group < GroupCount(); ++group) {
+      KAFFINITY mask = mMasks[group];
+      unsigned long index;
+      while (CPU_BITSCANFORWARD(&index, mask)) {
+        mask &= mask - 1;
+        PROCESSOR_NUMBER cpu = {};
+        cpu.Group = group;
+        cpu.Number = static_cast<BYTE>(index);
+        aFunc(cpu);
+      }
+    }
+  }
+
+  /**
+   * Formats the set as comma separated runs of the form group:first[-last],
+   * which is also what --cpus=list: accepts.
+   */
+  std::wstring ToString() const
+  {
+    std::wstring result;
+    for (WORD group = 0; group < GroupCount(); ++group) {
+      KAFFINITY mask = mMasks[group];
+      unsigned long first;
+      while (CPU_BITSCANFORWARD(&first, mask)) {
+        unsigned long last = first;
+        while (last + 1 < MAXIMUM_PROC_PER_GROUP &&
+               (mask & Bit(static_cast<BYTE>(last + 1)))) {
+          ++last;
+        }
+        for (unsigned long i = first; i <= last; ++i) {
+          mask &= ~Bit(static_cast<BYTE>(i));
+        }
+
+        if (!result.empty()) {
+          result += L',';
+        }
+        result += std::to_wstring(group) + L':' + std::to_wstring(first);
+        if (last != first) {
+          result += L'-' + std::to_wstring(last);
+        }
+      }
+    }
+    return result;
+  }
+
+private:
+  std::vector<KAFFINITY> mMasks;
+};
+
+#endif // rununiproc_CpuSet_h
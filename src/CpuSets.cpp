@@ -0,0 +1,360 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CpuSets.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include <tlhelp32.h>
+
+#include "Output.h"
+
+namespace {
+
+// Mirrors SYSTEM_CPU_SET_INFORMATION, which older SDKs do not declare
+struct CpuSetInformation
+{
+  DWORD Size;
+  DWORD Type;
+  struct
+  {
+    DWORD Id;
+    WORD Group;
+    BYTE LogicalProcessorIndex;
+    BYTE CoreIndex;
+    BYTE LastLevelCacheIndex;
+    BYTE NumaNodeIndex;
+    BYTE EfficiencyClass;
+    BYTE AllFlags;
+    DWORD Reserved;
+    DWORD64 AllocationTag;
+  } CpuSet;
+};
+
+DWORD const kCpuSetInformation = 0;
+
+using GetSystemCpuSetInformationFn = BOOL (WINAPI*)(CpuSetInformation*, ULONG,
+                                                    PULONG, HANDLE, ULONG);
+using SetProcessDefaultCpuSetsFn = BOOL (WINAPI*)(HANDLE, ULONG const*,
+                                                  ULONG);
+using GetProcessDefaultCpuSetsFn = BOOL (WINAPI*)(HANDLE, PULONG, ULONG,
+                                                  PULONG);
+using SetThreadSelectedCpuSetsFn = BOOL (WINAPI*)(HANDLE, ULONG const*,
+                                                  ULONG);
+
+template <typename FnT>
+FnT
+GetKernel32Function(char const* aName)
+{
+  return reinterpret_cast<FnT>(GetProcAddress(GetModuleHandle(L"kernel32.dll"),
+                                              aName));
+}
+
+GetSystemCpuSetInformationFn
+GetGetSystemCpuSetInformation()
+{
+  static GetSystemCpuSetInformationFn sFn =
+    GetKernel32Function<GetSystemCpuSetInformationFn>(
+      "GetSystemCpuSetInformation");
+  return sFn;
+}
+
+SetProcessDefaultCpuSetsFn
+GetSetProcessDefaultCpuSets()
+{
+  static SetProcessDefaultCpuSetsFn sFn =
+    GetKernel32Function<SetProcessDefaultCpuSetsFn>(
+      "SetProcessDefaultCpuSets");
+  return sFn;
+}
+
+GetProcessDefaultCpuSetsFn
+GetGetProcessDefaultCpuSets()
+{
+  static GetProcessDefaultCpuSetsFn sFn =
+    GetKernel32Function<GetProcessDefaultCpuSetsFn>(
+      "GetProcessDefaultCpuSets");
+  return sFn;
+}
+
+SetThreadSelectedCpuSetsFn
+GetSetThreadSelectedCpuSets()
+{
+  static SetThreadSelectedCpuSetsFn sFn =
+    GetKernel32Function<SetThreadSelectedCpuSetsFn>(
+      "SetThreadSelectedCpuSets");
+  return sFn;
+}
+
+/**
+ * Calls aFunc with each entry that GetSystemCpuSetInformation reports.
+ */
+template <typename F>
+bool
+ForEachCpuSet(F&& aFunc)
+{
+  GetSystemCpuSetInformationFn getInfo = GetGetSystemCpuSetInformation();
+  if (!getInfo) {
+    gStderr << L"CPU sets require Windows 10." << EndLine;
+    return false;
+  }
+
+  ULONG bufLen = 0;
+  if (!getInfo(nullptr, 0, &bufLen, GetCurrentProcess(), 0) &&
+      GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+    DWORD err = GetLastError();
+    gStderr << L"GetSystemCpuSetInformation for sizing failed with error "
+               L"code " << err << EndLine;
+    return false;
+  }
+
+  auto buf = std::make_unique<char[]>(bufLen);
+  if (!getInfo(reinterpret_cast<CpuSetInformation*>(buf.get()), bufLen,
+               &bufLen, GetCurrentProcess(), 0)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetSystemCpuSetInformation failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  for (ULONG offset = 0; offset < bufLen;) {
+    auto info = reinterpret_cast<CpuSetInformation*>(buf.get() + offset);
+    if (info->Type == kCpuSetInformation) {
+      aFunc(*info);
+    }
+    offset += info->Size;
+  }
+
+  return true;
+}
+
+} // anonymous namespace
+
+bool
+AreCpuSetsSupported()
+{
+  return GetGetSystemCpuSetInformation() && GetSetProcessDefaultCpuSets() &&
+         GetGetProcessDefaultCpuSets() && GetSetThreadSelectedCpuSets();
+}
+
+bool
+GetCpuSetIds(CpuSet const& aCpus, std::vector<ULONG>& aIds)
+{
+  aIds.clear();
+  bool ok = ForEachCpuSet([&](CpuSetInformation const& aInfo) {
+    PROCESSOR_NUMBER cpu = {};
+    cpu.Group = aInfo.CpuSet.Group;
+    cpu.Number = aInfo.CpuSet.LogicalProcessorIndex;
+    if (aCpus.Contains(cpu)) {
+      aIds.push_back(aInfo.CpuSet.Id);
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+
+  if (aIds.size() != aCpus.Count()) {
+    gStderr << L"Not every CPU in " << aCpus.ToString()
+            << L" has a CPU set." << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ApplyCpuSets(HANDLE aProcess, HANDLE aThread, CpuSet const& aCpus)
+{
+  if (!AreCpuSetsSupported()) {
+    gStderr << L"CPU sets require Windows 10." << EndLine;
+    return false;
+  }
+
+  std::vector<ULONG> ids;
+  if (!GetCpuSetIds(aCpus, ids)) {
+    return false;
+  }
+
+  ULONG const count = static_cast<ULONG>(ids.size());
+  if (!GetSetProcessDefaultCpuSets()(aProcess, ids.data(), count)) {
+    DWORD err = GetLastError();
+    gStderr << L"SetProcessDefaultCpuSets failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  // The main thread already exists, so the process default does not apply to
+  // it; it needs its own selection.
+  if (!GetSetThreadSelectedCpuSets()(aThread, ids.data(), count)) {
+    DWORD err = GetLastError();
+    gStderr << L"SetThreadSelectedCpuSets failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+SelectThreadCpuSets(HANDLE aThread, CpuSet const& aCpus)
+{
+  if (!AreCpuSetsSupported()) {
+    gStderr << L"CPU sets require Windows 10." << EndLine;
+    return false;
+  }
+
+  std::vector<ULONG> ids;
+  if (!GetCpuSetIds(aCpus, ids)) {
+    return false;
+  }
+
+  if (!GetSetThreadSelectedCpuSets()(aThread, ids.data(),
+                                     static_cast<ULONG>(ids.size()))) {
+    DWORD err = GetLastError();
+    gStderr << L"SetThreadSelectedCpuSets failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+CpuSetReservation::~CpuSetReservation()
+{
+  Restore();
+}
+
+bool
+CpuSetReservation::Apply(CpuSet const& aCpus)
+{
+  if (!AreCpuSetsSupported()) {
+    gStderr << L"CPU sets require Windows 10." << EndLine;
+    return false;
+  }
+
+  std::vector<ULONG> reservedIds;
+  if (!GetCpuSetIds(aCpus, reservedIds)) {
+    return false;
+  }
+
+  std::vector<ULONG> otherIds;
+  bool ok = ForEachCpuSet([&](CpuSetInformation const& aInfo) {
+    if (std::find(reservedIds.begin(), reservedIds.end(), aInfo.CpuSet.Id) ==
+        reservedIds.end()) {
+      otherIds.push_back(aInfo.CpuSet.Id);
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+
+  if (otherIds.empty()) {
+    gStderr << L"Refusing to reserve every CPU on the system." << EndLine;
+    return false;
+  }
+
+  UniqueHandle snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+  if (snapshot.get() == INVALID_HANDLE_VALUE) {
+    snapshot.release();
+    DWORD err = GetLastError();
+    gStderr << L"CreateToolhelp32Snapshot failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  // An interrupt waits until every process that we move is recorded, then
+  // moves them all back
+  ExitCleanup::AutoLock lock;
+  Register();
+
+  DWORD const ourPid = GetCurrentProcessId();
+  size_t skipped = 0;
+
+  PROCESSENTRY32W entry = { sizeof(entry) };
+  for (BOOL more = Process32FirstW(snapshot.get(), &entry); more;
+       more = Process32NextW(snapshot.get(), &entry)) {
+    DWORD pid = entry.th32ProcessID;
+    if (!pid || pid == ourPid) {
+      continue;
+    }
+
+    SavedProcess saved;
+    saved.mProcess.reset(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION |
+                                     PROCESS_SET_LIMITED_INFORMATION, FALSE,
+                                     pid));
+    if (!saved.mProcess) {
+      ++skipped;
+      continue;
+    }
+
+    ULONG required = 0;
+    GetGetProcessDefaultCpuSets()(saved.mProcess.get(), nullptr, 0, &required);
+    saved.mPreviousIds.resize(required);
+    if (required &&
+        !GetGetProcessDefaultCpuSets()(saved.mProcess.get(),
+                                       saved.mPreviousIds.data(), required,
+                                       &required)) {
+      ++skipped;
+      continue;
+    }
+
+    // Processes that already chose CPU sets keep whatever of theirs is left
+    std::vector<ULONG> newIds;
+    if (saved.mPreviousIds.empty()) {
+      newIds = otherIds;
+    } else {
+      for (ULONG id : saved.mPreviousIds) {
+        if (std::find(otherIds.begin(), otherIds.end(), id) !=
+            otherIds.end()) {
+          newIds.push_back(id);
+        }
+      }
+      if (newIds.empty() || newIds.size() == saved.mPreviousIds.size()) {
+        continue;
+      }
+    }
+
+    if (!GetSetProcessDefaultCpuSets()(saved.mProcess.get(), newIds.data(),
+                                       static_cast<ULONG>(newIds.size()))) {
+      ++skipped;
+      continue;
+    }
+
+    mSaved.push_back(std::move(saved));
+  }
+
+#if defined(DEBUG)
+  gStdout << L"Moved " << mSaved.size() << L" processes off CPUs "
+          << aCpus.ToString() << L"; " << skipped
+          << L" could not be modified" << EndLine;
+#else
+  (void)skipped;
+#endif
+
+  return true;
+}
+
+void
+CpuSetReservation::Restore()
+{
+  RunCleanup();
+}
+
+void
+CpuSetReservation::Cleanup()
+{
+  SetProcessDefaultCpuSetsFn setDefault = GetSetProcessDefaultCpuSets();
+  for (SavedProcess& saved : mSaved) {
+    // An empty list clears the assignment again
+    setDefault(saved.mProcess.get(),
+               saved.mPreviousIds.empty() ? nullptr :
+                                            saved.mPreviousIds.data(),
+               static_cast<ULONG>(saved.mPreviousIds.size()));
+  }
+  mSaved.clear();
+}
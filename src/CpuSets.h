@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_CpuSets_h
+#define rununiproc_CpuSets_h
+
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "ExitCleanup.h"
+#include "UniqueHandle.h"
+
+/**
+ * Support for the Windows 10 CPU Sets API, which steers threads towards
+ * processors without forbidding them from running elsewhere. The functions
+ * are resolved at runtime so that we continue to load on older versions.
+ */
+bool AreCpuSetsSupported();
+
+/**
+ * Translates aCpus into CPU set IDs. Reports any failure to stderr and returns
+ * false.
+ */
+bool GetCpuSetIds(CpuSet const& aCpus, std::vector<ULONG>& aIds);
+
+/**
+ * Makes aCpus the default CPU sets of aProcess, and the selected CPU sets of
+ * its main thread aThread, which should still be suspended. Reports any
+ * failure to stderr and returns false.
+ */
+bool ApplyCpuSets(HANDLE aProcess, HANDLE aThread, CpuSet const& aCpus);
+
+/**
+ * Makes aCpus the selected CPU sets of aThread. Reports any failure to stderr
+ * and returns false.
+ */
+bool SelectThreadCpuSets(HANDLE aThread, CpuSet const& aCpus);
+
+/**
+ * Moves the default CPU sets of every other process that we are permitted to
+ * modify off a set of processors, and puts them back when destroyed, or when
+ * we are interrupted. Threads that have their own CPU sets or a hard affinity
+ * are not affected, nor are processes started after Apply.
+ */
+class CpuSetReservation : private ExitCleanup
+{
+public:
+  CpuSetReservation() = default;
+  ~CpuSetReservation();
+
+  CpuSetReservation(CpuSetReservation const&) = delete;
+  CpuSetReservation& operator=(CpuSetReservation const&) = delete;
+
+  /**
+   * Moves every existing process except ourselves off aCpus, so that children
+   * launched afterwards with those CPU sets have them to themselves. Reports
+   * any failure to stderr and returns false; failing to modify an individual
+   * process is not an error.
+   */
+  bool Apply(CpuSet const& aCpus);
+
+  /**
+   * Restores the previous default CPU sets of every process we modified.
+   */
+  void Restore();
+
+private:
+  void Cleanup() override;
+
+  struct SavedProcess
+  {
+    UniqueHandle mProcess;
+    std::vector<ULONG> mPreviousIds;
+  };
+
+  std::vector<SavedProcess> mSaved;
+};
+
+#endif // rununiproc_CpuSets_h
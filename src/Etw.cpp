@@ -0,0 +1,201 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Etw.h"
+
+#include <string.h>
+#include <wchar.h>
+
+#include "CpuReservation.h"
+#include "Output.h"
+
+// Every kernel session that we start is named for its kind and its owner's
+// token, as rununiproc.<kind>.<token in hex>
+static wchar_t const kSessionPrefix[] = L"rununiproc.";
+
+GUID const kProcessEventGuid =
+  { 0x3d6fa8d0, 0xfe05, 0x11d0, { 0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba,
+                                  0x7c } };
+GUID const kThreadEventGuid =
+  { 0x3d6fa8d1, 0xfe05, 0x11d0, { 0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba,
+                                  0x7c } };
+GUID const kPerfInfoEventGuid =
+  { 0xce1dbfb4, 0x137e, 0x4da6, { 0x87, 0xb0, 0x3f, 0x59, 0xaa, 0x10, 0x2c,
+                                  0xbc } };
+
+namespace {
+
+template <typename FnT>
+FnT
+GetAdvapi32Function(char const* aName)
+{
+  return reinterpret_cast<FnT>(GetProcAddress(GetModuleHandle(L"advapi32.dll"),
+                                              aName));
+}
+
+} // anonymous namespace
+
+TraceSetInformationFn
+GetTraceSetInformation()
+{
+  static TraceSetInformationFn sFn =
+    GetAdvapi32Function<TraceSetInformationFn>("TraceSetInformation");
+  return sFn;
+}
+
+TraceQueryInformationFn
+GetTraceQueryInformation()
+{
+  static TraceQueryInformationFn sFn =
+    GetAdvapi32Function<TraceQueryInformationFn>("TraceQueryInformation");
+  return sFn;
+}
+
+EVENT_TRACE_PROPERTIES*
+InitTraceProperties(std::vector<BYTE>& aBuffer,
+                    std::wstring const& aSessionName, wchar_t const* aLogFile,
+                    ULONG aEnableFlags)
+{
+  size_t const nameBytes = (aSessionName.size() + 1) * sizeof(wchar_t);
+  size_t const fileBytes = aLogFile ? (wcslen(aLogFile) + 1) * sizeof(wchar_t)
+                                    : 0;
+  aBuffer.assign(sizeof(EVENT_TRACE_PROPERTIES) + nameBytes + fileBytes, 0);
+
+  auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(aBuffer.data());
+  props->Wnode.BufferSize = static_cast<ULONG>(aBuffer.size());
+  props->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+  // QueryPerformanceCounter timestamps
+  props->Wnode.ClientContext = 1;
+  // Every processor logs kernel events, so be generous with buffers
+  props->BufferSize = 256;
+  props->MinimumBuffers = 64;
+  props->MaximumBuffers = 1024;
+  props->FlushTimer = 1;
+  props->LogFileMode = kSystemLoggerMode |
+                       (aLogFile ? EVENT_TRACE_FILE_MODE_SEQUENTIAL
+                                 : EVENT_TRACE_REAL_TIME_MODE);
+  props->EnableFlags = aEnableFlags;
+  props->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+
+  if (aLogFile) {
+    props->LogFileNameOffset =
+      static_cast<ULONG>(sizeof(EVENT_TRACE_PROPERTIES) + nameBytes);
+    memcpy(&aBuffer[props->LogFileNameOffset], aLogFile, fileBytes);
+  }
+
+  return props;
+}
+
+bool
+MakeKernelSessionName(wchar_t const* aKind, std::wstring& aName)
+{
+  LONG64 token;
+  if (!CpuReservation::GetOwnerToken(GetCurrentProcess(),
+                                     GetCurrentProcessId(), token)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetProcessTimes failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  StringWriter name;
+  name << kSessionPrefix << aKind << L'.' << Hex
+       << static_cast<unsigned long long>(token);
+  aName = name.str();
+  return true;
+}
+
+void
+StopOrphanedKernelSessions()
+{
+  // Generous limits: Windows itself runs a few dozen sessions at most
+  ULONG const kMaxSessions = 128;
+  size_t const kNameChars = 1024;
+  size_t const propsSize = sizeof(EVENT_TRACE_PROPERTIES) +
+                           2 * kNameChars * sizeof(wchar_t);
+
+  std::vector<BYTE> buffer(propsSize * kMaxSessions, 0);
+  std::vector<EVENT_TRACE_PROPERTIES*> sessions(kMaxSessions);
+  for (ULONG i = 0; i < kMaxSessions; ++i) {
+    auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(&buffer[i *
+                                                                  propsSize]);
+    props->Wnode.BufferSize = static_cast<ULONG>(propsSize);
+    props->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    props->LogFileNameOffset =
+      static_cast<ULONG>(sizeof(EVENT_TRACE_PROPERTIES) +
+                         kNameChars * sizeof(wchar_t));
+    sessions[i] = props;
+  }
+
+  // ERROR_MORE_DATA still fills in as many as there is room for
+  ULONG count = 0;
+  ULONG result = QueryAllTraces(sessions.data(), kMaxSessions, &count);
+  if (result != ERROR_SUCCESS && result != ERROR_MORE_DATA) {
+    return;
+  }
+
+  size_t const prefixLen = sizeof(kSessionPrefix) / sizeof(wchar_t) - 1;
+  for (ULONG i = 0; i < count && i < kMaxSessions; ++i) {
+    EVENT_TRACE_PROPERTIES* props = sessions[i];
+    auto name = reinterpret_cast<wchar_t*>(
+      reinterpret_cast<BYTE*>(props) + props->LoggerNameOffset);
+    name[kNameChars - 1] = L'\0';
+    if (wcsncmp(name, kSessionPrefix, prefixLen)) {
+      continue;
+    }
+
+    wchar_t const* tokenStart = wcsrchr(name, L'.');
+    wchar_t* end;
+    LONG64 const token = static_cast<LONG64>(
+      wcstoull(tokenStart + 1, &end, 16));
+    if (!token || *end || CpuReservation::IsOwnerAlive(token)) {
+      continue;
+    }
+
+    ControlTrace(0, name, props, EVENT_TRACE_CONTROL_STOP);
+  }
+}
+
+bool
+StartKernelSession(std::wstring const& aSessionName,
+                   EVENT_TRACE_PROPERTIES* aProperties, TRACEHANDLE& aSession)
+{
+  ULONG result = StartTrace(&aSession, aSessionName.c_str(), aProperties);
+  if (result == ERROR_SUCCESS) {
+    return true;
+  }
+
+  aSession = 0;
+  gStderr << L"Unable to start kernel trace session, error code "
+          << result;
+  if (result == ERROR_ACCESS_DENIED) {
+    gStderr << L" (kernel tracing requires administrator rights)";
+  }
+  gStderr << EndLine;
+  return false;
+}
+
+ULONG
+StopKernelSession(TRACEHANDLE aSession, EVENT_TRACE_PROPERTIES* aProperties)
+{
+  return ControlTrace(aSession, nullptr, aProperties,
+                      EVENT_TRACE_CONTROL_STOP);
+}
+
+bool
+CheckKernelSessionStopped(ULONG aResult,
+                          EVENT_TRACE_PROPERTIES const* aProperties,
+                          ULONG& aEventsLost)
+{
+  if (aResult != ERROR_SUCCESS) {
+    gStderr << L"Unable to stop kernel trace session, error code "
+            << aResult << EndLine;
+    return false;
+  }
+
+  aEventsLost = aProperties->EventsLost + aProperties->RealTimeBuffersLost;
+  return true;
+}
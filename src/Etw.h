@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Etw_h
+#define rununiproc_Etw_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <evntrace.h>
+#include <evntcons.h>
+
+// Pieces of the ETW API that are only declared by the Windows 8 SDK and
+// later, or that are shared by our kernel trace sessions.
+
+ULONG const kSystemLoggerMode = 0x02000000;
+USHORT const kExtTypePmcCounters = 0x0008;
+
+// TRACE_INFO_CLASS values
+int const kTraceStackTracingInfo = 3;
+int const kTraceProfileSourceListInfo = 7;
+int const kTracePmcEventListInfo = 8;
+int const kTracePmcCounterListInfo = 9;
+
+// The classic kernel event classes and the opcodes that we refer to
+extern GUID const kProcessEventGuid;
+extern GUID const kThreadEventGuid;
+extern GUID const kPerfInfoEventGuid;
+UCHAR const kOpcodeStart = 1;
+UCHAR const kOpcodeContextSwitch = 36;
+UCHAR const kOpcodeSampledProfile = 46;
+UCHAR const kOpcodeReadyThread = 50;
+
+// Mirrors CLASSIC_EVENT_ID
+struct ClassicEventId
+{
+  GUID EventGuid;
+  UCHAR Type;
+  UCHAR Reserved[7];
+};
+
+// Resolved at runtime so that the TRACE_INFO_CLASS values need not be
+// declared by the SDK; TraceQueryInformation is new in Windows 8
+using TraceSetInformationFn = ULONG (WINAPI*)(TRACEHANDLE, int, PVOID,
+                                              ULONG);
+using TraceQueryInformationFn = ULONG (WINAPI*)(TRACEHANDLE, int, PVOID,
+                                                ULONG, PULONG);
+
+TraceSetInformationFn GetTraceSetInformation();
+TraceQueryInformationFn GetTraceQueryInformation();
+
+/**
+ * Sizes aBuffer for, and fills in, the EVENT_TRACE_PROPERTIES of a system
+ * logger session named aSessionName that enables the kernel events in
+ * aEnableFlags. The session logs to aLogFile when it is non-null, otherwise
+ * in real time.
+ */
+EVENT_TRACE_PROPERTIES* InitTraceProperties(std::vector<BYTE>& aBuffer,
+                                            std::wstring const& aSessionName,
+                                            wchar_t const* aLogFile,
+                                            ULONG aEnableFlags);
+
+/**
+ * Names a kernel session of the given kind, such as L"trace", after this
+ * instance, so that StopOrphanedKernelSessions can tell whether its owner is
+ * still running. Reports any failure to stderr and returns false.
+ */
+bool MakeKernelSessionName(wchar_t const* aKind, std::wstring& aName);
+
+/**
+ * Stops every session named by MakeKernelSessionName whose owner has exited,
+ * such as one left running by an instance that was killed. Failures are
+ * ignored: they only leave whatever was running before.
+ */
+void StopOrphanedKernelSessions();
+
+/**
+ * Starts the session described by aProperties, as set up by
+ * InitTraceProperties. Reports any failure to stderr and returns false.
+ */
+bool StartKernelSession(std::wstring const& aSessionName,
+                        EVENT_TRACE_PROPERTIES* aProperties,
+                        TRACEHANDLE& aSession);
+
+/**
+ * Stops aSession, filling in aProperties with its final statistics. Reports
+ * nothing, so that it may run from a console control handler, and returns
+ * the result for CheckKernelSessionStopped.
+ */
+ULONG StopKernelSession(TRACEHANDLE aSession,
+                        EVENT_TRACE_PROPERTIES* aProperties);
+
+/**
+ * Reports aResult, from StopKernelSession, to stderr and returns false if it
+ * is a failure. Otherwise, sets aEventsLost to the number of events and real
+ * time buffers that the session dropped.
+ */
+bool CheckKernelSessionStopped(ULONG aResult,
+                               EVENT_TRACE_PROPERTIES const* aProperties,
+                               ULONG& aEventsLost);
+
+#endif // rununiproc_Etw_h
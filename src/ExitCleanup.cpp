@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ExitCleanup.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+SRWLOCK sLock = SRWLOCK_INIT;
+
+/**
+ * Outstanding cleanups, in the order that they were registered. Never freed,
+ * so that it outlives every static that registers.
+ */
+std::vector<ExitCleanup*>&
+Cleanups()
+{
+  static std::vector<ExitCleanup*>* sCleanups =
+    new std::vector<ExitCleanup*>();
+  return *sCleanups;
+}
+
+} // anonymous namespace
+
+BOOL WINAPI
+ExitCleanup::OnControl(DWORD aType)
+{
+  // The lock stays held: the default handler, which runs once we return
+  // FALSE, ends the process
+  AcquireSRWLockExclusive(&sLock);
+  std::vector<ExitCleanup*>& cleanups = Cleanups();
+  for (auto it = cleanups.rbegin(); it != cleanups.rend(); ++it) {
+    (*it)->Cleanup();
+  }
+  cleanups.clear();
+  return FALSE;
+}
+
+void
+ExitCleanup::Install()
+{
+  // Registered cleanups must not be missed by an early interrupt
+  Cleanups();
+  SetConsoleCtrlHandler(&OnControl, TRUE);
+}
+
+ExitCleanup::AutoLock::AutoLock()
+{
+  AcquireSRWLockExclusive(&sLock);
+}
+
+ExitCleanup::AutoLock::~AutoLock()
+{
+  ReleaseSRWLockExclusive(&sLock);
+}
+
+ExitCleanup::~ExitCleanup()
+{
+  // Our subclass is gone already, so all that is left is to forget it
+  AutoLock lock;
+  std::vector<ExitCleanup*>& cleanups = Cleanups();
+  cleanups.erase(std::remove(cleanups.begin(), cleanups.end(), this),
+                 cleanups.end());
+}
+
+void
+ExitCleanup::Register()
+{
+  std::vector<ExitCleanup*>& cleanups = Cleanups();
+  if (std::find(cleanups.begin(), cleanups.end(), this) == cleanups.end()) {
+    cleanups.push_back(this);
+  }
+}
+
+void
+ExitCleanup::RunCleanup()
+{
+  AutoLock lock;
+  std::vector<ExitCleanup*>& cleanups = Cleanups();
+  auto found = std::find(cleanups.begin(), cleanups.end(), this);
+  if (found == cleanups.end()) {
+    return;
+  }
+  cleanups.erase(found);
+  Cleanup();
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_ExitCleanup_h
+#define rununiproc_ExitCleanup_h
+
+#include <windows.h>
+
+/**
+ * The base of everything that changes state outside our own process, such as
+ * other processes' CPU sets or kernel trace sessions, and must change it back
+ * before we exit. Ctrl+C, Ctrl+Break and closing the console end the process
+ * without running destructors, so a console control handler runs every
+ * outstanding cleanup first, on its own thread. Cleanups run under a single
+ * lock, which the handler never releases, so that nothing is set up again
+ * between the handler undoing it and the process exiting.
+ */
+class ExitCleanup
+{
+public:
+  /**
+   * Installs the console control handler. Until then, cleanups only run when
+   * their owners ask.
+   */
+  static void Install();
+
+  /**
+   * Holds the cleanup lock, so that a side effect can be set up and
+   * registered without the handler running halfway through.
+   */
+  class AutoLock
+  {
+  public:
+    AutoLock();
+    ~AutoLock();
+
+    AutoLock(AutoLock const&) = delete;
+    AutoLock& operator=(AutoLock const&) = delete;
+  };
+
+protected:
+  ExitCleanup() = default;
+  ~ExitCleanup();
+
+  ExitCleanup(ExitCleanup const&) = delete;
+  ExitCleanup& operator=(ExitCleanup const&) = delete;
+
+  /**
+   * Undoes the side effect. Runs with the lock held, at most once for each
+   * call to Register, and possibly on the handler's thread, so it must not
+   * report anything or take the lock.
+   */
+  virtual void Cleanup() = 0;
+
+  /**
+   * Arranges for Cleanup to run if we are interrupted. The caller must hold
+   * an AutoLock.
+   */
+  void Register();
+
+  /**
+   * Runs Cleanup now if it is still outstanding.
+   */
+  void RunCleanup();
+
+private:
+  static BOOL WINAPI OnControl(DWORD aType);
+};
+
+#endif // rununiproc_ExitCleanup_h
@@ -0,0 +1,256 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Isolation.h"
+
+#include "CpuSelection.h"
+#include "Output.h"
+#include "UniqueHandle.h"
+
+namespace {
+
+// From IRQ_DEVICE_POLICY in wdm.h
+DWORD const kIrqPolicyAllProcessorsInMachine = 3;
+DWORD const kIrqPolicySpecifiedProcessors = 4;
+DWORD const kIrqPolicySpreadMessagesAcrossAllProcessors = 5;
+
+wchar_t const kEnumKey[] = L"SYSTEM\\CurrentControlSet\\Enum";
+wchar_t const kAffinityPolicyKey[] =
+  L"Device Parameters\\Interrupt Management\\Affinity Policy";
+
+// Longer than any device instance path component
+DWORD const kMaxKeyNameLen = 256;
+
+UniqueRegKey
+OpenKey(HKEY aParent, wchar_t const* aName)
+{
+  HKEY key = nullptr;
+  if (RegOpenKeyEx(aParent, aName, 0, KEY_READ, &key) != ERROR_SUCCESS) {
+    return UniqueRegKey();
+  }
+  return UniqueRegKey(key);
+}
+
+/**
+ * Invokes aFunc with the name and key of every subkey of aParent.
+ */
+template <typename F>
+void
+ForEachSubkey(HKEY aParent, F&& aFunc)
+{
+  wchar_t name[kMaxKeyNameLen];
+  for (DWORD index = 0;; ++index) {
+    DWORD nameLen = kMaxKeyNameLen;
+    LONG result = RegEnumKeyEx(aParent, index, name, &nameLen, nullptr,
+                               nullptr, nullptr, nullptr);
+    if (result == ERROR_NO_MORE_ITEMS) {
+      return;
+    }
+    if (result != ERROR_SUCCESS) {
+      continue;
+    }
+    UniqueRegKey key(OpenKey(aParent, name));
+    if (key) {
+      aFunc(name, key.get());
+    }
+  }
+}
+
+bool
+QueryDword(HKEY aKey, wchar_t const* aName, DWORD& aValue)
+{
+  DWORD type;
+  DWORD size = sizeof(aValue);
+  return RegQueryValueEx(aKey, aName, nullptr, &type,
+                         reinterpret_cast<BYTE*>(&aValue), &size) ==
+         ERROR_SUCCESS && type == REG_DWORD;
+}
+
+/**
+ * Reads AssignmentSetOverride, which holds a group 0 affinity mask as binary
+ * data of up to a KAFFINITY's size.
+ */
+bool
+QueryAffinityOverride(HKEY aKey, KAFFINITY& aMask)
+{
+  KAFFINITY mask = 0;
+  DWORD size = sizeof(mask);
+  if (RegQueryValueEx(aKey, L"AssignmentSetOverride", nullptr, nullptr,
+                      reinterpret_cast<BYTE*>(&mask), &size) !=
+      ERROR_SUCCESS) {
+    return false;
+  }
+  aMask = mask;
+  return true;
+}
+
+/**
+ * Returns a name for the device instance at aKey that a user would
+ * recognize, falling back to its instance path.
+ */
+std::wstring
+DeviceName(HKEY aKey, std::wstring const& aInstancePath)
+{
+  wchar_t const* const names[] = { L"FriendlyName", L"DeviceDesc" };
+  for (wchar_t const* valueName : names) {
+    wchar_t value[kMaxKeyNameLen] = {};
+    DWORD type;
+    DWORD size = sizeof(value) - sizeof(value[0]);
+    if (RegQueryValueEx(aKey, valueName, nullptr, &type,
+                        reinterpret_cast<BYTE*>(value), &size) !=
+        ERROR_SUCCESS || type != REG_SZ || !value[0]) {
+      continue;
+    }
+    // Descriptions from INF files look like "@file.inf,%id%;Description"
+    std::wstring name(value);
+    size_t const separator = name.rfind(L';');
+    return separator == std::wstring::npos ? name :
+                                             name.substr(separator + 1);
+  }
+  return aInstancePath;
+}
+
+} // anonymous namespace
+
+bool
+Isolation::Apply(Topology const& aTopology, CpuSet const& aAffinity)
+{
+  // SMT siblings share the core's execution resources, so they are isolated
+  // too
+  PlacementPolicy wholeCores;
+  wholeCores.mWholeCore = true;
+  mIsolated = OccupiedProcessors(aTopology, wholeCores, aAffinity);
+
+  if (!mReservation.Apply(mIsolated)) {
+    return false;
+  }
+
+#if defined(DEBUG)
+  gStdout << L"Isolating CPUs " << mIsolated.ToString() << EndLine;
+#endif
+
+  ReportInterruptPolicies();
+
+  mBefore.assign(mIsolated.GroupCount(), std::vector<ProcessorTimes>());
+  for (WORD group = 0; group < mIsolated.GroupCount(); ++group) {
+    if (mIsolated.GroupMask(group) &&
+        !SnapshotProcessorTimes(group, mBefore[group])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+Isolation::ReportInterruptPolicies() const
+{
+  UniqueRegKey enumKey(OpenKey(HKEY_LOCAL_MACHINE, kEnumKey));
+  if (!enumKey) {
+    gStderr << L"Unable to read device interrupt policies" << EndLine;
+    return;
+  }
+
+  // Interrupt policies only ever name processors in group 0
+  KAFFINITY const isolatedMask = mIsolated.GroupMask(0);
+
+  // Instance paths have three parts, such as PCI\VEN_8086&DEV_1234\3&11583659
+  ForEachSubkey(enumKey.get(), [&](wchar_t const* aBus, HKEY aBusKey) {
+    ForEachSubkey(aBusKey, [&](wchar_t const* aDevice, HKEY aDeviceKey) {
+      ForEachSubkey(aDeviceKey, [&](wchar_t const* aInstance,
+                                    HKEY aInstanceKey) {
+        UniqueRegKey policyKey(OpenKey(aInstanceKey, kAffinityPolicyKey));
+        DWORD policy;
+        if (!policyKey || !QueryDword(policyKey.get(), L"DevicePolicy",
+                                      policy)) {
+          return;
+        }
+
+        wchar_t const* conflict = nullptr;
+        KAFFINITY mask = 0;
+        if (policy == kIrqPolicySpecifiedProcessors &&
+            QueryAffinityOverride(policyKey.get(), mask) &&
+            (mask & isolatedMask)) {
+          conflict = L"is steered to them";
+        } else if (policy == kIrqPolicyAllProcessorsInMachine ||
+                   policy == kIrqPolicySpreadMessagesAcrossAllProcessors) {
+          conflict = L"is spread across every processor";
+        }
+        if (!conflict) {
+          return;
+        }
+
+        std::wstring const path = std::wstring(aBus) + L'\\' + aDevice +
+                                  L'\\' + aInstance;
+        gStderr << L"Interrupts from \"" << DeviceName(aInstanceKey, path)
+                << L"\" can reach the isolated CPUs: its interrupt affinity "
+                << conflict << EndLine;
+      });
+    });
+  });
+}
+
+bool
+Isolation::Stop()
+{
+  mAfter.assign(mBefore.size(), std::vector<ProcessorTimes>());
+  for (WORD group = 0; group < mBefore.size(); ++group) {
+    if (!mBefore[group].empty() &&
+        !SnapshotProcessorTimes(group, mAfter[group])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::wstring
+Isolation::FormatReport(StatsFormat aFormat) const
+{
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  if (aFormat == StatsFormat::Json) {
+    stream << L"{\"isolated\":[";
+  } else {
+    stream << L"Isolated CPU    interrupts   interrupt ms     DPC ms\n";
+  }
+
+  bool first = true;
+  mIsolated.ForEach([&](PROCESSOR_NUMBER const& aCpu) {
+    if (aCpu.Group >= mAfter.size() ||
+        aCpu.Number >= mBefore[aCpu.Group].size() ||
+        aCpu.Number >= mAfter[aCpu.Group].size()) {
+      return;
+    }
+    ProcessorTimes const& before = mBefore[aCpu.Group][aCpu.Number];
+    ProcessorTimes const& after = mAfter[aCpu.Group][aCpu.Number];
+    ULONG const interrupts = after.mInterruptCount - before.mInterruptCount;
+    // Times are in 100ns units
+    double const interruptMs = (after.mInterrupt - before.mInterrupt) /
+                               10000.0;
+    double const dpcMs = (after.mDpc - before.mDpc) / 10000.0;
+
+    if (aFormat == StatsFormat::Json) {
+      stream << (first ? L"" : L",") << L"{\"group\":" << aCpu.Group
+             << L",\"cpu\":" << aCpu.Number << L",\"interrupts\":"
+             << interrupts << L",\"interrupt_ms\":" << interruptMs
+             << L",\"dpc_ms\":" << dpcMs << L'}';
+    } else {
+      std::wstring const name = std::to_wstring(aCpu.Group) + L':' +
+                                std::to_wstring(aCpu.Number);
+      stream << L"  " << AlignLeft << SetWidth(10) << name << AlignRight
+             << SetWidth(14) << interrupts << SetWidth(15) << interruptMs
+             << SetWidth(11) << dpcMs << L"\n";
+    }
+    first = false;
+  });
+
+  if (aFormat == StatsFormat::Json) {
+    stream << L"]}\n";
+  }
+
+  return stream.str();
+}
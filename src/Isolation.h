@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Isolation_h
+#define rununiproc_Isolation_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "CpuSets.h"
+#include "JobStats.h"
+#include "ProcessorLoad.h"
+#include "Topology.h"
+
+/**
+ * Makes the cores that a child runs on as close to exclusive as user mode
+ * allows, for --isolate: every other process is moved off them by means of
+ * its default CPU sets, devices whose interrupt affinity targets them are
+ * reported, and the interrupts and DPCs that they take anyway are counted.
+ * Other processes get their CPU sets back when this is destroyed, or when we
+ * are interrupted.
+ */
+class Isolation
+{
+public:
+  Isolation() = default;
+
+  Isolation(Isolation const&) = delete;
+  Isolation& operator=(Isolation const&) = delete;
+
+  /**
+   * Isolates every core that aAffinity touches, SMT siblings included, and
+   * warns on stderr about devices whose interrupt policy steers interrupts
+   * onto them. Reports any failure to stderr and returns false.
+   */
+  bool Apply(Topology const& aTopology, CpuSet const& aAffinity);
+
+  /**
+   * Stops counting interrupts on the isolated processors. Reports any
+   * failure to stderr and returns false.
+   */
+  bool Stop();
+
+  /**
+   * Formats the interrupts and DPCs that each isolated processor took from
+   * Apply until Stop.
+   */
+  std::wstring FormatReport(StatsFormat aFormat) const;
+
+private:
+  void ReportInterruptPolicies() const;
+
+  CpuSet mIsolated;
+  CpuSetReservation mReservation;
+  // Indexed by group, then by processor number within the group
+  std::vector<std::vector<ProcessorTimes>> mBefore;
+  std::vector<std::vector<ProcessorTimes>> mAfter;
+};
+
+#endif // rununiproc_Isolation_h
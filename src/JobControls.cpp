@@ -0,0 +1,520 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "JobControls.h"
+
+#include <string>
+
+#include <wchar.h>
+#include <wctype.h>
+
+#include "Output.h"
+#include "UniqueHandle.h"
+
+namespace {
+
+// Mirrors PROCESS_POWER_THROTTLING_STATE, which older SDKs do not declare
+struct PowerThrottlingState
+{
+  ULONG Version;
+  ULONG ControlMask;
+  ULONG StateMask;
+};
+
+ULONG const kPowerThrottlingCurrentVersion = 1;
+ULONG const kPowerThrottlingExecutionSpeed = 0x1;
+int const kProcessPowerThrottling = 4;
+
+// Mirrors MEMORY_PRIORITY_INFORMATION, which is new in the Windows 8 SDK
+struct MemoryPriorityInformation
+{
+  ULONG MemoryPriority;
+};
+
+int const kProcessMemoryPriority = 0;
+
+// Mirrors WIN32_MEMORY_RANGE_ENTRY, also new in the Windows 8 SDK
+struct MemoryRangeEntry
+{
+  PVOID VirtualAddress;
+  SIZE_T NumberOfBytes;
+};
+
+using PrefetchVirtualMemoryFn = BOOL (WINAPI*)(HANDLE, ULONG_PTR,
+                                               MemoryRangeEntry*, ULONG);
+
+// Mirrors the documented prefix of PROCESS_BASIC_INFORMATION
+struct ProcessBasicInformation
+{
+  PVOID ExitStatus;
+  PVOID PebBaseAddress;
+  PVOID Reserved[2];
+  ULONG_PTR UniqueProcessId;
+  PVOID InheritedFromUniqueProcessId;
+};
+
+ULONG const kProcessBasicInformation = 0;
+// PEB::ImageBaseAddress follows four bytes of flags and the Mutant handle
+size_t const kPebImageBaseOffset = 2 * sizeof(PVOID);
+
+using NtQueryInformationProcessFn = LONG (WINAPI*)(HANDLE, ULONG, PVOID,
+                                                   ULONG, PULONG);
+
+// SetProcessInformation is new in Windows 8
+using SetProcessInformationFn = BOOL (WINAPI*)(HANDLE, int, LPVOID, DWORD);
+
+SetProcessInformationFn
+GetSetProcessInformation()
+{
+  static SetProcessInformationFn sFn =
+    reinterpret_cast<SetProcessInformationFn>(
+      GetProcAddress(GetModuleHandle(L"kernel32.dll"),
+                     "SetProcessInformation"));
+  return sFn;
+}
+
+PrefetchVirtualMemoryFn
+GetPrefetchVirtualMemory()
+{
+  static PrefetchVirtualMemoryFn sFn =
+    reinterpret_cast<PrefetchVirtualMemoryFn>(
+      GetProcAddress(GetModuleHandle(L"kernel32.dll"),
+                     "PrefetchVirtualMemory"));
+  return sFn;
+}
+
+NtQueryInformationProcessFn
+GetNtQueryInformationProcess()
+{
+  static NtQueryInformationProcessFn sFn =
+    reinterpret_cast<NtQueryInformationProcessFn>(
+      GetProcAddress(GetModuleHandle(L"ntdll.dll"),
+                     "NtQueryInformationProcess"));
+  return sFn;
+}
+
+/**
+ * Enables SeLockMemoryPrivilege in aProcess's token. A process's token can
+ * only hold privileges that its account was granted, so this fails unless
+ * the user has "Lock pages in memory".
+ */
+bool
+EnableLockMemoryPrivilege(HANDLE aProcess)
+{
+  HANDLE rawToken;
+  if (!OpenProcessToken(aProcess, TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+                        &rawToken)) {
+    DWORD err = GetLastError();
+    gStderr << L"OpenProcessToken failed with error code " << err
+            << EndLine;
+    return false;
+  }
+  UniqueHandle token(rawToken);
+
+  TOKEN_PRIVILEGES privileges = {};
+  privileges.PrivilegeCount = 1;
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  if (!LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME,
+                            &privileges.Privileges[0].Luid)) {
+    DWORD err = GetLastError();
+    gStderr << L"LookupPrivilegeValue failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  // AdjustTokenPrivileges succeeds even when it assigns nothing
+  if (!AdjustTokenPrivileges(token.get(), FALSE, &privileges, 0, nullptr,
+                             nullptr) ||
+      GetLastError() == ERROR_NOT_ALL_ASSIGNED) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to enable SeLockMemoryPrivilege, error code " << err
+            << L" (the account needs the \"Lock pages in memory\" right)"
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Reads all of aProcess's main image into memory, so that the child's first
+ * touches of its code and data are soft faults rather than disk reads. The
+ * process must be suspended, so that its image is the only one mapped that
+ * the PEB describes.
+ */
+bool
+PrefaultImage(HANDLE aProcess)
+{
+  PrefetchVirtualMemoryFn prefetch = GetPrefetchVirtualMemory();
+  NtQueryInformationProcessFn queryFn = GetNtQueryInformationProcess();
+  if (!prefetch || !queryFn) {
+    gStderr << L"Prefaulting the image requires Windows 8." << EndLine;
+    return false;
+  }
+
+  ProcessBasicInformation basicInfo = {};
+  LONG status = queryFn(aProcess, kProcessBasicInformation, &basicInfo,
+                        sizeof(basicInfo), nullptr);
+  if (status < 0) {
+    gStderr << L"NtQueryInformationProcess failed with status 0x"
+            << Hex << static_cast<ULONG>(status) << Dec << EndLine;
+    return false;
+  }
+
+  // A 32-bit rununiproc cannot read a 64-bit child's PEB this way, and it
+  // fails here
+  PVOID imageBase = nullptr;
+  char headers[4096];
+  auto const peb = static_cast<char const*>(basicInfo.PebBaseAddress);
+  if (!ReadProcessMemory(aProcess, peb + kPebImageBaseOffset, &imageBase,
+                         sizeof(imageBase), nullptr) ||
+      !ReadProcessMemory(aProcess, imageBase, headers, sizeof(headers),
+                         nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to read the child's image headers, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  // SizeOfImage is at the same offset in 32- and 64-bit optional headers
+  auto const dosHeader = reinterpret_cast<IMAGE_DOS_HEADER const*>(headers);
+  LONG const ntOffset = dosHeader->e_lfanew;
+  if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE || ntOffset < 0 ||
+      ntOffset + sizeof(IMAGE_NT_HEADERS) > sizeof(headers)) {
+    gStderr << L"The child's image headers are not valid" << EndLine;
+    return false;
+  }
+  auto const ntHeaders =
+    reinterpret_cast<IMAGE_NT_HEADERS const*>(headers + ntOffset);
+
+  MemoryRangeEntry range = {};
+  range.VirtualAddress = imageBase;
+  range.NumberOfBytes = ntHeaders->OptionalHeader.SizeOfImage;
+  if (!prefetch(aProcess, 1, &range, 0)) {
+    DWORD err = GetLastError();
+    gStderr << L"PrefetchVirtualMemory failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Parses a percentage with up to two decimal places into hundredths of a
+ * percent, which is the unit that CPU rate control uses.
+ */
+bool
+ParseRate(wchar_t const* aText, wchar_t const** aEnd, DWORD& aRate)
+{
+  wchar_t* end = nullptr;
+  unsigned long whole = wcstoul(aText, &end, 10);
+  if (end == aText) {
+    return false;
+  }
+
+  unsigned long fraction = 0;
+  if (*end == L'.') {
+    wchar_t const* digits = end + 1;
+    for (int i = 0; i < 2; ++i) {
+      fraction *= 10;
+      if (*digits >= L'0' && *digits <= L'9') {
+        fraction += *digits++ - L'0';
+      }
+    }
+    end = const_cast<wchar_t*>(digits);
+  }
+
+  if (whole > 100 || (whole == 100 && fraction)) {
+    return false;
+  }
+
+  aRate = static_cast<DWORD>(whole * 100 + fraction);
+  *aEnd = end;
+  return aRate > 0;
+}
+
+} // anonymous namespace
+
+bool
+ParsePriorityClass(wchar_t const* aSpec, DWORD& aPriorityClass)
+{
+  static struct
+  {
+    wchar_t const* mName;
+    DWORD mPriorityClass;
+  } const kPriorityClasses[] = {
+    { L"idle", IDLE_PRIORITY_CLASS },
+    { L"below", BELOW_NORMAL_PRIORITY_CLASS },
+    { L"normal", NORMAL_PRIORITY_CLASS },
+    { L"above", ABOVE_NORMAL_PRIORITY_CLASS },
+    { L"high", HIGH_PRIORITY_CLASS },
+    { L"realtime", REALTIME_PRIORITY_CLASS },
+  };
+
+  for (auto const& entry : kPriorityClasses) {
+    if (!wcscmp(aSpec, entry.mName)) {
+      aPriorityClass = entry.mPriorityClass;
+      return true;
+    }
+  }
+
+  gStderr << L"Unknown priority class \"" << aSpec << L"\"" << EndLine;
+  return false;
+}
+
+bool
+ParseCpuRate(wchar_t const* aSpec,
+             JOBOBJECT_CPU_RATE_CONTROL_INFORMATION& aCpuRate)
+{
+  aCpuRate = {};
+  wchar_t const* end = nullptr;
+
+  if (!wcsncmp(aSpec, L"cap:", 4)) {
+    DWORD rate;
+    if (ParseRate(aSpec + 4, &end, rate) && !*end) {
+      aCpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                              JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+      aCpuRate.CpuRate = rate;
+      return true;
+    }
+  } else if (!wcsncmp(aSpec, L"weight:", 7)) {
+    wchar_t* weightEnd = nullptr;
+    unsigned long weight = wcstoul(aSpec + 7, &weightEnd, 10);
+    if (weightEnd != aSpec + 7 && !*weightEnd && weight >= 1 && weight <= 9) {
+      aCpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                              JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED;
+      aCpuRate.Weight = weight;
+      return true;
+    }
+  } else if (!wcsncmp(aSpec, L"minmax:", 7)) {
+    DWORD minRate, maxRate;
+    if (ParseRate(aSpec + 7, &end, minRate) && *end == L'-' &&
+        ParseRate(end + 1, &end, maxRate) && !*end && minRate <= maxRate) {
+      aCpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+                              JOB_OBJECT_CPU_RATE_CONTROL_MIN_MAX_RATE;
+      aCpuRate.MinRate = static_cast<WORD>(minRate);
+      aCpuRate.MaxRate = static_cast<WORD>(maxRate);
+      return true;
+    }
+  }
+
+  gStderr << L"Invalid CPU rate \"" << aSpec << L"\"" << EndLine;
+  return false;
+}
+
+bool
+ParseExecutionQos(wchar_t const* aSpec, ExecutionQos& aQos)
+{
+  if (!wcscmp(aSpec, L"default")) {
+    aQos = ExecutionQos::Default;
+  } else if (!wcscmp(aSpec, L"high")) {
+    aQos = ExecutionQos::High;
+  } else if (!wcscmp(aSpec, L"eco")) {
+    aQos = ExecutionQos::Eco;
+  } else {
+    gStderr << L"Unknown QoS \"" << aSpec << L"\"" << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ParseMemoryPriority(wchar_t const* aSpec, ULONG& aMemoryPriority)
+{
+  // The MEMORY_PRIORITY_* values
+  static struct
+  {
+    wchar_t const* mName;
+    ULONG mMemoryPriority;
+  } const kMemoryPriorities[] = {
+    { L"very-low", 1 },
+    { L"low", 2 },
+    { L"medium", 3 },
+    { L"below", 4 },
+    { L"normal", 5 },
+  };
+
+  for (auto const& entry : kMemoryPriorities) {
+    if (!wcscmp(aSpec, entry.mName)) {
+      aMemoryPriority = entry.mMemoryPriority;
+      return true;
+    }
+  }
+
+  gStderr << L"Unknown memory priority \"" << aSpec << L"\"" << EndLine;
+  return false;
+}
+
+bool
+ParseMemorySize(wchar_t const* aOption, wchar_t const* aSpec, SIZE_T& aSize)
+{
+  wchar_t* end = nullptr;
+  unsigned long long value = wcstoull(aSpec, &end, 10);
+  unsigned int shift = 0;
+  if (end != aSpec) {
+    switch (towupper(*end)) {
+      case L'K':
+        shift = 10;
+        break;
+      case L'M':
+        shift = 20;
+        break;
+      case L'G':
+        shift = 30;
+        break;
+    }
+    if (shift) {
+      ++end;
+    }
+  }
+
+  // Reject sizes that overflow, and those that do not fit in a SIZE_T on
+  // 32-bit builds
+  unsigned long long const maxValue = static_cast<SIZE_T>(-1);
+  if (end == aSpec || *end || !value || value > (maxValue >> shift)) {
+    gStderr << L"Invalid size \"" << aSpec << L"\" for --" << aOption
+            << EndLine;
+    return false;
+  }
+
+  aSize = static_cast<SIZE_T>(value << shift);
+  return true;
+}
+
+bool
+ParseWorkingSet(wchar_t const* aSpec, SIZE_T& aMin, SIZE_T& aMax)
+{
+  wchar_t const* comma = wcschr(aSpec, L',');
+  if (!comma) {
+    gStderr << L"--working-set requires <min>,<max>" << EndLine;
+    return false;
+  }
+
+  std::wstring minSpec(aSpec, comma);
+  if (!ParseMemorySize(L"working-set", minSpec.c_str(), aMin) ||
+      !ParseMemorySize(L"working-set", comma + 1, aMax)) {
+    return false;
+  }
+
+  if (aMin > aMax) {
+    gStderr << L"The minimum working set exceeds the maximum" << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ApplyJobControls(HANDLE aJob, JobControls const& aControls,
+                 JOBOBJECT_EXTENDED_LIMIT_INFORMATION& aLimits)
+{
+  JOBOBJECT_BASIC_LIMIT_INFORMATION& basic = aLimits.BasicLimitInformation;
+  if (aControls.mPriorityClass) {
+    basic.LimitFlags |= JOB_OBJECT_LIMIT_PRIORITY_CLASS;
+    basic.PriorityClass = aControls.mPriorityClass;
+  }
+
+  // Members of a job with a working set limit cannot have their own limits
+  // changed, so hard limits are left to ApplyProcessControls alone
+  if (aControls.mMaxWorkingSet && !aControls.mHardWorkingSet) {
+    basic.LimitFlags |= JOB_OBJECT_LIMIT_WORKINGSET;
+    basic.MinimumWorkingSetSize = aControls.mMinWorkingSet;
+    basic.MaximumWorkingSetSize = aControls.mMaxWorkingSet;
+  }
+
+  if (aControls.mProcessMemoryLimit) {
+    basic.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+    aLimits.ProcessMemoryLimit = aControls.mProcessMemoryLimit;
+  }
+
+  if (aControls.mJobMemoryLimit) {
+    basic.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+    aLimits.JobMemoryLimit = aControls.mJobMemoryLimit;
+  }
+
+  if (aControls.mCpuRate.ControlFlags) {
+    JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuRate = aControls.mCpuRate;
+    if (!SetInformationJobObject(aJob, JobObjectCpuRateControlInformation,
+                                 &cpuRate, sizeof(cpuRate))) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to set CPU rate control on job object, error "
+                 L"code " << err << L" (requires Windows 8)" << EndLine;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+ApplyProcessControls(HANDLE aProcess, JobControls const& aControls)
+{
+  // Job limits leave the memory manager free to let the working set grow
+  // past its maximum while memory is plentiful; hard limits do not. The job
+  // has no working set limit in this case, so the child's may be set.
+  if (aControls.mHardWorkingSet &&
+      !SetProcessWorkingSetSizeEx(aProcess, aControls.mMinWorkingSet,
+                                  aControls.mMaxWorkingSet,
+                                  QUOTA_LIMITS_HARDWS_MIN_DISABLE |
+                                  QUOTA_LIMITS_HARDWS_MAX_ENABLE)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to set a hard working set limit, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  if (aControls.mLockMemory && !EnableLockMemoryPrivilege(aProcess)) {
+    return false;
+  }
+
+  if (aControls.mPrefaultImage && !PrefaultImage(aProcess)) {
+    return false;
+  }
+
+  if (aControls.mQos == ExecutionQos::Default &&
+      !aControls.mMemoryPriority) {
+    return true;
+  }
+
+  SetProcessInformationFn setInfo = GetSetProcessInformation();
+  if (!setInfo) {
+    gStderr << L"Memory priority and power throttling control require "
+               L"Windows 8 and Windows 10 respectively." << EndLine;
+    return false;
+  }
+
+  if (aControls.mMemoryPriority) {
+    MemoryPriorityInformation priority = { aControls.mMemoryPriority };
+    if (!setInfo(aProcess, kProcessMemoryPriority, &priority,
+                 sizeof(priority))) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to set memory priority, error code " << err
+              << EndLine;
+      return false;
+    }
+  }
+
+  if (aControls.mQos == ExecutionQos::Default) {
+    return true;
+  }
+
+  PowerThrottlingState state = {};
+  state.Version = kPowerThrottlingCurrentVersion;
+  state.ControlMask = kPowerThrottlingExecutionSpeed;
+  state.StateMask = aControls.mQos == ExecutionQos::Eco ?
+                    kPowerThrottlingExecutionSpeed : 0;
+
+  if (!setInfo(aProcess, kProcessPowerThrottling, &state, sizeof(state))) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to set power throttling state, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  return true;
+}
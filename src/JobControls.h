@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_JobControls_h
+#define rununiproc_JobControls_h
+
+#include <windows.h>
+
+/**
+ * The power throttling state requested for the child.
+ */
+enum class ExecutionQos
+{
+  // Leave it up to the system
+  Default,
+  // Opt out of power throttling, which keeps the child on the fastest cores
+  High,
+  // Opt in to power throttling (EcoQoS)
+  Eco
+};
+
+/**
+ * Resource controls applied to the child's job and process, beyond affinity.
+ */
+struct JobControls
+{
+  // Applied as JOB_OBJECT_LIMIT_PRIORITY_CLASS when non-zero
+  DWORD mPriorityClass = 0;
+  // Applied as JobObjectCpuRateControlInformation when ControlFlags is set
+  JOBOBJECT_CPU_RATE_CONTROL_INFORMATION mCpuRate = {};
+  ExecutionQos mQos = ExecutionQos::Default;
+  // Applied as JOB_OBJECT_LIMIT_PROCESS_MEMORY and JOB_OBJECT_LIMIT_JOB_MEMORY
+  // when non-zero
+  SIZE_T mProcessMemoryLimit = 0;
+  SIZE_T mJobMemoryLimit = 0;
+  // Applied as JOB_OBJECT_LIMIT_WORKINGSET when mMaxWorkingSet is non-zero
+  SIZE_T mMinWorkingSet = 0;
+  SIZE_T mMaxWorkingSet = 0;
+  // Apply the working set limits as hard limits on the child process instead
+  // of as job limits, which would keep them from being set
+  bool mHardWorkingSet = false;
+  // A MEMORY_PRIORITY_* value for the child's pages, or zero to leave it
+  ULONG mMemoryPriority = 0;
+  // Enable SeLockMemoryPrivilege in the child's token, so that it may
+  // allocate large pages
+  bool mLockMemory = false;
+  // Read the child's image into memory before it starts
+  bool mPrefaultImage = false;
+};
+
+/**
+ * Parses a --priority= value: idle, below, normal, above, high or realtime.
+ * Reports any failure to stderr and returns false.
+ */
+bool ParsePriorityClass(wchar_t const* aSpec, DWORD& aPriorityClass);
+
+/**
+ * Parses a --cpu-rate= value:
+ *
+ *   cap:<percent>           Hard cap on the job's share of all CPU time
+ *   weight:<1-9>            Relative weight against other weighted jobs
+ *   minmax:<min>-<max>      Guaranteed minimum and hard maximum percentages
+ *
+ * Percentages may have up to two decimal places. Reports any failure to
+ * stderr and returns false.
+ */
+bool ParseCpuRate(wchar_t const* aSpec,
+                  JOBOBJECT_CPU_RATE_CONTROL_INFORMATION& aCpuRate);
+
+/**
+ * Parses a --qos= value: default, high or eco. Reports any failure to stderr
+ * and returns false.
+ */
+bool ParseExecutionQos(wchar_t const* aSpec, ExecutionQos& aQos);
+
+/**
+ * Parses a --memory-priority= value: very-low, low, medium, below or normal.
+ * Reports any failure to stderr and returns false.
+ */
+bool ParseMemoryPriority(wchar_t const* aSpec, ULONG& aMemoryPriority);
+
+/**
+ * Parses a memory size: a number of bytes, optionally followed by K, M or G
+ * for multiples of 1024. Reports any failure to stderr, naming the option
+ * aOption, and returns false.
+ */
+bool ParseMemorySize(wchar_t const* aOption, wchar_t const* aSpec,
+                     SIZE_T& aSize);
+
+/**
+ * Parses a --working-set= value, <min>,<max>, each a memory size. Reports any
+ * failure to stderr and returns false.
+ */
+bool ParseWorkingSet(wchar_t const* aSpec, SIZE_T& aMin, SIZE_T& aMax);
+
+/**
+ * Applies the job-wide controls in aControls to aJob, adding any limits to
+ * aLimits for the caller to set along with its own. Reports any failure to
+ * stderr and returns false.
+ */
+bool ApplyJobControls(HANDLE aJob, JobControls const& aControls,
+                      JOBOBJECT_EXTENDED_LIMIT_INFORMATION& aLimits);
+
+/**
+ * Applies the per-process controls in aControls to the suspended child
+ * aProcess. Reports any failure to stderr and returns false.
+ */
+bool ApplyProcessControls(HANDLE aProcess, JobControls const& aControls);
+
+#endif // rununiproc_JobControls_h
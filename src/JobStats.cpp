@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "JobStats.h"
+
+#include "Output.h"
+#include "UniqueHandle.h"
+
+namespace {
+
+/**
+ * Converts a duration in 100ns units to milliseconds.
+ */
+double
+ToMs(LARGE_INTEGER const& aDuration)
+{
+  return static_cast<double>(aDuration.QuadPart) / 10000.0;
+}
+
+void
+AppendJsonString(StringWriter& aStream, wchar_t const* aText)
+{
+  aStream << L'"';
+  for (wchar_t const* c = aText; *c; ++c) {
+    switch (*c) {
+      case L'"':
+        aStream << L"\\\"";
+        break;
+      case L'\\':
+        aStream << L"\\\\";
+        break;
+      case L'\t':
+        aStream << L"\\t";
+        break;
+      default:
+        if (*c < 0x20) {
+          aStream << L"\\u00" << L"0123456789abcdef"[*c >> 4]
+                  << L"0123456789abcdef"[*c & 0xf];
+        } else {
+          aStream << *c;
+        }
+        break;
+    }
+  }
+  aStream << L'"';
+}
+
+} // anonymous namespace
+
+LONGLONG
+StatsTimestamp()
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+bool
+QueryJobStats(HANDLE aJob, LONGLONG aStart, LONGLONG aEnd, JobStats& aStats)
+{
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  aStats.mWallMs = static_cast<double>(aEnd - aStart) * 1000.0 /
+                   static_cast<double>(frequency.QuadPart);
+
+  if (!QueryInformationJobObject(aJob,
+                                 JobObjectBasicAndIoAccountingInformation,
+                                 &aStats.mAccounting,
+                                 sizeof(aStats.mAccounting), nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to query job accounting information, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInfo = {};
+  if (!QueryInformationJobObject(aJob, JobObjectExtendedLimitInformation,
+                                 &limitInfo, sizeof(limitInfo), nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to query job limit information, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  aStats.mPeakProcessMemory = limitInfo.PeakProcessMemoryUsed;
+  aStats.mPeakJobMemory = limitInfo.PeakJobMemoryUsed;
+  return true;
+}
+
+std::wstring
+FormatJobStats(JobStats const& aStats, StatsFormat aFormat, size_t aIndex,
+               wchar_t const* aCommand)
+{
+  JOBOBJECT_BASIC_ACCOUNTING_INFORMATION const& basic =
+    aStats.mAccounting.BasicInfo;
+  IO_COUNTERS const& io = aStats.mAccounting.IoInfo;
+
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  if (aFormat == StatsFormat::Json) {
+    stream << L'{';
+    if (aCommand) {
+      stream << L"\"index\":" << aIndex << L",\"command\":";
+      AppendJsonString(stream, aCommand);
+      stream << L',';
+    }
+    stream << L"\"wall_ms\":" << aStats.mWallMs
+           << L",\"user_ms\":" << ToMs(basic.TotalUserTime)
+           << L",\"kernel_ms\":" << ToMs(basic.TotalKernelTime)
+           << L",\"page_faults\":" << basic.TotalPageFaultCount
+           << L",\"processes\":" << basic.TotalProcesses
+           << L",\"read_ops\":" << io.ReadOperationCount
+           << L",\"write_ops\":" << io.WriteOperationCount
+           << L",\"other_ops\":" << io.OtherOperationCount
+           << L",\"read_bytes\":" << io.ReadTransferCount
+           << L",\"write_bytes\":" << io.WriteTransferCount
+           << L",\"other_bytes\":" << io.OtherTransferCount
+           << L",\"peak_process_memory\":" << aStats.mPeakProcessMemory
+           << L",\"peak_job_memory\":" << aStats.mPeakJobMemory
+           << L"}\n";
+    return stream.str();
+  }
+
+  if (aCommand) {
+    stream << L"[" << aIndex << L"] " << aCommand << L"\n";
+  }
+  stream << L"  wall time:           " << aStats.mWallMs << L" ms\n"
+         << L"  user time:           " << ToMs(basic.TotalUserTime)
+         << L" ms\n"
+         << L"  kernel time:         " << ToMs(basic.TotalKernelTime)
+         << L" ms\n"
+         << L"  page faults:         " << basic.TotalPageFaultCount << L"\n"
+         << L"  processes:           " << basic.TotalProcesses << L"\n"
+         << L"  reads:               " << io.ReadOperationCount << L" ("
+         << io.ReadTransferCount << L" bytes)\n"
+         << L"  writes:              " << io.WriteOperationCount << L" ("
+         << io.WriteTransferCount << L" bytes)\n"
+         << L"  other I/O:           " << io.OtherOperationCount << L" ("
+         << io.OtherTransferCount << L" bytes)\n"
+         << L"  peak process memory: " << aStats.mPeakProcessMemory
+         << L" bytes\n"
+         << L"  peak job memory:     " << aStats.mPeakJobMemory
+         << L" bytes\n";
+  return stream.str();
+}
+
+bool
+WriteStatsReport(wchar_t const* aPath, std::wstring const& aReport)
+{
+  if (!aPath) {
+    gStderr << aReport << Flush;
+    return true;
+  }
+
+  std::string bytes;
+  if (!aReport.empty()) {
+    int srcLen = static_cast<int>(aReport.size());
+    int len = WideCharToMultiByte(CP_UTF8, 0, aReport.data(), srcLen,
+                                  nullptr, 0, nullptr, nullptr);
+    bytes.resize(len);
+    WideCharToMultiByte(CP_UTF8, 0, aReport.data(), srcLen, &bytes[0], len,
+                        nullptr, nullptr);
+  }
+
+  UniqueHandle file(CreateFile(aPath, GENERIC_WRITE, FILE_SHARE_READ,
+                               nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                               nullptr));
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create stats file \"" << aPath
+            << L"\", error code " << err << EndLine;
+    return false;
+  }
+
+  DWORD written;
+  if (!WriteFile(file.get(), bytes.data(), static_cast<DWORD>(bytes.size()),
+                 &written, nullptr) || written != bytes.size()) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to write stats file \"" << aPath
+            << L"\", error code " << err << EndLine;
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_JobStats_h
+#define rununiproc_JobStats_h
+
+#include <string>
+
+#include <windows.h>
+
+enum class StatsFormat
+{
+  None,
+  Text,
+  Json
+};
+
+/**
+ * Resource usage accumulated by every process in a child's job.
+ */
+struct JobStats
+{
+  // From the child being resumed until we saw it exit
+  double mWallMs = 0.0;
+  JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION mAccounting = {};
+  SIZE_T mPeakProcessMemory = 0;
+  SIZE_T mPeakJobMemory = 0;
+};
+
+/**
+ * Returns a high resolution timestamp for use with QueryJobStats.
+ */
+LONGLONG StatsTimestamp();
+
+/**
+ * Reads aJob's accounting and peak memory information into aStats. The wall
+ * clock time is the interval between the timestamps aStart and aEnd. Reports
+ * any failure to stderr and returns false.
+ */
+bool QueryJobStats(HANDLE aJob, LONGLONG aStart, LONGLONG aEnd,
+                   JobStats& aStats);
+
+/**
+ * Formats aStats as a report. When aCommand is non-null, it and aIndex
+ * identify which batch command the report belongs to. Json reports are a
+ * single line each, so that a batch produces one object per line.
+ */
+std::wstring FormatJobStats(JobStats const& aStats, StatsFormat aFormat,
+                            size_t aIndex = 0,
+                            wchar_t const* aCommand = nullptr);
+
+/**
+ * Writes aReport to aPath as UTF-8, replacing any existing file, or to stderr
+ * when aPath is null. Reports any failure to stderr and returns false.
+ */
+bool WriteStatsReport(wchar_t const* aPath, std::wstring const& aReport);
+
+#endif // rununiproc_JobStats_h
@@ -0,0 +1,828 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Launcher.h"
+
+#include "CpuSets.h"
+#include "JobControls.h"
+#include "Output.h"
+#include "Timings.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+// What cmd.exe searches for when PATHEXT is not set
+static wchar_t const kDefaultPathExt[] = L".COM;.EXE;.BAT;.CMD";
+
+static bool
+IsBatchScript(wchar_t const* aExt)
+{
+  return !_wcsicmp(aExt, L".bat") || !_wcsicmp(aExt, L".cmd");
+}
+
+/**
+ * Only these can be started by CreateProcess, batch scripts by way of the
+ * command interpreter. Other PATHEXT types need ShellExecute's associations.
+ */
+static bool
+IsLaunchable(wchar_t const* aExt)
+{
+  return !_wcsicmp(aExt, L".exe") || !_wcsicmp(aExt, L".com") ||
+         IsBatchScript(aExt);
+}
+
+/**
+ * Returns the extension of aPath, including its dot, or nullptr if it has
+ * none.
+ */
+static wchar_t const*
+FindExtension(wchar_t const* aPath)
+{
+  wchar_t const* dot = wcsrchr(aPath, L'.');
+  if (!dot || wcspbrk(dot, L"\\/:")) {
+    return nullptr;
+  }
+  return dot;
+}
+
+static bool
+IsFile(std::wstring const& aPath)
+{
+  DWORD attributes = GetFileAttributes(aPath.c_str());
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+         !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+/**
+ * Sets aPath to the full path of aCandidate, which may be relative to the
+ * current directory, if it names a file.
+ */
+static bool
+FindCandidate(std::wstring const& aCandidate, std::wstring& aPath)
+{
+  // Most paths fit in MAX_PATH; GetFullPathName tells us how much room it
+  // needs when they do not, in which case we ask again with enough.
+  wchar_t pathBuf[MAX_PATH];
+  DWORD pathLen = GetFullPathName(aCandidate.c_str(), MAX_PATH, pathBuf,
+                                  nullptr);
+  if (!pathLen) {
+    return false;
+  }
+  if (pathLen < MAX_PATH) {
+    aPath.assign(pathBuf, pathLen);
+  } else {
+    aPath.resize(pathLen);
+    pathLen = GetFullPathName(aCandidate.c_str(), pathLen, &aPath[0],
+                              nullptr);
+    if (!pathLen || pathLen >= aPath.size()) {
+      return false;
+    }
+    aPath.resize(pathLen);
+  }
+
+  return IsFile(aPath);
+}
+
+/**
+ * Appends to aDirs the directories that cmd.exe searches, in order, for
+ * aName when it has no directory of its own: the current directory (as an
+ * empty string) unless NoDefaultCurrentDirectoryInExePath excludes it, then
+ * each PATH entry.
+ */
+static void
+GetSearchDirectories(wchar_t const* aName, std::vector<std::wstring>& aDirs)
+{
+  if (NeedCurrentDirectoryForExePath(aName)) {
+    aDirs.emplace_back();
+  }
+
+  std::wstring path;
+  DWORD len = GetEnvironmentVariable(L"PATH", nullptr, 0);
+  if (len) {
+    path.resize(len);
+    len = GetEnvironmentVariable(L"PATH", &path[0], len);
+    path.resize(len < path.size() ? len : 0);
+  }
+
+  size_t pos = 0;
+  while (pos < path.size()) {
+    size_t end = path.find(L';', pos);
+    if (end == std::wstring::npos) {
+      end = path.size();
+    }
+
+    // Entries may be quoted so that they can contain semicolons
+    std::wstring dir;
+    for (size_t i = pos; i < end; ++i) {
+      if (path[i] != L'"') {
+        dir += path[i];
+      }
+    }
+    pos = end + 1;
+
+    if (!dir.empty()) {
+      aDirs.push_back(std::move(dir));
+    }
+  }
+}
+
+bool
+ResolveExecutable(wchar_t const* aName, std::wstring& aExePath,
+                  PathCache* aCache)
+{
+  // Names with directories are not looked up on the PATH, so they are quick
+  // to resolve and are not worth caching.
+  bool const hasDirectory = !!wcspbrk(aName, L"\\/:");
+  if (!hasDirectory && aCache && aCache->Lookup(aName, aExePath)) {
+    return true;
+  }
+
+  // As cmd.exe does, take the name as given if it already has a usable
+  // extension, and otherwise try each PATHEXT extension in turn.
+  std::vector<std::wstring> exts;
+  wchar_t const* ext = FindExtension(aName);
+  if (ext && IsLaunchable(ext)) {
+    exts.emplace_back();
+  }
+
+  DWORD const pathExtBufLen = 256;
+  wchar_t pathExtBuf[pathExtBufLen];
+  DWORD len = GetEnvironmentVariable(L"PATHEXT", pathExtBuf, pathExtBufLen);
+  wchar_t const* pathExt = len && len < pathExtBufLen ? pathExtBuf :
+                           kDefaultPathExt;
+  for (wchar_t const* cur = pathExt; *cur;) {
+    wchar_t const* sep = wcschr(cur, L';');
+    size_t extLen = sep ? sep - cur : wcslen(cur);
+    std::wstring thisExt(cur, extLen);
+    cur += extLen + (sep ? 1 : 0);
+    if (!thisExt.empty() && IsLaunchable(thisExt.c_str())) {
+      exts.push_back(std::move(thisExt));
+    }
+  }
+
+  // Every extension is tried in one directory before the next directory is
+  // searched, so an earlier PATH entry wins whatever the extension.
+  std::vector<std::wstring> dirs;
+  if (hasDirectory) {
+    dirs.emplace_back();
+  } else {
+    GetSearchDirectories(aName, dirs);
+  }
+
+  bool found = false;
+  std::wstring candidate;
+  for (size_t i = 0; i < dirs.size() && !found; ++i) {
+    std::wstring prefix(dirs[i]);
+    if (!prefix.empty() && prefix.back() != L'\\' && prefix.back() != L'/') {
+      prefix += L'\\';
+    }
+    prefix += aName;
+
+    for (size_t j = 0; j < exts.size() && !found; ++j) {
+      candidate = prefix;
+      candidate += exts[j];
+      found = FindCandidate(candidate, aExePath);
+    }
+  }
+
+  if (!found) {
+    gStderr << L"Unable to find an executable named " << aName << EndLine;
+    return false;
+  }
+
+  if (!hasDirectory && aCache) {
+    aCache->Store(aName, aExePath);
+  }
+  return true;
+}
+
+/**
+ * Arguments are quoted so that CommandLineToArgvW, and the CRT's own parsing,
+ * recover them exactly: only arguments that are empty or that contain
+ * whitespace or quotes are quoted, with embedded quotes escaped and the
+ * backslashes that precede a quote doubled.
+ *
+ * Batch scripts get their arguments from cmd.exe instead, which splits them
+ * at more than whitespace, treats & | < > ^ and parentheses as operators
+ * outside quotes, knows no escape for a quote within quotes, and expands
+ * %VAR% even within them. Their arguments are quoted whenever they contain
+ * anything cmd would split at or interpret, with nothing escaped, and those
+ * containing characters in kCmdUnsafe are refused.
+ */
+static wchar_t const kCmdSpecial[] = L" \t\v\f&|<>^()[]{}=;!'+,`~";
+static wchar_t const kCmdUnsafe[] = L"\"%\r\n";
+
+static bool
+NeedsQuotes(wchar_t const* aArg, bool aForCmd)
+{
+  return !*aArg || wcspbrk(aArg, aForCmd ? kCmdSpecial : L" \t\n\v\"");
+}
+
+/**
+ * Returns the number of characters that AppendArgument adds for aArg.
+ */
+static size_t
+QuotedLength(wchar_t const* aArg, bool aForCmd)
+{
+  if (!NeedsQuotes(aArg, aForCmd)) {
+    return wcslen(aArg);
+  }
+  if (aForCmd) {
+    return wcslen(aArg) + 2;
+  }
+
+  size_t length = 2;
+  size_t backslashes = 0;
+  for (wchar_t const* c = aArg; *c; ++c) {
+    if (*c == L'\\') {
+      ++backslashes;
+      continue;
+    }
+    if (*c == L'"') {
+      length += backslashes + 1;
+    }
+    length += backslashes + 1;
+    backslashes = 0;
+  }
+
+  // Backslashes at the end precede our closing quote
+  return length + backslashes * 2;
+}
+
+static void
+AppendArgument(std::wstring& aCmdLine, wchar_t const* aArg, bool aForCmd)
+{
+  if (!NeedsQuotes(aArg, aForCmd)) {
+    aCmdLine += aArg;
+    return;
+  }
+
+  aCmdLine += L'"';
+  if (aForCmd) {
+    aCmdLine += aArg;
+    aCmdLine += L'"';
+    return;
+  }
+
+  size_t backslashes = 0;
+  for (wchar_t const* c = aArg; *c; ++c) {
+    if (*c == L'\\') {
+      ++backslashes;
+      continue;
+    }
+    if (*c == L'"') {
+      aCmdLine.append(backslashes * 2 + 1, L'\\');
+    } else {
+      aCmdLine.append(backslashes, L'\\');
+    }
+    aCmdLine += *c;
+    backslashes = 0;
+  }
+  aCmdLine.append(backslashes * 2, L'\\');
+  aCmdLine += L'"';
+}
+
+/**
+ * Returns true if aCmdLine can be handed to cmd.exe without it expanding or
+ * acting on any part of it: it has no characters from kCmdUnsafe other than
+ * quotes, and no operators outside them. Reports the failure to stderr and
+ * returns false otherwise.
+ */
+static bool
+CheckCmdCommandLine(wchar_t const* aCmdLine)
+{
+  bool inQuotes = false;
+  for (wchar_t const* c = aCmdLine; *c; ++c) {
+    if (*c == L'"') {
+      // cmd has no escape for quotes; each one toggles its quoting
+      inQuotes = !inQuotes;
+    } else if (wcschr(kCmdUnsafe, *c) ||
+               (!inQuotes && wcschr(L"&|<>^()", *c))) {
+      gStderr << L"Batch scripts cannot be given arguments containing % or"
+                 L" line breaks, nor & | < > ^ ( ) outside quotes, which"
+                 L" cmd.exe would act on." << EndLine;
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Starts a command line with the quoted aExePath, reserving aLength
+ * characters in all. Paths cannot contain quotes, so none need escaping.
+ */
+static void
+StartCommandLine(std::wstring const& aExePath, size_t aLength,
+                 std::wstring& aCmdLine)
+{
+  aCmdLine.clear();
+  aCmdLine.reserve(aLength);
+  aCmdLine += L'"';
+  aCmdLine += aExePath;
+  aCmdLine += L'"';
+}
+
+ResponseFile::~ResponseFile()
+{
+  if (!mPath.empty()) {
+    DeleteFile(mPath.c_str());
+  }
+}
+
+bool
+ResponseFile::Write(std::wstring const& aArgs)
+{
+  wchar_t dir[MAX_PATH + 1];
+  wchar_t path[MAX_PATH];
+  DWORD dirLen = GetTempPath(MAX_PATH + 1, dir);
+  if (!dirLen || dirLen > MAX_PATH ||
+      !GetTempFileName(dir, L"rsp", 0, path)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create a response file, error code " << err
+            << EndLine;
+    return false;
+  }
+  // GetTempFileName created the file, so it is ours to delete from now on
+  mPath = path;
+
+  std::string bytes;
+  if (!aArgs.empty()) {
+    int srcLen = static_cast<int>(aArgs.size());
+    int len = WideCharToMultiByte(CP_UTF8, 0, aArgs.data(), srcLen, nullptr,
+                                  0, nullptr, nullptr);
+    bytes.resize(len);
+    WideCharToMultiByte(CP_UTF8, 0, aArgs.data(), srcLen, &bytes[0], len,
+                        nullptr, nullptr);
+  }
+
+  UniqueHandle file(CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                               TRUNCATE_EXISTING, FILE_ATTRIBUTE_TEMPORARY,
+                               nullptr));
+  DWORD written;
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+  } else if (WriteFile(file.get(), bytes.data(),
+                       static_cast<DWORD>(bytes.size()), &written,
+                       nullptr) && written == bytes.size()) {
+    return true;
+  }
+
+  DWORD err = GetLastError();
+  gStderr << L"Unable to write response file \"" << mPath
+          << L"\", error code " << err << EndLine;
+  return false;
+}
+
+bool
+BuildCommandLine(std::wstring const& aExePath, int aArgc, wchar_t* aArgv[],
+                 std::wstring& aCmdLine, ResponseFile* aResponseFile)
+{
+  wchar_t const* ext = FindExtension(aExePath.c_str());
+  bool const forCmd = ext && IsBatchScript(ext);
+  if (forCmd) {
+    for (int i = 0; i < aArgc; ++i) {
+      if (wcspbrk(aArgv[i], kCmdUnsafe)) {
+        gStderr << L"Argument \"" << aArgv[i] << L"\" cannot be passed to"
+                   L" a batch script: cmd.exe would act on its quotes,"
+                   L" percent signs or line breaks." << EndLine;
+        return false;
+      }
+    }
+  }
+
+  // Size the result up front so that it is built with a single allocation
+  size_t const exeLength = aExePath.size() + 2;
+  size_t length = exeLength;
+  for (int i = 0; i < aArgc; ++i) {
+    length += 1 + QuotedLength(aArgv[i], forCmd);
+  }
+
+  if (length < kMaxCommandLineLen) {
+    StartCommandLine(aExePath, length, aCmdLine);
+    for (int i = 0; i < aArgc; ++i) {
+      aCmdLine += L' ';
+      AppendArgument(aCmdLine, aArgv[i], forCmd);
+    }
+    return true;
+  }
+
+  if (!aResponseFile) {
+    gStderr << L"Command line is too long for CreateProcess" << EndLine;
+    return false;
+  }
+
+  // Hand the arguments over in a file instead, as @path
+  std::wstring args;
+  args.reserve(length - exeLength);
+  for (int i = 0; i < aArgc; ++i) {
+    if (i) {
+      args += L' ';
+    }
+    AppendArgument(args, aArgv[i], false);
+  }
+  if (!aResponseFile->Write(args)) {
+    return false;
+  }
+
+  std::wstring const ref = L"@" + aResponseFile->Path();
+  StartCommandLine(aExePath,
+                   exeLength + 1 + QuotedLength(ref.c_str(), forCmd),
+                   aCmdLine);
+  aCmdLine += L' ';
+  AppendArgument(aCmdLine, ref.c_str(), forCmd);
+  if (aCmdLine.size() >= kMaxCommandLineLen) {
+    gStderr << L"Command line is too long for CreateProcess" << EndLine;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Returns the rest of aCmdLine after its first aCount arguments and the
+ * whitespace that follows them, parsing as the CRT does for argv.
+ */
+static wchar_t const*
+SkipArguments(wchar_t const* aCmdLine, int aCount)
+{
+  auto isSpace = [](wchar_t aChar) {
+    return aChar == L' ' || aChar == L'\t';
+  };
+
+  wchar_t const* cur = aCmdLine;
+  for (int i = 0; i < aCount && *cur; ++i) {
+    bool inQuotes = false;
+    while (*cur && (inQuotes || !isSpace(*cur))) {
+      // Backslashes are not special in the program name
+      if (*cur == L'\\' && i > 0) {
+        size_t backslashes = wcsspn(cur, L"\\");
+        cur += backslashes;
+        // An odd number of them escapes a quote
+        if (*cur == L'"' && (backslashes & 1)) {
+          ++cur;
+        }
+        continue;
+      }
+
+      if (*cur == L'"') {
+        // Within quotes, a doubled quote is a literal one
+        if (inQuotes && cur[1] == L'"' && i > 0) {
+          cur += 2;
+          continue;
+        }
+        inQuotes = !inQuotes;
+      }
+      ++cur;
+    }
+
+    while (isSpace(*cur)) {
+      ++cur;
+    }
+  }
+  return cur;
+}
+
+bool
+BuildRawCommandLine(std::wstring const& aExePath, wchar_t const* aOwnCmdLine,
+                    int aSkip, std::wstring& aCmdLine)
+{
+  wchar_t const* tail = SkipArguments(aOwnCmdLine, aSkip);
+  size_t const tailLength = wcslen(tail);
+  size_t const length = aExePath.size() + 2 +
+                        (tailLength ? 1 + tailLength : 0);
+  if (length >= kMaxCommandLineLen) {
+    gStderr << L"Command line is too long for CreateProcess" << EndLine;
+    return false;
+  }
+
+  StartCommandLine(aExePath, length, aCmdLine);
+  if (tailLength) {
+    aCmdLine += L' ';
+    aCmdLine.append(tail, tailLength);
+  }
+  return true;
+}
+
+/**
+ * Retrieves the path of cmd.exe. Reports any failure to stderr and returns
+ * false.
+ */
+static bool
+GetCommandInterpreter(std::wstring& aPath)
+{
+  wchar_t buf[MAX_PATH];
+  DWORD len = GetEnvironmentVariable(L"ComSpec", buf, MAX_PATH);
+  if (len && len < MAX_PATH) {
+    aPath.assign(buf, len);
+    return true;
+  }
+
+  len = GetSystemDirectory(buf, MAX_PATH);
+  if (!len || len >= MAX_PATH) {
+    DWORD err = GetLastError();
+    gStderr << L"GetSystemDirectory failed with error code " << err
+            << EndLine;
+    return false;
+  }
+  aPath.assign(buf, len);
+  aPath += L"\\cmd.exe";
+  return true;
+}
+
+/**
+ * Pins aJob to aAffinity. Where that requires a basic limit, it is added to
+ * aLimits for the caller to set.
+ */
+static bool
+SetJobAffinity(HANDLE aJob, CpuSet const& aAffinity,
+               JOBOBJECT_BASIC_LIMIT_INFORMATION& aLimits)
+{
+  std::vector<GROUP_AFFINITY> groupAffinities;
+  for (WORD group = 0; group < aAffinity.GroupCount(); ++group) {
+    if (aAffinity.GroupMask(group)) {
+      GROUP_AFFINITY groupAffinity = {};
+      groupAffinity.Group = group;
+      groupAffinity.Mask = aAffinity.GroupMask(group);
+      groupAffinities.push_back(groupAffinity);
+    }
+  }
+
+  if (groupAffinities.empty()) {
+    gStderr << L"Refusing to pin a job to no CPUs at all." << EndLine;
+    return false;
+  }
+
+  // Windows 10 accepts group-qualified affinities for the whole job
+  if (SetInformationJobObject(aJob, JobObjectGroupInformationEx,
+                              groupAffinities.data(),
+                              static_cast<DWORD>(groupAffinities.size() *
+                                                 sizeof(GROUP_AFFINITY)))) {
+    return true;
+  }
+
+  if (groupAffinities.size() > 1) {
+    gStderr << L"Pinning a job to several processor groups requires "
+               L"Windows 10." << EndLine;
+    return false;
+  }
+
+  // Older versions need the job to be bound to the group first; the basic
+  // limit's affinity mask then applies within that group.
+  USHORT group = groupAffinities[0].Group;
+  if (!SetInformationJobObject(aJob, JobObjectGroupInformation, &group,
+                               sizeof(group))) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to set processor group " << group
+            << L" on job object, error code " << err << EndLine;
+    return false;
+  }
+
+  aLimits.LimitFlags |= JOB_OBJECT_LIMIT_AFFINITY;
+  aLimits.Affinity = groupAffinities[0].Mask;
+  return true;
+}
+
+bool
+CreatePinnedChild(LaunchParams const& aParams, PinnedChild& aChild)
+{
+  UniqueHandle job(CreateJobObject(nullptr, nullptr));
+  if (!job) {
+    gStderr << L"CreateJobObject failed." << EndLine;
+    return false;
+  }
+
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInfo = {};
+  JOBOBJECT_BASIC_LIMIT_INFORMATION& basicLimitInfo =
+    limitInfo.BasicLimitInformation;
+
+  bool const useJobAffinity = aParams.mBackend == AffinityBackend::Job;
+  if (useJobAffinity &&
+      !SetJobAffinity(job.get(), aParams.mAffinity, basicLimitInfo)) {
+    return false;
+  }
+
+  if (!ApplyJobControls(job.get(), aParams.mControls, limitInfo)) {
+    return false;
+  }
+
+  if (basicLimitInfo.LimitFlags &&
+      !SetInformationJobObject(job.get(), JobObjectExtendedLimitInformation,
+                               &limitInfo, sizeof(limitInfo))) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to set limit information on job object, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  // The port must be associated before the child joins the job, otherwise we
+  // could miss its messages.
+  if (aParams.mCompletionPort) {
+    JOBOBJECT_ASSOCIATE_COMPLETION_PORT portInfo = {};
+    portInfo.CompletionKey = reinterpret_cast<PVOID>(aParams.mCompletionKey);
+    portInfo.CompletionPort = aParams.mCompletionPort;
+    if (!SetInformationJobObject(job.get(),
+                                 JobObjectAssociateCompletionPortInformation,
+                                 &portInfo, sizeof(portInfo))) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to associate completion port with job object, "
+                 L"error code " << err << EndLine;
+      return false;
+    }
+  }
+  gTimings.Mark(LaunchPhase::CreateJob);
+
+  bool const hasPreferredNode = aParams.mPreferredNode >= 0;
+  DWORD const attrCount = 1 + (useJobAffinity ? 1 : 0) +
+                          (hasPreferredNode ? 1 : 0);
+  ProcThreadAttributeList attrList;
+  if (!attrList.Init(attrCount)) {
+    DWORD err = GetLastError();
+    gStderr << L"InitializeProcThreadAttributeList failed with error code "
+            << err << EndLine;
+    return false;
+  }
+
+  HANDLE const stdOutput = aParams.mStdOutput ? aParams.mStdOutput :
+                           GetStdHandle(STD_OUTPUT_HANDLE);
+  HANDLE const stdError = aParams.mStdError ? aParams.mStdError :
+                          GetStdHandle(STD_ERROR_HANDLE);
+  HANDLE inheritableHandleWhitelist[] = {
+    GetStdHandle(STD_INPUT_HANDLE),
+    stdOutput,
+    stdError
+  };
+
+  if (!UpdateProcThreadAttribute(attrList.get(), 0,
+                                 PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                 inheritableHandleWhitelist,
+                                 sizeof(inheritableHandleWhitelist), nullptr,
+                                 nullptr)) {
+    gStderr << L"UpdateProcThreadAttribute failed" << EndLine;
+    return false;
+  }
+
+  // Start the child's main thread in the (first) selected group so that it
+  // does not have to be migrated there once it joins the job. This is a hard
+  // affinity, so CPU sets must do without it.
+  PROCESSOR_NUMBER firstCpu = {};
+  aParams.mAffinity.First(firstCpu);
+  GROUP_AFFINITY groupAffinity = {};
+  groupAffinity.Group = firstCpu.Group;
+  groupAffinity.Mask = aParams.mAffinity.GroupMask(firstCpu.Group);
+  if (useJobAffinity &&
+      !UpdateProcThreadAttribute(attrList.get(), 0,
+                                 PROC_THREAD_ATTRIBUTE_GROUP_AFFINITY,
+                                 &groupAffinity, sizeof(groupAffinity),
+                                 nullptr, nullptr)) {
+    gStderr << L"UpdateProcThreadAttribute for group affinity failed"
+            << EndLine;
+    return false;
+  }
+
+  // Have the child's memory come from the node that it runs on
+  USHORT preferredNode = static_cast<USHORT>(aParams.mPreferredNode);
+  if (hasPreferredNode &&
+      !UpdateProcThreadAttribute(attrList.get(), 0,
+                                 PROC_THREAD_ATTRIBUTE_PREFERRED_NODE,
+                                 &preferredNode, sizeof(preferredNode),
+                                 nullptr, nullptr)) {
+    gStderr << L"UpdateProcThreadAttribute for preferred node failed"
+            << EndLine;
+    return false;
+  }
+
+  STARTUPINFOEX siex{};
+  siex.StartupInfo.cb = sizeof(siex);
+  siex.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+  siex.StartupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+  siex.StartupInfo.hStdOutput = stdOutput;
+  siex.StartupInfo.hStdError = stdError;
+  siex.lpAttributeList = attrList.get();
+  gTimings.Mark(LaunchPhase::AttributeList);
+
+  // CreateProcess may modify the command line buffer
+  std::wstring appName(aParams.mExePath);
+  std::wstring cmdLine(aParams.mCmdLine);
+  wchar_t const* ext = FindExtension(appName.c_str());
+  if (ext && IsBatchScript(ext)) {
+    // Batch scripts run in the command interpreter, which is given our whole
+    // command line; /s has it strip just the outer pair of quotes, and /v:off
+    // keeps it from expanding !VAR! whatever the registry says. Raw and
+    // --batch command lines are passed as written, so check every one here.
+    if (!CheckCmdCommandLine(aParams.mCmdLine.c_str()) ||
+        !GetCommandInterpreter(appName)) {
+      return false;
+    }
+    cmdLine = L"\"" + appName + L"\" /d /v:off /s /c \"" +
+              aParams.mCmdLine + L"\"";
+    if (cmdLine.size() >= kMaxCommandLineLen) {
+      gStderr << L"Command line is too long for CreateProcess" << EndLine;
+      return false;
+    }
+  }
+
+  PROCESS_INFORMATION pi;
+  if (!CreateProcess(appName.c_str(), &cmdLine[0],
+                     nullptr, nullptr, TRUE, CREATE_SUSPENDED |
+                     CREATE_UNICODE_ENVIRONMENT | EXTENDED_STARTUPINFO_PRESENT,
+                     nullptr, nullptr, &siex.StartupInfo, &pi)) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateProcess failed with error code " << err << EndLine;
+    return false;
+  }
+  gTimings.Mark(LaunchPhase::CreateProcess);
+
+  UniqueHandle childProcess(pi.hProcess);
+  UniqueHandle childMainThread(pi.hThread);
+
+  if (!AssignProcessToJobObject(job.get(), childProcess.get())) {
+    DWORD err = GetLastError();
+    gStderr << L"AssignProcessToJobObject failed with error code " << err
+            << EndLine;
+    TerminateProcess(childProcess.get(), 1);
+    return false;
+  }
+  gTimings.Mark(LaunchPhase::AssignToJob);
+
+  if (!useJobAffinity &&
+      !ApplyCpuSets(childProcess.get(), childMainThread.get(),
+                    aParams.mAffinity)) {
+    TerminateProcess(childProcess.get(), 1);
+    return false;
+  }
+
+  if (!ApplyProcessControls(childProcess.get(), aParams.mControls)) {
+    TerminateProcess(childProcess.get(), 1);
+    return false;
+  }
+  gTimings.Mark(LaunchPhase::ProcessControls);
+
+  aChild.mJob = std::move(job);
+  aChild.mProcess = std::move(childProcess);
+  aChild.mMainThread = std::move(childMainThread);
+  aChild.mPid = pi.dwProcessId;
+  return true;
+}
+
+bool
+RepinJob(HANDLE aJob, CpuSet const& aAffinity)
+{
+  // The basic limits are rewritten whole, so start from the current ones
+  JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInfo = {};
+  if (!QueryInformationJobObject(aJob, JobObjectExtendedLimitInformation,
+                                 &limitInfo, sizeof(limitInfo), nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to query limit information on job object, error "
+               L"code " << err << EndLine;
+    return false;
+  }
+
+  JOBOBJECT_BASIC_LIMIT_INFORMATION& basicLimitInfo =
+    limitInfo.BasicLimitInformation;
+  basicLimitInfo.LimitFlags &= ~JOB_OBJECT_LIMIT_AFFINITY;
+  if (!SetJobAffinity(aJob, aAffinity, basicLimitInfo)) {
+    return false;
+  }
+
+  if ((basicLimitInfo.LimitFlags & JOB_OBJECT_LIMIT_AFFINITY) &&
+      !SetInformationJobObject(aJob, JobObjectExtendedLimitInformation,
+                               &limitInfo, sizeof(limitInfo))) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to set limit information on job object, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ResumeChild(PinnedChild& aChild)
+{
+  if (ResumeThread(aChild.mMainThread.get()) == ((DWORD)-1)) {
+    DWORD err = GetLastError();
+    gStderr << L"ResumeThread failed with error code " << err << EndLine;
+    TerminateProcess(aChild.mProcess.get(), 1);
+    return false;
+  }
+  gTimings.Mark(LaunchPhase::Resume);
+
+  return true;
+}
+
+void
+GetChildExitCode(PinnedChild const& aChild, DWORD& aExitCode)
+{
+  DWORD exitCode;
+  if (!GetExitCodeProcess(aChild.mProcess.get(), &exitCode)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetExitCodeProcess failed with error code " << err
+            << EndLine;
+    return;
+  }
+
+  aExitCode = exitCode;
+}
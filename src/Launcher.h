@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Launcher_h
+#define rununiproc_Launcher_h
+
+#include <string>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "JobControls.h"
+#include "PathCache.h"
+#include "UniqueHandle.h"
+
+// The longest command line that CreateProcess accepts, including the null
+// terminator
+DWORD const kMaxCommandLineLen = 32767;
+
+/**
+ * Resolves aName to the full path of an executable or batch script, as
+ * cmd.exe would: names without a directory are searched for in the current
+ * directory and then in each PATH directory, and names without a launchable
+ * extension are tried with each PATHEXT extension, all of them in one
+ * directory before the next.
+ * When aCache is given, PATH searches are looked up in and added to it.
+ * Reports any failure to stderr and returns false.
+ */
+bool ResolveExecutable(wchar_t const* aName, std::wstring& aExePath,
+                       PathCache* aCache = nullptr);
+
+/**
+ * A temporary file holding arguments that did not fit on a command line. The
+ * file is deleted when this object is destroyed, so it must outlive the child.
+ */
+class ResponseFile
+{
+public:
+  ResponseFile() = default;
+  ~ResponseFile();
+
+  ResponseFile(ResponseFile const&) = delete;
+  ResponseFile& operator=(ResponseFile const&) = delete;
+
+  /**
+   * Writes aArgs to a new temporary file as UTF-8. Reports any failure to
+   * stderr and returns false.
+   */
+  bool Write(std::wstring const& aArgs);
+
+  std::wstring const& Path() const
+  {
+    return mPath;
+  }
+
+private:
+  std::wstring mPath;
+};
+
+/**
+ * Builds the command line for aExePath followed by the aArgc arguments in
+ * aArgv, quoted so that the child's CommandLineToArgvW recovers them exactly,
+ * or for cmd.exe when aExePath is a batch script, which refuses arguments
+ * that cmd.exe would act on.
+ * If the result would be too long for CreateProcess and aResponseFile is
+ * given, the arguments are written to it and passed as a single @path
+ * argument instead. Reports any failure to stderr and returns false.
+ */
+bool BuildCommandLine(std::wstring const& aExePath, int aArgc,
+                      wchar_t* aArgv[], std::wstring& aCmdLine,
+                      ResponseFile* aResponseFile = nullptr);
+
+/**
+ * Builds the command line for aExePath followed by aOwnCmdLine, which is the
+ * command line that our argv came from, as given, after its first aSkip
+ * arguments. This preserves quoting that argv cannot represent, for children
+ * that parse their command lines themselves. Reports any failure to stderr
+ * and returns false.
+ */
+bool BuildRawCommandLine(std::wstring const& aExePath,
+                         wchar_t const* aOwnCmdLine, int aSkip,
+                         std::wstring& aCmdLine);
+
+/**
+ * How a child is confined to its processors.
+ */
+enum class AffinityBackend
+{
+  // A hard affinity limit on the job; the child can never run elsewhere
+  Job,
+  // The child's default CPU sets (Windows 10 and newer); the scheduler may
+  // still run the child elsewhere when its processors are unavailable
+  CpuSets
+};
+
+struct LaunchParams
+{
+  std::wstring mExePath;
+  std::wstring mCmdLine;
+  CpuSet mAffinity;
+  AffinityBackend mBackend = AffinityBackend::Job;
+  // The NUMA node that the child's memory should come from, or -1 to leave
+  // that up to the system
+  int mPreferredNode = -1;
+  JobControls mControls;
+  // The child's stdout and stderr; our own when null
+  HANDLE mStdOutput = nullptr;
+  HANDLE mStdError = nullptr;
+  // When set, the job reports its messages to this port under mCompletionKey
+  HANDLE mCompletionPort = nullptr;
+  ULONG_PTR mCompletionKey = 0;
+};
+
+/**
+ * A child process running inside its own pinned job object.
+ */
+struct PinnedChild
+{
+  UniqueHandle mJob;
+  UniqueHandle mProcess;
+  UniqueHandle mMainThread;
+  DWORD mPid = 0;
+};
+
+/**
+ * Creates a job and launches the child into it with its main thread suspended,
+ * confined to aParams.mAffinity by means of aParams.mBackend. Reports any
+ * failure to stderr and returns false, in which case no child is left running.
+ */
+bool CreatePinnedChild(LaunchParams const& aParams, PinnedChild& aChild);
+
+/**
+ * Moves every process in aJob, a job created by CreatePinnedChild with the
+ * job backend, to aAffinity, which must be within the groups that it already
+ * runs in. Reports any failure to stderr and returns false.
+ */
+bool RepinJob(HANDLE aJob, CpuSet const& aAffinity);
+
+/**
+ * Resumes the main thread of a child created by CreatePinnedChild. Reports any
+ * failure to stderr, terminates the child, and returns false.
+ */
+bool ResumeChild(PinnedChild& aChild);
+
+/**
+ * Retrieves the exit code of a child that has exited. If it cannot be
+ * retrieved, the failure is reported to stderr and aExitCode is left as-is.
+ */
+void GetChildExitCode(PinnedChild const& aChild, DWORD& aExitCode);
+
+#endif // rununiproc_Launcher_h
@@ -0,0 +1,291 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Migration.h"
+
+#include "CpuSelection.h"
+#include "Output.h"
+#include "ProcessorLoad.h"
+
+namespace {
+
+// How often to sample the processors
+DWORD const kSampleIntervalMs = 250;
+// Consecutive contended samples before moving off a processor
+unsigned int const kContendedSamples = 4;
+// Samples to wait after a migration before considering another
+unsigned int const kCooldownSamples = 8;
+// A replacement must be this far under the threshold
+double const kReplacementMargin = 0.5;
+
+ULONGLONG
+JobCpuTime(HANDLE aJob)
+{
+  JOBOBJECT_BASIC_ACCOUNTING_INFORMATION info = {};
+  if (!QueryInformationJobObject(aJob, JobObjectBasicAccountingInformation,
+                                 &info, sizeof(info), nullptr)) {
+    return 0;
+  }
+  return info.TotalUserTime.QuadPart + info.TotalKernelTime.QuadPart;
+}
+
+std::wstring
+FormatCpu(PROCESSOR_NUMBER const& aCpu)
+{
+  return std::to_wstring(aCpu.Group) + L':' + std::to_wstring(aCpu.Number);
+}
+
+} // anonymous namespace
+
+Migrator::~Migrator()
+{
+  Stop();
+}
+
+bool
+Migrator::Init(Topology const& aTopology, CpuSet const& aEligible,
+               CpuSet const& aAffinity, double aThreshold)
+{
+  // Job accounting only says how much time the child took in all, which is
+  // only the time that it took on each of its processors when it has one.
+  // Placements that pin to whole cores can still give it several.
+  PROCESSOR_NUMBER first;
+  if (!aAffinity.First(first)) {
+    return false;
+  }
+  if (aAffinity.Count() != 1) {
+    gStderr << L"--migrate requires the child to be pinned to a single CPU,"
+               L" not " << aAffinity.ToString() << L"." << EndLine;
+    return false;
+  }
+
+  mTopology = &aTopology;
+  mEligible = aEligible;
+  mThreshold = aThreshold;
+  mGroup = first.Group;
+  mAffinity = aAffinity;
+  return true;
+}
+
+bool
+Migrator::Start(PinnedChild const& aChild)
+{
+  mJob = aChild.mJob.get();
+  mStopEvent.reset(CreateEvent(nullptr, TRUE, FALSE, nullptr));
+  if (!mStopEvent) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateEvent failed with error code " << err << EndLine;
+    return false;
+  }
+
+  mWatchThread.reset(CreateThread(nullptr, 0, &WatchThread, this,
+                                  CREATE_SUSPENDED, nullptr));
+  if (!mWatchThread) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create migration watcher, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  KeepThreadOff(mWatchThread.get(), *mTopology, mAffinity);
+  ResumeThread(mWatchThread.get());
+  return true;
+}
+
+void
+Migrator::Stop()
+{
+  if (!mWatchThread) {
+    return;
+  }
+
+  SetEvent(mStopEvent.get());
+  WaitForSingleObject(mWatchThread.get(), INFINITE);
+  mWatchThread.reset();
+}
+
+DWORD WINAPI
+Migrator::WatchThread(LPVOID aContext)
+{
+  static_cast<Migrator*>(aContext)->Watch();
+  return 0;
+}
+
+bool
+Migrator::FindReplacement(PROCESSOR_NUMBER const& aCpu,
+                          std::vector<double> const& aLoad,
+                          PROCESSOR_NUMBER& aReplacement) const
+{
+  CpuSet l3;
+  for (Cache const& cache : mTopology->Caches()) {
+    if (cache.mLevel == 3 && cache.mProcessors.Contains(aCpu)) {
+      l3 = cache.mProcessors;
+      break;
+    }
+  }
+  NumaNode const* node = mTopology->NumaNodeOf(aCpu);
+
+  // The nearest domain with a quiet enough processor wins, and within it the
+  // quietest processor
+  CpuSet const domains[] = {
+    l3,
+    node ? node->mProcessors : CpuSet(),
+  };
+  for (CpuSet const& domain : domains) {
+    CpuSet candidates;
+    candidates.SetGroupMask(mGroup, domain.GroupMask(mGroup) &
+                                    mEligible.GroupMask(mGroup) &
+                                    ~mAffinity.GroupMask(mGroup));
+
+    bool found = false;
+    double best = mThreshold * kReplacementMargin;
+    candidates.ForEach([&](PROCESSOR_NUMBER const& aCandidate) {
+      if (aCandidate.Number < aLoad.size() && aLoad[aCandidate.Number] < best) {
+        best = aLoad[aCandidate.Number];
+        aReplacement = aCandidate;
+        found = true;
+      }
+    });
+    if (found) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+Migrator::Watch()
+{
+  std::vector<ProcessorTimes> before;
+  if (!SnapshotProcessorTimes(mGroup, before)) {
+    return;
+  }
+  ULONGLONG childBefore = JobCpuTime(mJob);
+  ULONGLONG const startTicks = GetTickCount64();
+
+  std::vector<unsigned int> contended(before.size(), 0);
+  unsigned int cooldown = 0;
+
+  while (WaitForSingleObject(mStopEvent.get(), kSampleIntervalMs) ==
+         WAIT_TIMEOUT) {
+    std::vector<ProcessorTimes> after;
+    if (!SnapshotProcessorTimes(mGroup, after)) {
+      return;
+    }
+    ULONGLONG const childAfter = JobCpuTime(mJob);
+
+    // All of the child's time was spent on its one processor; whatever else
+    // keeps that busy is other work
+    size_t const count = before.size() < after.size() ? before.size() :
+                                                        after.size();
+    std::vector<double> load(count, 1.0);
+    for (size_t i = 0; i < count; ++i) {
+      ULONGLONG const total = after[i].mTotal - before[i].mTotal;
+      if (!total) {
+        continue;
+      }
+      double busy = 1.0 - static_cast<double>(after[i].mIdle -
+                                              before[i].mIdle) / total;
+      PROCESSOR_NUMBER cpu = {};
+      cpu.Group = mGroup;
+      cpu.Number = static_cast<BYTE>(i);
+      if (mAffinity.Contains(cpu)) {
+        busy -= static_cast<double>(childAfter - childBefore) /
+                static_cast<double>(total);
+      }
+      load[i] = busy < 0.0 ? 0.0 : busy;
+    }
+    before.swap(after);
+    childBefore = childAfter;
+
+    if (cooldown) {
+      --cooldown;
+      continue;
+    }
+
+    // Move off at most one processor per sample
+    size_t moveFrom = count;
+    for (size_t i = 0; i < count && i < contended.size(); ++i) {
+      PROCESSOR_NUMBER cpu = {};
+      cpu.Group = mGroup;
+      cpu.Number = static_cast<BYTE>(i);
+      if (!mAffinity.Contains(cpu) || load[i] <= mThreshold) {
+        contended[i] = 0;
+      } else if (++contended[i] >= kContendedSamples && moveFrom == count) {
+        moveFrom = i;
+      }
+    }
+    if (moveFrom == count) {
+      continue;
+    }
+
+    Migration migration;
+    migration.mFrom = {};
+    migration.mFrom.Group = mGroup;
+    migration.mFrom.Number = static_cast<BYTE>(moveFrom);
+    if (!FindReplacement(migration.mFrom, load, migration.mTo)) {
+      // Nowhere better to go; look again once things may have changed
+      contended[moveFrom] = 0;
+      cooldown = kCooldownSamples;
+      continue;
+    }
+
+    CpuSet affinity = mAffinity;
+    affinity.Remove(migration.mFrom);
+    affinity.Add(migration.mTo);
+    if (!RepinJob(mJob, affinity)) {
+      return;
+    }
+    mAffinity = affinity;
+    // The child may have moved onto our own core
+    KeepThreadOff(GetCurrentThread(), *mTopology, mAffinity);
+
+    migration.mSeconds = (GetTickCount64() - startTicks) / 1000.0;
+    migration.mFromLoad = load[moveFrom];
+    migration.mToLoad = load[migration.mTo.Number];
+    mMigrations.push_back(migration);
+
+#if defined(DEBUG)
+    gStdout << L"Migrated from CPU " << FormatCpu(migration.mFrom)
+            << L" to " << FormatCpu(migration.mTo) << EndLine;
+#endif
+
+    contended.assign(count, 0);
+    cooldown = kCooldownSamples;
+  }
+}
+
+std::wstring
+Migrator::FormatReport(StatsFormat aFormat) const
+{
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  if (aFormat == StatsFormat::Json) {
+    stream << L"{\"migrations\":[";
+    for (size_t i = 0; i < mMigrations.size(); ++i) {
+      Migration const& migration = mMigrations[i];
+      stream << (i ? L"," : L"") << L"{\"seconds\":" << migration.mSeconds
+             << L",\"from\":\"" << FormatCpu(migration.mFrom)
+             << L"\",\"to\":\"" << FormatCpu(migration.mTo)
+             << L"\",\"from_load\":" << migration.mFromLoad
+             << L",\"to_load\":" << migration.mToLoad << L'}';
+    }
+    stream << L"]}\n";
+    return stream.str();
+  }
+
+  stream << mMigrations.size() << L" migrations\n";
+  for (Migration const& migration : mMigrations) {
+    stream << L"  " << SetWidth(10) << migration.mSeconds << L" s  CPU "
+           << FormatCpu(migration.mFrom) << L" ("
+           << migration.mFromLoad * 100.0 << L"% other work) to "
+           << FormatCpu(migration.mTo) << L" ("
+           << migration.mToLoad * 100.0 << L"%)\n";
+  }
+  return stream.str();
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Migration_h
+#define rununiproc_Migration_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "JobStats.h"
+#include "Launcher.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+/**
+ * Watches the processors that a child's job is pinned to and, when other work
+ * keeps one of them busy, re-pins the job to a quieter processor, for
+ * --migrate. A processor counts as contended once the time that it spends on
+ * anything but the child exceeds the threshold for several samples in a row;
+ * its replacement must be eligible, in the same group, and comfortably below
+ * the threshold, and is preferably on the same L3 cache, or failing that the
+ * same NUMA node. After each migration the watcher waits a while before
+ * considering another, so that the job does not bounce between processors.
+ */
+class Migrator
+{
+public:
+  Migrator() = default;
+  ~Migrator();
+
+  Migrator(Migrator const&) = delete;
+  Migrator& operator=(Migrator const&) = delete;
+
+  /**
+   * Prepares to watch a child pinned to aAffinity, which must be a single
+   * processor, moving it among aEligible when the work of others on one of
+   * its processors exceeds aThreshold, a fraction of that processor's time.
+   * Reports any failure to stderr and returns false.
+   */
+  bool Init(Topology const& aTopology, CpuSet const& aEligible,
+            CpuSet const& aAffinity, double aThreshold);
+
+  /**
+   * Starts watching aChild's job. Reports any failure to stderr and returns
+   * false.
+   */
+  bool Start(PinnedChild const& aChild);
+
+  /**
+   * Stops watching.
+   */
+  void Stop();
+
+  /**
+   * Formats every migration made between Start and Stop.
+   */
+  std::wstring FormatReport(StatsFormat aFormat) const;
+
+private:
+  struct Migration
+  {
+    // Since Start
+    double mSeconds;
+    PROCESSOR_NUMBER mFrom;
+    PROCESSOR_NUMBER mTo;
+    // The fraction of their time that each spent on other work
+    double mFromLoad;
+    double mToLoad;
+  };
+
+  static DWORD WINAPI WatchThread(LPVOID aContext);
+
+  void Watch();
+  bool FindReplacement(PROCESSOR_NUMBER const& aCpu,
+                       std::vector<double> const& aLoad,
+                       PROCESSOR_NUMBER& aReplacement) const;
+
+  Topology const* mTopology = nullptr;
+  CpuSet mEligible;
+  double mThreshold = 0.0;
+  WORD mGroup = 0;
+  // Only touched by the watch thread once it is running
+  CpuSet mAffinity;
+  std::vector<Migration> mMigrations;
+  HANDLE mJob = nullptr;
+  UniqueHandle mStopEvent;
+  UniqueHandle mWatchThread;
+};
+
+#endif // rununiproc_Migration_h
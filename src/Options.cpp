@@ -0,0 +1,551 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Options.h"
+
+#include <wchar.h>
+
+#include "Output.h"
+#include "Pmc.h"
+
+/**
+ * Checks whether argv[aIndex] is the option --aName. The option's value may be
+ * given either as --aName=value or as the following argument, in which case
+ * aIndex is advanced past it.
+ */
+static bool
+MatchOption(int argc, wchar_t* argv[], int& aIndex, wchar_t const* aName,
+            wchar_t const*& aValue)
+{
+  wchar_t const* arg = argv[aIndex] + 2;
+  size_t nameLen = wcslen(aName);
+  if (wcsncmp(arg, aName, nameLen)) {
+    return false;
+  }
+
+  if (arg[nameLen] == L'=') {
+    aValue = arg + nameLen + 1;
+    return true;
+  }
+
+  if (arg[nameLen]) {
+    return false;
+  }
+
+  if (aIndex + 1 >= argc) {
+    aValue = nullptr;
+    return true;
+  }
+
+  aValue = argv[++aIndex];
+  return true;
+}
+
+/**
+ * Checks whether aArg is the valueless option --aName.
+ */
+static bool
+MatchFlag(wchar_t const* aArg, wchar_t const* aName)
+{
+  return !wcscmp(aArg + 2, aName);
+}
+
+bool
+ParseOptions(int argc, wchar_t* argv[], Options& aOptions)
+{
+  bool summaryGiven = false;
+  int i = 1;
+  for (; i < argc; ++i) {
+    wchar_t const* arg = argv[i];
+    if (wcsncmp(arg, L"--", 2)) {
+      break;
+    }
+
+    if (!arg[2]) {
+      // "--" ends our options
+      ++i;
+      break;
+    }
+
+    wchar_t const* value = nullptr;
+    if (MatchFlag(arg, L"path-cache")) {
+      aOptions.mPathCache = true;
+    } else if (MatchFlag(arg, L"raw-args")) {
+      aOptions.mRawArgs = true;
+    } else if (MatchFlag(arg, L"response-file")) {
+      aOptions.mResponseFile = true;
+    } else if (MatchFlag(arg, L"reserve")) {
+      aOptions.mReserve = true;
+    } else if (MatchFlag(arg, L"reserve-cpusets")) {
+      aOptions.mReserveCpuSets = true;
+    } else if (MatchFlag(arg, L"isolate")) {
+      aOptions.mIsolate = true;
+    } else if (MatchFlag(arg, L"migrate")) {
+      aOptions.mMigrate = true;
+    } else if (!wcsncmp(arg + 2, L"migrate=", 8)) {
+      // Not MatchOption, since a bare --migrate must not consume the command
+      wchar_t* end = nullptr;
+      unsigned long percent = wcstoul(arg + 10, &end, 10);
+      if (end == arg + 10 || *end || !percent || percent > 100) {
+        gStderr << L"--migrate requires a percentage from 1 to 100."
+                << EndLine;
+        return false;
+      }
+      aOptions.mMigrate = true;
+      aOptions.mMigrateThreshold = percent / 100.0;
+    } else if (MatchFlag(arg, L"spread-threads")) {
+      aOptions.mSpreadThreads = true;
+    } else if (MatchFlag(arg, L"wait-tree")) {
+      aOptions.mWaitTree = true;
+    } else if (MatchFlag(arg, L"lock-memory")) {
+      aOptions.mControls.mLockMemory = true;
+    } else if (MatchFlag(arg, L"prefault-image")) {
+      aOptions.mControls.mPrefaultImage = true;
+    } else if (MatchFlag(arg, L"hard-working-set")) {
+      aOptions.mControls.mHardWorkingSet = true;
+    } else if (MatchFlag(arg, L"relay")) {
+      aOptions.mRelay = true;
+    } else if (!wcsncmp(arg + 2, L"relay=", 6)) {
+      // Not MatchOption, since a bare --relay must not consume the command
+      aOptions.mRelay = true;
+      aOptions.mRelayFile = arg + 8;
+    } else if (MatchFlag(arg, L"serve")) {
+      aOptions.mServe = true;
+    } else if (!wcsncmp(arg + 2, L"serve=", 6)) {
+      aOptions.mServe = true;
+      aOptions.mServerName = arg + 8;
+    } else if (MatchFlag(arg, L"connect")) {
+      aOptions.mConnect = true;
+    } else if (!wcsncmp(arg + 2, L"connect=", 8)) {
+      aOptions.mConnect = true;
+      aOptions.mServerName = arg + 10;
+    } else if (MatchFlag(arg, L"stats")) {
+      aOptions.mStats = StatsFormat::Text;
+    } else if (!wcsncmp(arg + 2, L"stats=", 6)) {
+      // Not MatchOption, since a bare --stats must not consume the command
+      if (!wcscmp(arg + 8, L"text")) {
+        aOptions.mStats = StatsFormat::Text;
+      } else if (!wcscmp(arg + 8, L"json")) {
+        aOptions.mStats = StatsFormat::Json;
+      } else {
+        gStderr << L"Unknown stats format \"" << arg + 8 << L"\""
+                << EndLine;
+        return false;
+      }
+    } else if (MatchFlag(arg, L"timings")) {
+      aOptions.mTimings = StatsFormat::Text;
+    } else if (!wcsncmp(arg + 2, L"timings=", 8)) {
+      if (!wcscmp(arg + 10, L"text")) {
+        aOptions.mTimings = StatsFormat::Text;
+      } else if (!wcscmp(arg + 10, L"json")) {
+        aOptions.mTimings = StatsFormat::Json;
+      } else {
+        gStderr << L"Unknown timings format \"" << arg + 10 << L"\""
+                << EndLine;
+        return false;
+      }
+    } else if (MatchFlag(arg, L"topology")) {
+      aOptions.mTopology = StatsFormat::Text;
+    } else if (!wcsncmp(arg + 2, L"topology=", 9)) {
+      if (!wcscmp(arg + 11, L"text")) {
+        aOptions.mTopology = StatsFormat::Text;
+      } else if (!wcscmp(arg + 11, L"json")) {
+        aOptions.mTopology = StatsFormat::Json;
+      } else {
+        gStderr << L"Unknown topology format \"" << arg + 11 << L"\""
+                << EndLine;
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"trace", value)) {
+      if (!value) {
+        gStderr << L"--trace requires a file name." << EndLine;
+        return false;
+      }
+      aOptions.mTraceFile = value;
+    } else if (MatchFlag(arg, L"pmc")) {
+      ParsePmcSources(L"", aOptions.mPmcSources);
+    } else if (!wcsncmp(arg + 2, L"pmc=", 4)) {
+      // As for --stats, a bare --pmc must not consume the command
+      if (!ParsePmcSources(arg + 6, aOptions.mPmcSources)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"stats-file", value)) {
+      if (!value) {
+        gStderr << L"--stats-file requires a file name." << EndLine;
+        return false;
+      }
+      aOptions.mStatsFile = value;
+    } else if (MatchOption(argc, argv, i, L"core-class", value)) {
+      if (!value) {
+        gStderr << L"--core-class requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseCoreClass(value, aOptions.mCoreClass)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"priority", value)) {
+      if (!value) {
+        gStderr << L"--priority requires a value." << EndLine;
+        return false;
+      }
+      if (!ParsePriorityClass(value, aOptions.mControls.mPriorityClass)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"cpu-rate", value)) {
+      if (!value) {
+        gStderr << L"--cpu-rate requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseCpuRate(value, aOptions.mControls.mCpuRate)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"qos", value)) {
+      if (!value) {
+        gStderr << L"--qos requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseExecutionQos(value, aOptions.mControls.mQos)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"max-memory", value)) {
+      if (!value) {
+        gStderr << L"--max-memory requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseMemorySize(L"max-memory", value,
+                           aOptions.mControls.mProcessMemoryLimit)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"max-job-memory", value)) {
+      if (!value) {
+        gStderr << L"--max-job-memory requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseMemorySize(L"max-job-memory", value,
+                           aOptions.mControls.mJobMemoryLimit)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"working-set", value)) {
+      if (!value) {
+        gStderr << L"--working-set requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseWorkingSet(value, aOptions.mControls.mMinWorkingSet,
+                           aOptions.mControls.mMaxWorkingSet)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"memory-priority", value)) {
+      if (!value) {
+        gStderr << L"--memory-priority requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseMemoryPriority(value, aOptions.mControls.mMemoryPriority)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"numa-memory", value)) {
+      if (value && !wcscmp(value, L"follow")) {
+        aOptions.mNumaMemory = true;
+      } else if (value && !wcscmp(value, L"none")) {
+        aOptions.mNumaMemory = false;
+      } else {
+        gStderr << L"--numa-memory must be follow or none." << EndLine;
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"backend", value)) {
+      if (value && !wcscmp(value, L"job")) {
+        aOptions.mBackend = AffinityBackend::Job;
+      } else if (value && !wcscmp(value, L"cpusets")) {
+        aOptions.mBackend = AffinityBackend::CpuSets;
+      } else {
+        gStderr << L"--backend must be job or cpusets." << EndLine;
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"placement", value)) {
+      if (!value) {
+        gStderr << L"--placement requires a value." << EndLine;
+        return false;
+      }
+      if (!ParsePlacement(value, aOptions.mPlacement)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"cpus", value)) {
+      if (!value) {
+        gStderr << L"--cpus requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseCpuSpec(value, aOptions.mCpus)) {
+        return false;
+      }
+    } else if (MatchOption(argc, argv, i, L"repeat", value)) {
+      wchar_t* end = nullptr;
+      unsigned long runs = value ? wcstoul(value, &end, 10) : 0;
+      if (!runs || *end) {
+        gStderr << L"--repeat requires a positive number." << EndLine;
+        return false;
+      }
+      aOptions.mRepeat.mRuns = runs;
+    } else if (MatchOption(argc, argv, i, L"warmup", value)) {
+      wchar_t* end = nullptr;
+      unsigned long warmup = value ? wcstoul(value, &end, 10) : 0;
+      if (!value || end == value || *end) {
+        gStderr << L"--warmup requires a number." << EndLine;
+        return false;
+      }
+      aOptions.mRepeat.mWarmup = warmup;
+    } else if (MatchOption(argc, argv, i, L"prewarm", value)) {
+      wchar_t* end = nullptr;
+      unsigned long prewarm = value ? wcstoul(value, &end, 10) : 0;
+      if (!prewarm || *end) {
+        gStderr << L"--prewarm requires a positive number." << EndLine;
+        return false;
+      }
+      aOptions.mRepeat.mPrewarm = prewarm;
+    } else if (MatchFlag(arg, L"drop-outliers")) {
+      aOptions.mRepeat.mDropOutliers = true;
+    } else if (MatchOption(argc, argv, i, L"summary", value)) {
+      if (!value) {
+        gStderr << L"--summary requires a value." << EndLine;
+        return false;
+      }
+      if (!ParseSummaryFormat(value, aOptions.mRepeat.mFormat)) {
+        return false;
+      }
+      summaryGiven = true;
+    } else if (MatchOption(argc, argv, i, L"batch", value)) {
+      if (!value) {
+        gStderr << L"--batch requires a file name, or - for stdin."
+                << EndLine;
+        return false;
+      }
+      aOptions.mBatchFile = value;
+    } else if (MatchOption(argc, argv, i, L"slots", value)) {
+      wchar_t* end = nullptr;
+      unsigned long slots = value ? wcstoul(value, &end, 10) : 0;
+      if (!slots || *end) {
+        gStderr << L"--slots requires a positive number." << EndLine;
+        return false;
+      }
+      aOptions.mSlots = slots;
+    } else {
+      gStderr << L"Unknown option \"" << arg << L"\"" << EndLine;
+      return false;
+    }
+  }
+
+  if (aOptions.mSlots && !aOptions.mBatchFile) {
+    gStderr << L"--slots requires --batch." << EndLine;
+    return false;
+  }
+
+  bool const repeating = aOptions.mRepeat.mRuns != 0;
+
+  if (aOptions.mControls.mHardWorkingSet &&
+      !aOptions.mControls.mMaxWorkingSet) {
+    gStderr << L"--hard-working-set requires --working-set." << EndLine;
+    return false;
+  }
+  if (!repeating && (aOptions.mRepeat.mWarmup || aOptions.mRepeat.mPrewarm ||
+                     aOptions.mRepeat.mDropOutliers || summaryGiven)) {
+    gStderr << L"--warmup, --prewarm, --drop-outliers and --summary require"
+               L" --repeat." << EndLine;
+    return false;
+  }
+
+  if (repeating && aOptions.mStats != StatsFormat::None) {
+    gStderr << L"--stats cannot be used with --repeat, which reports its"
+               L" own summary." << EndLine;
+    return false;
+  }
+
+  bool const sampling = !aOptions.mPmcSources.empty();
+  if (sampling && (repeating || aOptions.mBatchFile)) {
+    gStderr << L"--pmc cannot be used with --repeat or --batch."
+            << EndLine;
+    return false;
+  }
+
+  bool const timing = aOptions.mTimings != StatsFormat::None;
+  if (timing && (repeating || aOptions.mBatchFile)) {
+    gStderr << L"--timings cannot be used with --repeat or --batch."
+            << EndLine;
+    return false;
+  }
+
+  if (aOptions.mMigrate &&
+      (repeating || aOptions.mBatchFile || aOptions.mReserve ||
+       aOptions.mReserveCpuSets || aOptions.mIsolate ||
+       aOptions.mSpreadThreads ||
+       aOptions.mBackend != AffinityBackend::Job)) {
+    gStderr << L"--migrate only works for single launches with the job"
+               L" backend, and cannot be used with --reserve,"
+               L" --reserve-cpusets, --isolate or --spread-threads, whose"
+               L" processors would not follow the child." << EndLine;
+    return false;
+  }
+
+  // The child's time is only attributable to its processor when it has one
+  if (aOptions.mMigrate &&
+      (aOptions.mCpus.mCount > 1 || aOptions.mCpus.mWholeCores ||
+       aOptions.mCpus.mExplicit.Count() > 1)) {
+    gStderr << L"--migrate requires the child to be pinned to a single CPU."
+            << EndLine;
+    return false;
+  }
+
+  if (aOptions.mSpreadThreads && (repeating || aOptions.mBatchFile)) {
+    gStderr << L"--spread-threads cannot be used with --repeat or --batch."
+            << EndLine;
+    return false;
+  }
+
+  if (aOptions.mRawArgs && aOptions.mResponseFile) {
+    gStderr << L"--raw-args cannot be used with --response-file." << EndLine;
+    return false;
+  }
+
+  if ((aOptions.mRawArgs || aOptions.mResponseFile) && aOptions.mBatchFile) {
+    gStderr << L"--raw-args and --response-file cannot be used with --batch,"
+               L" whose arguments are always passed as written." << EndLine;
+    return false;
+  }
+
+  if (aOptions.mStatsFile && aOptions.mStats == StatsFormat::None &&
+      !repeating && !sampling && !timing && !aOptions.mIsolate &&
+      !aOptions.mMigrate) {
+    gStderr << L"--stats-file requires --stats, --timings, --isolate,"
+               L" --migrate, --repeat or --pmc." << EndLine;
+    return false;
+  }
+
+  if (aOptions.mTopology != StatsFormat::None) {
+    if (aOptions.mServe || aOptions.mBatchFile || repeating) {
+      gStderr << L"--topology cannot be used with --serve, --batch or"
+                 L" --repeat." << EndLine;
+      return false;
+    }
+    if (i < argc) {
+      gStderr << L"--topology does not take a command." << EndLine;
+      return false;
+    }
+    return true;
+  }
+
+  if (aOptions.mServe) {
+    if (aOptions.mConnect || aOptions.mBatchFile) {
+      gStderr << L"--serve cannot be used with --connect or --batch."
+              << EndLine;
+      return false;
+    }
+    if (i < argc) {
+      gStderr << L"--serve does not take a command; clients pass theirs"
+                 L" with --connect." << EndLine;
+      return false;
+    }
+    return true;
+  }
+
+  if (aOptions.mBatchFile) {
+    if (repeating) {
+      gStderr << L"--repeat cannot be used with --batch." << EndLine;
+      return false;
+    }
+    if (!aOptions.mCpus.mExplicit.IsEmpty()) {
+      gStderr << L"--cpus=list: cannot be used with --batch." << EndLine;
+      return false;
+    }
+    if (i < argc) {
+      gStderr << L"--batch does not take a command." << EndLine;
+      return false;
+    }
+    return true;
+  }
+
+  if (i >= argc) {
+    gStderr << L"At least one argument required." << EndLine;
+    return false;
+  }
+
+  aOptions.mCommandIndex = i;
+  return true;
+}
+
+void
+PrintUsage()
+{
+  gStderr << L"Usage: rununiproc [options] [--] <program> [args...]\n"
+             L"       rununiproc [options] --batch <file|->\n"
+             L"\n"
+             L"Options:\n"
+             L"  --placement=<terms>  Comma separated placement policy:\n"
+             L"                       first, core, avoid-cpu0, l3:<n>,\n"
+             L"                       numa:<n>, idle[:<ms>]\n"
+             L"  --cpus=<spec>        How many CPUs to pin to: <n>,\n"
+             L"                       <n>cores, either optionally followed\n"
+             L"                       by @l3 or @numa, or list:<cpus>\n"
+             L"  --backend=<name>     job (hard affinity, the default) or\n"
+             L"                       cpusets (Windows 10 soft affinity)\n"
+             L"  --numa-memory=<how>  follow (prefer the CPUs' NUMA node,\n"
+             L"                       the default) or none\n"
+             L"  --core-class=<kind>  performance (default), efficiency or\n"
+             L"                       any core on hybrid processors\n"
+             L"  --priority=<class>   idle, below, normal, above, high or\n"
+             L"                       realtime\n"
+             L"  --cpu-rate=<rate>    cap:<pct>, weight:<1-9> or\n"
+             L"                       minmax:<pct>-<pct>\n"
+             L"  --qos=<level>        default, high or eco power throttling\n"
+             L"  --raw-args           Pass the arguments on exactly as typed\n"
+             L"  --response-file      Pass over-long arguments in an @file\n"
+             L"  --relay[=<file>]     Relay the child's output through pipes\n"
+             L"                       to file, or to our stdout and stderr\n"
+             L"  --path-cache         Remember where commands are found on\n"
+             L"                       the PATH\n"
+             L"  --serve[=<name>]     Serve launches from --connect clients\n"
+             L"  --connect[=<name>]   Have a --serve daemon run the command\n"
+             L"  --max-memory=<size>  Limit each process's committed memory\n"
+             L"  --max-job-memory=<size>\n"
+             L"                       Limit the whole job's committed memory\n"
+             L"  --working-set=<min>,<max>\n"
+             L"                       Limit each process's working set\n"
+             L"  --hard-working-set   Enforce --working-set as a hard limit\n"
+             L"  --memory-priority=<level>\n"
+             L"                       very-low, low, medium, below or normal\n"
+             L"  --lock-memory        Let the child allocate large pages\n"
+             L"  --prefault-image     Read the child's image in before it\n"
+             L"                       starts\n"
+             L"  --reserve-cpusets    Move other processes off the CPUs\n"
+             L"  --isolate            Move other processes off the cores and\n"
+             L"                       report interrupts that reach them\n"
+             L"  --migrate[=<pct>]    Re-pin the child when others take more\n"
+             L"                       than pct (50) of one of its CPUs\n"
+             L"  --reserve            Claim the CPUs so that concurrent\n"
+             L"                       instances pick different ones\n"
+             L"  --spread-threads     Pin each child thread to its own core\n"
+             L"  --wait-tree          Wait for the child's descendants to\n"
+             L"                       exit\n"
+             L"  --stats[=text|json]  Report the child's resource usage on\n"
+             L"                       exit\n"
+             L"  --timings[=text|json]\n"
+             L"                       Report how long each launch phase took\n"
+             L"  --topology[=text|json]\n"
+             L"                       Describe the CPUs and the ones a child\n"
+             L"                       would be pinned to, then exit\n"
+             L"  --stats-file=<path>  Write the report to path, not stderr\n"
+             L"  --trace <file.etl>   Record a kernel trace while children\n"
+             L"                       run\n"
+             L"  --pmc[=<counters>]   Count hardware events for the child:\n"
+             L"                       cycles, instructions, llc-misses,\n"
+             L"                       branch-misses or source names\n"
+             L"  --repeat=<n>         Run the command n times and summarize\n"
+             L"                       its launch, wall clock and CPU times\n"
+             L"  --warmup=<n>         Discard n runs before measuring\n"
+             L"  --prewarm=<n>        Keep n suspended children ready\n"
+             L"  --drop-outliers      Discard runs with outlying wall times\n"
+             L"  --summary=<format>   text (default), csv or json\n"
+             L"  --batch <file|->     Run every command line in file (or\n"
+             L"                       stdin), each on its own CPU\n"
+             L"  --slots=<n>          Run at most n batch commands at once"
+          << EndLine;
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Options_h
+#define rununiproc_Options_h
+
+#include <string>
+#include <vector>
+
+#include "Benchmark.h"
+#include "CpuSelection.h"
+#include "JobStats.h"
+#include "Launcher.h"
+
+struct Options
+{
+  PlacementPolicy mPlacement;
+  CpuSpec mCpus;
+  AffinityBackend mBackend = AffinityBackend::Job;
+  CoreClass mCoreClass = CoreClass::Performance;
+  JobControls mControls;
+  RepeatOptions mRepeat;
+  // Report the child's resource usage when it exits
+  StatsFormat mStats = StatsFormat::None;
+  // Report how long each phase of the launch took, in this format
+  StatsFormat mTimings = StatsFormat::None;
+  // Describe the machine and where a child would be pinned, in this format,
+  // instead of launching anything
+  StatsFormat mTopology = StatsFormat::None;
+  // Where to write the report; stderr when null
+  wchar_t const* mStatsFile = nullptr;
+  // Pin each of the child's threads to its own core within its affinity
+  bool mSpreadThreads = false;
+  // Wait for every process in the child's job, not just the child, to exit
+  bool mWaitTree = false;
+  // Record a kernel trace of the child's lifetime to this .etl file
+  wchar_t const* mTraceFile = nullptr;
+  // Hardware counters to sample for the child; none when empty
+  std::vector<std::wstring> mPmcSources;
+  // Pass our own command line's tail to the child as written, rather than
+  // requoting argv
+  bool mRawArgs = false;
+  // Pass arguments that do not fit on the command line in a response file
+  bool mResponseFile = false;
+  // Relay the children's output through pipes, to mRelayFile or, when that
+  // is null, to our own stdout and stderr
+  bool mRelay = false;
+  wchar_t const* mRelayFile = nullptr;
+  // Remember where commands were found on the PATH across runs
+  bool mPathCache = false;
+  // Prefer memory from the NUMA node of the child's processors
+  bool mNumaMemory = true;
+  // Move other processes' default CPU sets off the child's processors
+  bool mReserveCpuSets = false;
+  // Re-pin the child when other work takes more than mMigrateThreshold of
+  // one of its processors' time
+  bool mMigrate = false;
+  double mMigrateThreshold = 0.5;
+  // As mReserveCpuSets, but for the child's whole cores, also reporting the
+  // interrupts that can still reach them
+  bool mIsolate = false;
+  // Coordinate with other instances so that each claims a distinct CPU
+  bool mReserve = false;
+  // When set, the commands to run come from this file (or stdin for "-")
+  // rather than from our own command line
+  wchar_t const* mBatchFile = nullptr;
+  // Serve launch requests on a named pipe, or send ours to such a server,
+  // instead of launching anything ourselves. Pipes are named after
+  // mServerName, which when null means "default".
+  bool mServe = false;
+  bool mConnect = false;
+  wchar_t const* mServerName = nullptr;
+  // The number of batch commands to run at once; zero picks a default
+  size_t mSlots = 0;
+  // Index into argv of the executable to launch; its arguments follow it
+  int mCommandIndex = 0;
+};
+
+/**
+ * Parses our own options, which precede the command to launch. Reports any
+ * failure to stderr and returns false.
+ */
+bool ParseOptions(int argc, wchar_t* argv[], Options& aOptions);
+
+void PrintUsage();
+
+#endif // rununiproc_Options_h
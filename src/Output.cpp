@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Output.h"
+
+#include <stdio.h>
+#include <wchar.h>
+
+TextWriter gStdout(STD_OUTPUT_HANDLE);
+TextWriter gStderr(STD_ERROR_HANDLE);
+
+void
+TextWriter::Flush()
+{
+  // Either half of a surrogate pair on its own would become a replacement
+  // character, so a pair that a full buffer splits waits for the next flush
+  size_t len = mLen;
+  if (len && IS_HIGH_SURROGATE(mBuf[len - 1])) {
+    --len;
+  }
+  if (!len) {
+    return;
+  }
+
+  // Writes may be partial, so keep going until everything is out or a write
+  // fails, in which case there is nowhere left to report it
+  HANDLE output = GetStdHandle(mStdHandle);
+  DWORD written;
+  DWORD mode;
+  if (GetConsoleMode(output, &mode)) {
+    for (size_t done = 0; done < len; done += written) {
+      if (!WriteConsoleW(output, mBuf + done, static_cast<DWORD>(len - done),
+                         &written, nullptr) || !written) {
+        break;
+      }
+    }
+  } else {
+    // Redirected to a file or pipe, so write UTF-8
+    char bytes[kBufLen * 3];
+    int bytesLen = WideCharToMultiByte(CP_UTF8, 0, mBuf, static_cast<int>(len),
+                                       bytes, sizeof(bytes), nullptr, nullptr);
+    for (int done = 0; done < bytesLen; done += static_cast<int>(written)) {
+      if (!WriteFile(output, bytes + done,
+                     static_cast<DWORD>(bytesLen - done), &written, nullptr) ||
+          !written) {
+        break;
+      }
+    }
+  }
+
+  if (len < mLen) {
+    mBuf[0] = mBuf[len];
+  }
+  mLen -= len;
+}
+
+void
+TextWriter::Write(wchar_t const* aText, size_t aLen)
+{
+  if (mTarget) {
+    mTarget->append(aText, aLen);
+    return;
+  }
+
+  while (aLen) {
+    if (mLen == kBufLen) {
+      Flush();
+    }
+    size_t chunk = kBufLen - mLen;
+    if (chunk > aLen) {
+      chunk = aLen;
+    }
+    wmemcpy(mBuf + mLen, aText, chunk);
+    mLen += chunk;
+    aText += chunk;
+    aLen -= chunk;
+  }
+}
+
+void
+TextWriter::WritePadded(wchar_t const* aText, size_t aLen)
+{
+  size_t padding = mWidth > aLen ? mWidth - aLen : 0;
+  mWidth = 0;
+
+  static wchar_t const kSpaces[] = L"                ";
+  size_t const spacesLen = sizeof(kSpaces) / sizeof(kSpaces[0]) - 1;
+
+  if (mLeft) {
+    Write(aText, aLen);
+  }
+  while (padding) {
+    size_t chunk = padding < spacesLen ? padding : spacesLen;
+    Write(kSpaces, chunk);
+    padding -= chunk;
+  }
+  if (!mLeft) {
+    Write(aText, aLen);
+  }
+}
+
+TextWriter&
+TextWriter::operator<<(wchar_t const* aText)
+{
+  WritePadded(aText, wcslen(aText));
+  return *this;
+}
+
+TextWriter&
+TextWriter::operator<<(std::wstring const& aText)
+{
+  WritePadded(aText.data(), aText.size());
+  return *this;
+}
+
+TextWriter&
+TextWriter::operator<<(wchar_t aChar)
+{
+  WritePadded(&aChar, 1);
+  return *this;
+}
+
+TextWriter&
+TextWriter::WriteUnsigned(unsigned long long aValue, bool aNegative)
+{
+  wchar_t digits[24];
+  wchar_t* end = digits + sizeof(digits) / sizeof(digits[0]);
+  wchar_t* start = end;
+  unsigned int const base = mHex && !aNegative ? 16 : 10;
+  do {
+    *--start = L"0123456789abcdef"[aValue % base];
+    aValue /= base;
+  } while (aValue);
+  if (aNegative) {
+    *--start = L'-';
+  }
+
+  WritePadded(start, end - start);
+  return *this;
+}
+
+TextWriter&
+TextWriter::operator<<(int aValue)
+{
+  return *this << static_cast<long long>(aValue);
+}
+
+TextWriter&
+TextWriter::operator<<(long aValue)
+{
+  return *this << static_cast<long long>(aValue);
+}
+
+TextWriter&
+TextWriter::operator<<(long long aValue)
+{
+  // Negate in unsigned arithmetic so that the minimum value survives
+  unsigned long long magnitude = static_cast<unsigned long long>(aValue);
+  if (aValue < 0) {
+    magnitude = 0 - magnitude;
+  }
+  return WriteUnsigned(magnitude, aValue < 0);
+}
+
+TextWriter&
+TextWriter::operator<<(unsigned int aValue)
+{
+  return WriteUnsigned(aValue, false);
+}
+
+TextWriter&
+TextWriter::operator<<(unsigned long aValue)
+{
+  return WriteUnsigned(aValue, false);
+}
+
+TextWriter&
+TextWriter::operator<<(unsigned long long aValue)
+{
+  return WriteUnsigned(aValue, false);
+}
+
+TextWriter&
+TextWriter::operator<<(double aValue)
+{
+  wchar_t text[64];
+  int len = mPrecision >= 0 ?
+    swprintf(text, sizeof(text) / sizeof(text[0]), L"%.*f", mPrecision,
+             aValue) :
+    swprintf(text, sizeof(text) / sizeof(text[0]), L"%g", aValue);
+  if (len < 0) {
+    // Too large for the buffer, which only happens with huge fixed values
+    len = swprintf(text, sizeof(text) / sizeof(text[0]), L"%g", aValue);
+  }
+
+  WritePadded(text, len > 0 ? len : 0);
+  return *this;
+}
+
+TextWriter&
+EndLine(TextWriter& aWriter)
+{
+  aWriter << L'\n';
+  aWriter.Flush();
+  return aWriter;
+}
+
+TextWriter&
+Flush(TextWriter& aWriter)
+{
+  aWriter.Flush();
+  return aWriter;
+}
+
+TextWriter&
+AlignLeft(TextWriter& aWriter)
+{
+  aWriter.SetLeft(true);
+  return aWriter;
+}
+
+TextWriter&
+AlignRight(TextWriter& aWriter)
+{
+  aWriter.SetLeft(false);
+  return aWriter;
+}
+
+TextWriter&
+Hex(TextWriter& aWriter)
+{
+  aWriter.SetHex(true);
+  return aWriter;
+}
+
+TextWriter&
+Dec(TextWriter& aWriter)
+{
+  aWriter.SetHex(false);
+  return aWriter;
+}
@@ -0,0 +1,197 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Output_h
+#define rununiproc_Output_h
+
+#include <stddef.h>
+
+#include <string>
+
+#include <windows.h>
+
+/**
+ * A stand-in for the little of <iostream> and <sstream> that we use. iostreams
+ * cost every launch their static initialization and locale machinery for the
+ * sake of an error message that is almost never printed, so instead this
+ * formats into a fixed buffer and writes straight to a standard handle, or
+ * appends to a string.
+ *
+ * As with iostreams, a width set with SetWidth applies to the next item only,
+ * while SetFixed, AlignLeft and AlignRight stay in effect.
+ */
+class TextWriter
+{
+public:
+  /**
+   * Writes to the standard handle aStdHandle (STD_OUTPUT_HANDLE or
+   * STD_ERROR_HANDLE), buffering until EndLine, Flush or a full buffer. The
+   * constructor is constexpr so that the global writers need no dynamic
+   * initialization.
+   */
+  constexpr explicit TextWriter(DWORD aStdHandle)
+    : mStdHandle(aStdHandle)
+    , mTarget(nullptr)
+    , mBuf{}
+    , mLen(0)
+    , mWidth(0)
+    , mPrecision(-1)
+    , mLeft(false)
+    , mHex(false)
+  {
+  }
+
+  TextWriter(TextWriter const&) = delete;
+  TextWriter& operator=(TextWriter const&) = delete;
+
+  TextWriter& operator<<(wchar_t const* aText);
+  TextWriter& operator<<(std::wstring const& aText);
+  TextWriter& operator<<(wchar_t aChar);
+  TextWriter& operator<<(int aValue);
+  TextWriter& operator<<(long aValue);
+  TextWriter& operator<<(long long aValue);
+  TextWriter& operator<<(unsigned int aValue);
+  TextWriter& operator<<(unsigned long aValue);
+  TextWriter& operator<<(unsigned long long aValue);
+  TextWriter& operator<<(double aValue);
+
+  TextWriter& operator<<(TextWriter& (*aManipulator)(TextWriter&))
+  {
+    return aManipulator(*this);
+  }
+
+  void SetWidth(unsigned int aWidth)
+  {
+    mWidth = aWidth;
+  }
+
+  // A negative precision selects the shortest representation, as %g does
+  void SetPrecision(int aPrecision)
+  {
+    mPrecision = aPrecision;
+  }
+
+  void SetLeft(bool aLeft)
+  {
+    mLeft = aLeft;
+  }
+
+  // Affects unsigned integers, which are all that we print in hex
+  void SetHex(bool aHex)
+  {
+    mHex = aHex;
+  }
+
+  /**
+   * Writes out anything buffered for a standard handle, apart from a trailing
+   * high surrogate, which waits to be written with its pair.
+   */
+  void Flush();
+
+protected:
+  /**
+   * Appends everything written to aTarget.
+   */
+  explicit TextWriter(std::wstring& aTarget)
+    : TextWriter(static_cast<DWORD>(0))
+  {
+    mTarget = &aTarget;
+  }
+
+private:
+  void Write(wchar_t const* aText, size_t aLen);
+  void WritePadded(wchar_t const* aText, size_t aLen);
+  TextWriter& WriteUnsigned(unsigned long long aValue, bool aNegative);
+
+  static size_t const kBufLen = 512;
+
+  DWORD mStdHandle;
+  std::wstring* mTarget;
+  wchar_t mBuf[kBufLen];
+  size_t mLen;
+  unsigned int mWidth;
+  int mPrecision;
+  bool mLeft;
+  bool mHex;
+};
+
+/**
+ * Replaces std::wostringstream.
+ */
+class StringWriter : public TextWriter
+{
+public:
+  StringWriter()
+    : TextWriter(mString)
+  {
+  }
+
+  std::wstring const& str() const
+  {
+    return mString;
+  }
+
+private:
+  std::wstring mString;
+};
+
+extern TextWriter gStdout;
+extern TextWriter gStderr;
+
+/**
+ * Ends the line and flushes, like std::endl.
+ */
+TextWriter& EndLine(TextWriter& aWriter);
+TextWriter& Flush(TextWriter& aWriter);
+TextWriter& AlignLeft(TextWriter& aWriter);
+TextWriter& AlignRight(TextWriter& aWriter);
+TextWriter& Hex(TextWriter& aWriter);
+TextWriter& Dec(TextWriter& aWriter);
+
+struct WidthManipulator
+{
+  unsigned int mWidth;
+};
+
+struct FixedManipulator
+{
+  int mPrecision;
+};
+
+/**
+ * Pads the next item to aWidth characters, like std::setw.
+ */
+inline WidthManipulator
+SetWidth(unsigned int aWidth)
+{
+  return WidthManipulator{ aWidth };
+}
+
+/**
+ * Formats doubles with aPrecision decimal places, like std::fixed combined
+ * with std::setprecision.
+ */
+inline FixedManipulator
+SetFixed(int aPrecision)
+{
+  return FixedManipulator{ aPrecision };
+}
+
+inline TextWriter&
+operator<<(TextWriter& aWriter, WidthManipulator aManipulator)
+{
+  aWriter.SetWidth(aManipulator.mWidth);
+  return aWriter;
+}
+
+inline TextWriter&
+operator<<(TextWriter& aWriter, FixedManipulator aManipulator)
+{
+  aWriter.SetPrecision(aManipulator.mPrecision);
+  return aWriter;
+}
+
+#endif // rununiproc_Output_h
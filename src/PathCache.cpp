@@ -0,0 +1,268 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PathCache.h"
+
+#include "CpuReservation.h"
+#include "Output.h"
+
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+static size_t const kEntryCount = 128;
+
+// Bump the version suffix whenever the layout of Table changes
+static wchar_t const kCacheFileName[] = L"\\rununiproc\\PathCache.2";
+
+struct PathCache::Entry
+{
+  // The token of the writer that has claimed the entry, or zero
+  LONG64 volatile mWriter;
+  // Odd while a writer is updating the entry
+  LONG volatile mSequence;
+  ULONGLONG mKey;
+  DWORD mVolumeSerial;
+  DWORD mFileIndexHigh;
+  DWORD mFileIndexLow;
+  FILETIME mLastWriteTime;
+  wchar_t mPath[MAX_PATH];
+};
+
+struct PathCache::Table
+{
+  // The file is zero-filled when it is extended, and a zero key never
+  // matches, so no initialization is necessary.
+  Entry mEntries[kEntryCount];
+};
+
+/**
+ * Identifies the file at aPath. Returns false if it cannot be opened.
+ */
+static bool
+GetFileIdentity(wchar_t const* aPath, BY_HANDLE_FILE_INFORMATION& aInfo)
+{
+  UniqueHandle file(CreateFile(aPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE |
+                               FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0,
+                               nullptr));
+  if (file.get() == INVALID_HANDLE_VALUE) {
+    file.release();
+    return false;
+  }
+
+  return !!GetFileInformationByHandle(file.get(), &aInfo);
+}
+
+static void
+HashBytes(ULONGLONG& aHash, void const* aData, size_t aLen)
+{
+  // FNV-1a
+  auto bytes = static_cast<unsigned char const*>(aData);
+  for (size_t i = 0; i < aLen; ++i) {
+    aHash ^= bytes[i];
+    aHash *= 0x100000001B3ULL;
+  }
+}
+
+static void
+HashVariable(ULONGLONG& aHash, wchar_t const* aName)
+{
+  DWORD const bufLen = 1024;
+  wchar_t buf[bufLen];
+  DWORD len = GetEnvironmentVariable(aName, buf, bufLen);
+  if (!len) {
+    // Unset, and buf was left alone; hash it as empty
+    buf[0] = L'\0';
+  }
+  if (len < bufLen) {
+    HashBytes(aHash, buf, (len + 1) * sizeof(wchar_t));
+    return;
+  }
+
+  // The variable may change between the calls, so only trust a value that
+  // fit
+  std::wstring value(len, L'\0');
+  len = GetEnvironmentVariable(aName, &value[0], len);
+  value.resize(len < value.size() ? len : 0);
+  HashBytes(aHash, value.c_str(), (value.size() + 1) * sizeof(wchar_t));
+}
+
+ULONGLONG
+PathCache::KeyFor(wchar_t const* aName)
+{
+  ULONGLONG hash = 0xCBF29CE484222325ULL;
+
+  // Names are case insensitive
+  for (wchar_t const* c = aName; *c; ++c) {
+    wchar_t lower = towlower(*c);
+    HashBytes(hash, &lower, sizeof(lower));
+  }
+  wchar_t const terminator = L'\0';
+  HashBytes(hash, &terminator, sizeof(terminator));
+
+  HashVariable(hash, L"PATH");
+  HashVariable(hash, L"PATHEXT");
+
+  // The search looks in the current directory too
+  wchar_t cwd[MAX_PATH];
+  DWORD len = GetCurrentDirectory(MAX_PATH, cwd);
+  if (len && len < MAX_PATH) {
+    HashBytes(hash, cwd, len * sizeof(wchar_t));
+  } else if (len) {
+    std::wstring longCwd(len, L'\0');
+    len = GetCurrentDirectory(len, &longCwd[0]);
+    if (!len || len >= longCwd.size()) {
+      return 0;
+    }
+    HashBytes(hash, longCwd.c_str(), len * sizeof(wchar_t));
+  } else {
+    return 0;
+  }
+
+  // Zero marks an empty entry
+  return hash ? hash : 1;
+}
+
+bool
+PathCache::Open()
+{
+  if (!CpuReservation::GetOwnerToken(GetCurrentProcess(),
+                                     GetCurrentProcessId(), mToken)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to compute the path cache writer token, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  wchar_t path[MAX_PATH];
+  size_t const fileNameLen = sizeof(kCacheFileName) / sizeof(wchar_t);
+  DWORD len = GetEnvironmentVariable(L"LOCALAPPDATA", path, MAX_PATH);
+  if (!len || len + fileNameLen > MAX_PATH) {
+    gStderr << L"Unable to locate the local application data directory"
+            << EndLine;
+    return false;
+  }
+
+  wmemcpy(path + len, kCacheFileName, fileNameLen);
+
+  // Create our directory, leaving path as is once done
+  wchar_t* fileName = wcsrchr(path, L'\\');
+  *fileName = L'\0';
+  if (!CreateDirectory(path, nullptr) &&
+      GetLastError() != ERROR_ALREADY_EXISTS) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create " << path << L", error code " << err
+            << EndLine;
+    return false;
+  }
+  *fileName = L'\\';
+
+  mFile.reset(CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+  if (mFile.get() == INVALID_HANDLE_VALUE) {
+    mFile.release();
+    DWORD err = GetLastError();
+    gStderr << L"Unable to open path cache " << path << L", error code "
+            << err << EndLine;
+    return false;
+  }
+
+  mSection.reset(CreateFileMapping(mFile.get(), nullptr, PAGE_READWRITE, 0,
+                                   sizeof(Table), nullptr));
+  if (!mSection) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to map path cache, error code " << err << EndLine;
+    return false;
+  }
+
+  mTable.reset(reinterpret_cast<Table*>(
+    MapViewOfFile(mSection.get(), FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Table))));
+  if (!mTable) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to map path cache, error code " << err << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+PathCache::Lookup(wchar_t const* aName, std::wstring& aPath)
+{
+  ULONGLONG const key = KeyFor(aName);
+  if (!key) {
+    return false;
+  }
+  Entry& entry = mTable->mEntries[key % kEntryCount];
+
+  LONG sequence = entry.mSequence;
+  MemoryBarrier();
+  if ((sequence & 1) || entry.mKey != key) {
+    return false;
+  }
+
+  Entry copy;
+  memcpy(&copy, &entry, sizeof(copy));
+  MemoryBarrier();
+  if (entry.mSequence != sequence) {
+    return false;
+  }
+  copy.mPath[MAX_PATH - 1] = L'\0';
+
+  // The file must still be the one that we found before
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileIdentity(copy.mPath, info) ||
+      info.dwVolumeSerialNumber != copy.mVolumeSerial ||
+      info.nFileIndexHigh != copy.mFileIndexHigh ||
+      info.nFileIndexLow != copy.mFileIndexLow ||
+      CompareFileTime(&info.ftLastWriteTime, &copy.mLastWriteTime)) {
+    return false;
+  }
+
+  aPath = copy.mPath;
+  return true;
+}
+
+void
+PathCache::Store(wchar_t const* aName, std::wstring const& aPath)
+{
+  BY_HANDLE_FILE_INFORMATION info;
+  if (aPath.size() >= MAX_PATH || !GetFileIdentity(aPath.c_str(), info)) {
+    return;
+  }
+
+  ULONGLONG const key = KeyFor(aName);
+  if (!key) {
+    return;
+  }
+  Entry& entry = mTable->mEntries[key % kEntryCount];
+
+  // Another instance is updating this entry; theirs is as good as ours.
+  // One that died while doing so left its claim behind, and possibly an odd
+  // sequence that would hide the entry for good, so take its place.
+  LONG64 writer = InterlockedCompareExchange64(&entry.mWriter, mToken, 0);
+  if (writer && (CpuReservation::IsOwnerAlive(writer) ||
+                 InterlockedCompareExchange64(&entry.mWriter, mToken,
+                                              writer) != writer)) {
+    return;
+  }
+
+  // Only the claimant changes the sequence, so it is ours to make odd
+  if (!(entry.mSequence & 1)) {
+    InterlockedIncrement(&entry.mSequence);
+  }
+
+  entry.mKey = key;
+  entry.mVolumeSerial = info.dwVolumeSerialNumber;
+  entry.mFileIndexHigh = info.nFileIndexHigh;
+  entry.mFileIndexLow = info.nFileIndexLow;
+  entry.mLastWriteTime = info.ftLastWriteTime;
+  wmemcpy(entry.mPath, aPath.c_str(), aPath.size() + 1);
+
+  InterlockedIncrement(&entry.mSequence);
+  InterlockedExchange64(&entry.mWriter, 0);
+}
@@ -0,0 +1,71 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_PathCache_h
+#define rununiproc_PathCache_h
+
+#include <string>
+
+#include <windows.h>
+
+#include "UniqueHandle.h"
+
+/**
+ * Remembers where commands were found on the PATH, so that repeated launches
+ * need not search it again.
+ *
+ * The cache is a small file in the user's local application data directory
+ * that every instance maps. Entries are keyed by a hash of the command name
+ * together with everything else that the search depends on: PATH, PATHEXT
+ * and the current directory. An entry is only used while the file that it
+ * names still has the same file ID and last write time. Each entry is guarded
+ * by a sequence count, so concurrent instances need no lock; a reader that
+ * races with a writer simply misses. Writers first claim the entry with their
+ * CpuReservation owner token, so an entry left mid-update by a writer that
+ * died is taken over by the next one to store there.
+ */
+class PathCache
+{
+public:
+  PathCache() = default;
+
+  PathCache(PathCache const&) = delete;
+  PathCache& operator=(PathCache const&) = delete;
+
+  /**
+   * Opens (or creates) the cache file. Reports any failure to stderr and
+   * returns false, in which case the cache must not be used.
+   */
+  bool Open();
+
+  /**
+   * Looks up the path of aName as resolved in the current environment.
+   * Returns false when there is no valid entry.
+   */
+  bool Lookup(wchar_t const* aName, std::wstring& aPath);
+
+  /**
+   * Records that aName resolved to aPath in the current environment.
+   */
+  void Store(wchar_t const* aName, std::wstring const& aPath);
+
+private:
+  struct Entry;
+  struct Table;
+
+  /**
+   * Returns zero if the current directory cannot be queried, in which case
+   * the cache is bypassed.
+   */
+  static ULONGLONG KeyFor(wchar_t const* aName);
+
+  LONG64 mToken = 0;
+  UniqueHandle mFile;
+  UniqueHandle mSection;
+  MappedViewPtr<Table> mTable;
+};
+
+#endif // rununiproc_PathCache_h
@@ -0,0 +1,466 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Pmc.h"
+
+#include <unordered_set>
+
+#include <string.h>
+#include <wchar.h>
+
+#include "CpuSelection.h"
+#include "Output.h"
+
+namespace {
+
+// Mirrors PROFILE_SOURCE_INFO
+struct ProfileSourceInfo
+{
+  ULONG NextEntryOffset;
+  ULONG Source;
+  ULONG MinInterval;
+  ULONG MaxInterval;
+  ULONG64 Reserved;
+  WCHAR Description[ANYSIZE_ARRAY];
+};
+
+struct SourceAlias
+{
+  wchar_t const* mAlias;
+  wchar_t const* mSourceName;
+};
+
+SourceAlias const kSourceAliases[] = {
+  { L"cycles", L"TotalCycles" },
+  { L"instructions", L"InstructionRetired" },
+  { L"llc-misses", L"LLCMisses" },
+  { L"branch-misses", L"BranchMispredictions" },
+};
+
+bool
+IsEvent(EVENT_RECORD const& aRecord, GUID const& aGuid, UCHAR aOpcode)
+{
+  return aRecord.EventHeader.EventDescriptor.Opcode == aOpcode &&
+         aRecord.EventHeader.ProviderId == aGuid;
+}
+
+DWORD
+ReadUserDataDword(EVENT_RECORD const& aRecord, size_t aOffset)
+{
+  DWORD value;
+  memcpy(&value, static_cast<BYTE const*>(aRecord.UserData) + aOffset,
+         sizeof(value));
+  return value;
+}
+
+/**
+ * Returns the number of the processor that logged aRecord. This is
+ * ProcessorIndex in the Windows 8 SDK, which older SDKs split into two bytes.
+ */
+USHORT
+ProcessorIndex(EVENT_RECORD const& aRecord)
+{
+  USHORT index;
+  memcpy(&index, &aRecord.BufferContext, sizeof(index));
+  return index;
+}
+
+} // anonymous namespace
+
+bool
+ParsePmcSources(wchar_t const* aSpec, std::vector<std::wstring>& aNames)
+{
+  aNames.clear();
+  if (!*aSpec) {
+    for (SourceAlias const& alias : kSourceAliases) {
+      aNames.push_back(alias.mSourceName);
+    }
+    return true;
+  }
+
+  std::wstring spec(aSpec);
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t end = spec.find(L',', start);
+    if (end == std::wstring::npos) {
+      end = spec.size();
+    }
+
+    std::wstring term(spec, start, end - start);
+    if (term.empty()) {
+      gStderr << L"Empty counter name in \"" << aSpec << L"\""
+              << EndLine;
+      return false;
+    }
+
+    for (SourceAlias const& alias : kSourceAliases) {
+      if (term == alias.mAlias) {
+        term = alias.mSourceName;
+        break;
+      }
+    }
+    aNames.push_back(term);
+
+    start = end + 1;
+  }
+
+  return true;
+}
+
+PmcSession::~PmcSession()
+{
+  Stop();
+}
+
+bool
+PmcSession::ResolveSources(std::vector<std::wstring> const& aNames)
+{
+  TraceQueryInformationFn queryInfo = GetTraceQueryInformation();
+  if (!queryInfo) {
+    gStderr << L"Hardware counters require Windows 8." << EndLine;
+    return false;
+  }
+
+  std::vector<BYTE> buf(4096);
+  ULONG len = 0;
+  ULONG result;
+  while ((result = queryInfo(0, kTraceProfileSourceListInfo, buf.data(),
+                             static_cast<ULONG>(buf.size()), &len)) ==
+         ERROR_INSUFFICIENT_BUFFER || result == ERROR_BAD_LENGTH) {
+    buf.resize(len > buf.size() ? len : buf.size() * 2);
+  }
+  if (result != ERROR_SUCCESS) {
+    gStderr << L"Unable to list hardware counters, error code " << result
+            << EndLine;
+    return false;
+  }
+
+  std::vector<ProfileSourceInfo const*> sources;
+  for (size_t offset = 0; offset < len;) {
+    auto source = reinterpret_cast<ProfileSourceInfo const*>(&buf[offset]);
+    sources.push_back(source);
+    if (!source->NextEntryOffset) {
+      break;
+    }
+    offset += source->NextEntryOffset;
+  }
+
+  for (std::wstring const& name : aNames) {
+    ProfileSourceInfo const* found = nullptr;
+    for (ProfileSourceInfo const* source : sources) {
+      if (!_wcsicmp(source->Description, name.c_str())) {
+        found = source;
+        break;
+      }
+    }
+
+    if (!found) {
+      gStderr << L"This processor has no \"" << name << L"\" counter. "
+                 L"Available counters:";
+      for (ProfileSourceInfo const* source : sources) {
+        gStderr << L" " << source->Description;
+      }
+      gStderr << EndLine;
+      return false;
+    }
+
+    mSourceIds.push_back(found->Source);
+    mSourceNames.push_back(found->Description);
+  }
+
+  return true;
+}
+
+bool
+PmcSession::Start(std::vector<std::wstring> const& aNames,
+                  Topology const& aTopology, CpuSet const& aAvoid)
+{
+  TraceSetInformationFn setInfo = GetTraceSetInformation();
+  if (!setInfo || !ResolveSources(aNames)) {
+    if (!setInfo) {
+      gStderr << L"Hardware counters require Windows 8." << EndLine;
+    }
+    return false;
+  }
+
+  // System logger sessions are few, so free any that killed instances left
+  StopOrphanedKernelSessions();
+
+  if (!MakeKernelSessionName(L"pmc", mSessionName)) {
+    return false;
+  }
+
+  EVENT_TRACE_PROPERTIES* props =
+    InitTraceProperties(mProperties, mSessionName, nullptr,
+                        EVENT_TRACE_FLAG_PROCESS | EVENT_TRACE_FLAG_THREAD |
+                        EVENT_TRACE_FLAG_CSWITCH);
+
+  {
+    ExitCleanup::AutoLock lock;
+    if (!StartKernelSession(mSessionName, props, mSession)) {
+      return false;
+    }
+    Register();
+  }
+
+  // The counters must be configured before the events that carry them
+  ULONG result =
+    setInfo(mSession, kTracePmcCounterListInfo, mSourceIds.data(),
+            static_cast<ULONG>(mSourceIds.size() * sizeof(ULONG)));
+  if (result != ERROR_SUCCESS) {
+    gStderr << L"Unable to configure hardware counters, error code "
+            << result << EndLine;
+    return false;
+  }
+
+  ClassicEventId contextSwitch = {};
+  contextSwitch.EventGuid = kThreadEventGuid;
+  contextSwitch.Type = kOpcodeContextSwitch;
+  result = setInfo(mSession, kTracePmcEventListInfo, &contextSwitch,
+                   sizeof(contextSwitch));
+  if (result != ERROR_SUCCESS) {
+    gStderr << L"Unable to attach hardware counters to context switches, "
+               L"error code " << result << EndLine;
+    return false;
+  }
+
+  EVENT_TRACE_LOGFILE logFile = {};
+  logFile.LoggerName = const_cast<wchar_t*>(mSessionName.c_str());
+  logFile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME |
+                             PROCESS_TRACE_MODE_EVENT_RECORD;
+  logFile.EventRecordCallback = &OnEvent;
+  logFile.Context = this;
+
+  mConsumer = OpenTrace(&logFile);
+  if (mConsumer == INVALID_PROCESSTRACE_HANDLE) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to consume kernel trace session, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  mConsumerThread.reset(CreateThread(nullptr, 0, &ConsumerThread, this,
+                                     CREATE_SUSPENDED, nullptr));
+  if (!mConsumerThread) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create trace consumer thread, error code "
+            << err << EndLine;
+    return false;
+  }
+
+  KeepThreadOff(mConsumerThread.get(), aTopology, aAvoid);
+  ResumeThread(mConsumerThread.get());
+
+  return true;
+}
+
+bool
+PmcSession::Stop()
+{
+  bool ok = true;
+
+  if (mSession) {
+    RunCleanup();
+    auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(mProperties.data());
+    ok = CheckKernelSessionStopped(mStopResult, props, mEventsLost);
+  }
+
+  // ProcessTrace returns once the stopped session's last buffers are consumed
+  if (mConsumerThread) {
+    WaitForSingleObject(mConsumerThread.get(), INFINITE);
+    mConsumerThread.reset();
+  }
+
+  if (mConsumer != INVALID_PROCESSTRACE_HANDLE) {
+    CloseTrace(mConsumer);
+    mConsumer = INVALID_PROCESSTRACE_HANDLE;
+  }
+
+  return ok;
+}
+
+void
+PmcSession::Cleanup()
+{
+  auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(mProperties.data());
+  mStopResult = StopKernelSession(mSession, props);
+  mSession = 0;
+}
+
+DWORD WINAPI
+PmcSession::ConsumerThread(LPVOID aContext)
+{
+  auto self = static_cast<PmcSession*>(aContext);
+  ProcessTrace(&self->mConsumer, 1, nullptr, nullptr);
+  return 0;
+}
+
+void WINAPI
+PmcSession::OnEvent(PEVENT_RECORD aRecord)
+{
+  auto self = static_cast<PmcSession*>(aRecord->UserContext);
+  EVENT_RECORD const& record = *aRecord;
+
+  if (IsEvent(record, kThreadEventGuid, kOpcodeContextSwitch)) {
+    self->OnContextSwitch(record);
+  } else if (IsEvent(record, kThreadEventGuid, kOpcodeStart)) {
+    self->OnThreadStart(record);
+  } else if (IsEvent(record, kProcessEventGuid, kOpcodeStart)) {
+    self->OnProcessStart(record);
+  }
+}
+
+void
+PmcSession::OnProcessStart(EVENT_RECORD const& aRecord)
+{
+  // ProcessId and ParentId follow the UniqueProcessKey pointer
+  size_t const pointerSize =
+    (aRecord.EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER) ? 4 : 8;
+  if (aRecord.UserDataLength < pointerSize + 2 * sizeof(DWORD)) {
+    return;
+  }
+
+  DWORD const pid = ReadUserDataDword(aRecord, pointerSize);
+  mProcessParent[pid] = ReadUserDataDword(aRecord, pointerSize +
+                                                   sizeof(DWORD));
+  // The pid may have been reused
+  mProcessCounts.erase(pid);
+}
+
+void
+PmcSession::OnThreadStart(EVENT_RECORD const& aRecord)
+{
+  if (aRecord.UserDataLength < 2 * sizeof(DWORD)) {
+    return;
+  }
+
+  DWORD const pid = ReadUserDataDword(aRecord, 0);
+  DWORD const tid = ReadUserDataDword(aRecord, sizeof(DWORD));
+  mThreadProcess[tid] = pid;
+}
+
+void
+PmcSession::OnContextSwitch(EVENT_RECORD const& aRecord)
+{
+  if (aRecord.UserDataLength < 2 * sizeof(DWORD)) {
+    return;
+  }
+
+  ULONG64 const* counters = nullptr;
+  size_t count = 0;
+  for (USHORT i = 0; i < aRecord.ExtendedDataCount; ++i) {
+    EVENT_HEADER_EXTENDED_DATA_ITEM const& item = aRecord.ExtendedData[i];
+    if (item.ExtType == kExtTypePmcCounters) {
+      counters = reinterpret_cast<ULONG64 const*>(item.DataPtr);
+      count = item.DataSize / sizeof(ULONG64);
+      break;
+    }
+  }
+  if (!counters || count != mSourceIds.size()) {
+    return;
+  }
+
+  // Whatever the processor counted since its previous context switch was done
+  // by the thread that is now being switched out
+  std::vector<ULONG64>& last = mLastCounters[ProcessorIndex(aRecord)];
+  if (last.size() == count) {
+    DWORD const oldThread = ReadUserDataDword(aRecord, sizeof(DWORD));
+    auto thread = mThreadProcess.find(oldThread);
+    if (thread != mThreadProcess.end()) {
+      std::vector<ULONG64>& totals = mProcessCounts[thread->second];
+      totals.resize(count, 0);
+      for (size_t i = 0; i < count; ++i) {
+        if (counters[i] >= last[i]) {
+          totals[i] += counters[i] - last[i];
+        }
+      }
+    }
+  }
+
+  last.assign(counters, counters + count);
+}
+
+std::vector<ULONG64>
+PmcSession::CountsFor(DWORD aPid) const
+{
+  std::unordered_set<DWORD> tree = { aPid };
+  bool grew = true;
+  while (grew) {
+    grew = false;
+    for (auto const& entry : mProcessParent) {
+      if (tree.count(entry.second) && tree.insert(entry.first).second) {
+        grew = true;
+      }
+    }
+  }
+
+  std::vector<ULONG64> result(mSourceIds.size(), 0);
+  for (DWORD pid : tree) {
+    auto counts = mProcessCounts.find(pid);
+    if (counts == mProcessCounts.end()) {
+      continue;
+    }
+    for (size_t i = 0; i < result.size() && i < counts->second.size(); ++i) {
+      result[i] += counts->second[i];
+    }
+  }
+
+  return result;
+}
+
+std::wstring
+PmcSession::FormatReport(DWORD aPid, DWORD aExitCode) const
+{
+  std::vector<ULONG64> const counts = CountsFor(aPid);
+
+  ULONG64 const* cycles = nullptr;
+  ULONG64 const* instructions = nullptr;
+  ULONG64 const* llcMisses = nullptr;
+  ULONG64 const* branchMisses = nullptr;
+
+  StringWriter stream;
+  stream << L"Hardware counters (exit code " << aExitCode << L"):\n";
+  for (size_t i = 0; i < counts.size(); ++i) {
+    wchar_t const* name = mSourceNames[i].c_str();
+    stream << L"  " << AlignLeft << SetWidth(34) << name << AlignRight
+           << counts[i] << L"\n";
+    if (!_wcsicmp(name, L"TotalCycles")) {
+      cycles = &counts[i];
+    } else if (!_wcsicmp(name, L"InstructionRetired")) {
+      instructions = &counts[i];
+    } else if (!_wcsicmp(name, L"LLCMisses")) {
+      llcMisses = &counts[i];
+    } else if (!_wcsicmp(name, L"BranchMispredictions")) {
+      branchMisses = &counts[i];
+    }
+  }
+
+  stream << SetFixed(3);
+  if (cycles && instructions && *cycles) {
+    stream << L"  " << AlignLeft << SetWidth(34) << L"instructions per cycle"
+           << AlignRight << static_cast<double>(*instructions) / *cycles
+           << L"\n";
+  }
+  if (instructions && *instructions) {
+    if (llcMisses) {
+      stream << L"  " << AlignLeft << SetWidth(34)
+             << L"LLC misses per 1000 instructions" << AlignRight
+             << *llcMisses * 1000.0 / *instructions << L"\n";
+    }
+    if (branchMisses) {
+      stream << L"  " << AlignLeft << SetWidth(34)
+             << L"branch misses per 1000 instrs" << AlignRight
+             << *branchMisses * 1000.0 / *instructions << L"\n";
+    }
+  }
+
+  if (mEventsLost) {
+    stream << L"  warning: " << mEventsLost
+           << L" events were lost, so the counts are low\n";
+  }
+
+  return stream.str();
+}
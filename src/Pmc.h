@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Pmc_h
+#define rununiproc_Pmc_h
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "Etw.h"
+#include "ExitCleanup.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+/**
+ * Parses a --pmc= value: comma separated counter names, each either one of
+ * the aliases cycles, instructions, llc-misses and branch-misses, or the name
+ * of a profile source as reported by Windows. An empty aSpec selects all four
+ * aliases. Reports any failure to stderr and returns false.
+ */
+bool ParsePmcSources(wchar_t const* aSpec, std::vector<std::wstring>& aNames);
+
+/**
+ * Counts hardware performance counter events for a child process and its
+ * descendants, using a kernel ETW session that records the counters on every
+ * context switch. The counts accrued by each processor between context
+ * switches are attributed to the thread that was switched out, so work that
+ * the child's processors do on behalf of anything else is not counted. The
+ * session is stopped when this is destroyed, when we are interrupted, or
+ * failing both by the next instance to start a kernel session.
+ *
+ * Requires Windows 8 and administrator rights.
+ */
+class PmcSession : private ExitCleanup
+{
+public:
+  PmcSession() = default;
+  ~PmcSession();
+
+  PmcSession(PmcSession const&) = delete;
+  PmcSession& operator=(PmcSession const&) = delete;
+
+  /**
+   * Starts counting the profile sources named in aNames. This must happen
+   * before the child is created, so that its process and thread start events
+   * are seen. The thread that consumes every context switch on the machine
+   * is kept off the cores of aAvoid, the child's processors. Reports any
+   * failure to stderr and returns false.
+   */
+  bool Start(std::vector<std::wstring> const& aNames,
+             Topology const& aTopology, CpuSet const& aAvoid);
+
+  /**
+   * Stops the session and waits for every buffered event to be processed.
+   * Reports any failure to stderr and returns false.
+   */
+  bool Stop();
+
+  /**
+   * Formats the counts attributed to aPid and its descendants, along with
+   * derived ratios such as instructions per cycle, and aExitCode.
+   */
+  std::wstring FormatReport(DWORD aPid, DWORD aExitCode) const;
+
+private:
+  void Cleanup() override;
+
+  static void WINAPI OnEvent(PEVENT_RECORD aRecord);
+  static DWORD WINAPI ConsumerThread(LPVOID aContext);
+
+  void OnProcessStart(EVENT_RECORD const& aRecord);
+  void OnThreadStart(EVENT_RECORD const& aRecord);
+  void OnContextSwitch(EVENT_RECORD const& aRecord);
+
+  bool ResolveSources(std::vector<std::wstring> const& aNames);
+  std::vector<ULONG64> CountsFor(DWORD aPid) const;
+
+  std::wstring mSessionName;
+  // EVENT_TRACE_PROPERTIES followed by room for the session name
+  std::vector<BYTE> mProperties;
+  TRACEHANDLE mSession = 0;
+  ULONG mStopResult = ERROR_SUCCESS;
+  TRACEHANDLE mConsumer = INVALID_PROCESSTRACE_HANDLE;
+  UniqueHandle mConsumerThread;
+
+  // The profile sources being counted, and their names for reporting
+  std::vector<ULONG> mSourceIds;
+  std::vector<std::wstring> mSourceNames;
+
+  // Everything below is only touched by the consumer thread while it runs
+
+  // Thread id to process id, for threads started during the session
+  std::unordered_map<DWORD, DWORD> mThreadProcess;
+  // Process id to parent process id, for processes started during the session
+  std::unordered_map<DWORD, DWORD> mProcessParent;
+  // The counter values seen at each processor's most recent context switch
+  std::unordered_map<USHORT, std::vector<ULONG64>> mLastCounters;
+  // The counts attributed to each process
+  std::unordered_map<DWORD, std::vector<ULONG64>> mProcessCounts;
+
+  // As reported when the session stopped
+  ULONG mEventsLost = 0;
+};
+
+#endif // rununiproc_Pmc_h
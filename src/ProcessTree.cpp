@@ -0,0 +1,196 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ProcessTree.h"
+
+#include <utility>
+
+#include "Output.h"
+
+static ULONGLONG
+ToQuadPart(FILETIME const& aTime)
+{
+  return (static_cast<ULONGLONG>(aTime.dwHighDateTime) << 32) |
+         aTime.dwLowDateTime;
+}
+
+ProcessTree::Member*
+ProcessTree::Find(DWORD aPid)
+{
+  // Search backwards so that a reused pid finds its newest process
+  for (auto member = mMembers.rbegin(); member != mMembers.rend(); ++member) {
+    if (member->mPid == aPid) {
+      return &*member;
+    }
+  }
+  return nullptr;
+}
+
+void
+ProcessTree::OnMessage(DWORD aMessage, DWORD aPid)
+{
+  switch (aMessage) {
+    case JOB_OBJECT_MSG_NEW_PROCESS: {
+      Member member;
+      member.mPid = aPid;
+      // Holding a handle keeps the exit code and times around after it exits
+      member.mProcess.reset(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION |
+                                        SYNCHRONIZE, FALSE, aPid));
+      if (member.mProcess) {
+        wchar_t image[MAX_PATH];
+        DWORD len = MAX_PATH;
+        if (QueryFullProcessImageName(member.mProcess.get(), 0, image,
+                                      &len)) {
+          member.mImage.assign(image, len);
+        }
+      }
+      mMembers.push_back(std::move(member));
+      break;
+    }
+    case JOB_OBJECT_MSG_EXIT_PROCESS:
+    case JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS: {
+      Member* member = Find(aPid);
+      if (!member) {
+        break;
+      }
+      member->mAbnormalExit =
+        aMessage == JOB_OBJECT_MSG_ABNORMAL_EXIT_PROCESS;
+      if (member->mProcess) {
+        GetExitCodeProcess(member->mProcess.get(), &member->mExitCode);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+std::wstring
+ProcessTree::FormatReport(StatsFormat aFormat) const
+{
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  if (aFormat != StatsFormat::Json) {
+    stream << L"Process tree (" << mMembers.size() << L" processes):\n";
+  }
+
+  ULONGLONG firstStart = 0;
+  for (Member const& member : mMembers) {
+    FILETIME creation = {}, exit = {}, kernel, user;
+    bool const haveTimes =
+      member.mProcess &&
+      GetProcessTimes(member.mProcess.get(), &creation, &exit, &kernel,
+                      &user);
+    if (haveTimes && !firstStart) {
+      firstStart = ToQuadPart(creation);
+    }
+
+    // Times are in 100ns units
+    double const startMs = haveTimes ?
+      (ToQuadPart(creation) - firstStart) / 10000.0 : 0.0;
+    double const runMs = haveTimes && ToQuadPart(exit) ?
+      (ToQuadPart(exit) - ToQuadPart(creation)) / 10000.0 : 0.0;
+    bool const exited = member.mExitCode != STILL_ACTIVE;
+
+    if (aFormat == StatsFormat::Json) {
+      stream << L"{\"pid\":" << member.mPid << L",\"image\":\"";
+      for (wchar_t c : member.mImage) {
+        if (c == L'\\' || c == L'"') {
+          stream << L'\\';
+        }
+        stream << c;
+      }
+      stream << L"\",\"exit_code\":";
+      if (exited) {
+        stream << member.mExitCode;
+      } else {
+        stream << L"null";
+      }
+      stream << L",\"abnormal_exit\":"
+             << (member.mAbnormalExit ? L"true" : L"false")
+             << L",\"start_ms\":" << startMs << L",\"run_ms\":" << runMs
+             << L"}\n";
+      continue;
+    }
+
+    stream << L"  pid " << SetWidth(6) << AlignLeft << member.mPid
+           << AlignRight << L" ";
+    if (exited) {
+      stream << L"exit code " << SetWidth(10) << AlignLeft
+             << member.mExitCode << AlignRight;
+    } else {
+      stream << L"exit code unknown   ";
+    }
+    if (haveTimes) {
+      stream << L" started +" << startMs << L" ms, ran " << runMs << L" ms";
+    }
+    if (member.mAbnormalExit) {
+      stream << L" (abnormal exit)";
+    }
+    stream << L"  " << (member.mImage.empty() ? L"?" : member.mImage.c_str())
+           << L"\n";
+  }
+
+  return stream.str();
+}
+
+bool
+QueryJobEmpty(HANDLE aJob, bool& aEmpty)
+{
+  JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting = {};
+  if (!QueryInformationJobObject(aJob, JobObjectBasicAccountingInformation,
+                                 &accounting, sizeof(accounting), nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to query the job's processes, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  aEmpty = !accounting.ActiveProcesses;
+  return true;
+}
+
+bool
+WaitForEmptyJob(HANDLE aJob, HANDLE aPort, ULONG_PTR aKey, ProcessTree* aTree)
+{
+  while (true) {
+    DWORD message;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped;
+    if (!GetQueuedCompletionStatus(aPort, &message, &key, &overlapped,
+                                   kJobPollIntervalMs)) {
+      if (overlapped || GetLastError() != WAIT_TIMEOUT) {
+        DWORD err = GetLastError();
+        gStderr << L"GetQueuedCompletionStatus failed with error code "
+                << err << EndLine;
+        return false;
+      }
+      bool empty;
+      if (!QueryJobEmpty(aJob, empty)) {
+        return false;
+      }
+      if (empty) {
+        return true;
+      }
+      continue;
+    }
+
+    if (key != aKey) {
+      continue;
+    }
+
+    // For process messages, the "overlapped" pointer is really the pid
+    if (aTree) {
+      aTree->OnMessage(message, static_cast<DWORD>(
+                                  reinterpret_cast<ULONG_PTR>(overlapped)));
+    }
+
+    if (message == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO) {
+      return true;
+    }
+  }
+}
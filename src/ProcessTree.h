@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_ProcessTree_h
+#define rununiproc_ProcessTree_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "JobStats.h"
+#include "UniqueHandle.h"
+
+// Job notifications are not guaranteed to be delivered, so waits for a job's
+// processes also poll them this often
+DWORD const kJobPollIntervalMs = 1000;
+
+/**
+ * Records every process that runs in a child's job, as reported by the job's
+ * completion port, so that descendants can be accounted for after they exit.
+ */
+class ProcessTree
+{
+public:
+  ProcessTree() = default;
+
+  /**
+   * Handles a JOB_OBJECT_MSG_* notification concerning aPid.
+   */
+  void OnMessage(DWORD aMessage, DWORD aPid);
+
+  /**
+   * Formats each recorded process's exit code, start time relative to the
+   * first process, and run time, in aFormat.
+   */
+  std::wstring FormatReport(StatsFormat aFormat) const;
+
+private:
+  struct Member
+  {
+    DWORD mPid = 0;
+    // Null if the process was gone before we could open it
+    UniqueHandle mProcess;
+    std::wstring mImage;
+    DWORD mExitCode = STILL_ACTIVE;
+    bool mAbnormalExit = false;
+  };
+
+  Member* Find(DWORD aPid);
+
+  std::vector<Member> mMembers;
+};
+
+/**
+ * Waits until every process in aJob has exited. aPort must be aJob's
+ * completion port, with notifications for aJob posted under aKey; other
+ * notifications are discarded. When aTree is non-null, it is told about every
+ * notification for aJob. Reports any failure to stderr and returns false.
+ */
+bool WaitForEmptyJob(HANDLE aJob, HANDLE aPort, ULONG_PTR aKey,
+                     ProcessTree* aTree);
+
+/**
+ * Sets aEmpty to whether no process remains in aJob. Reports any failure to
+ * stderr and returns false.
+ */
+bool QueryJobEmpty(HANDLE aJob, bool& aEmpty);
+
+#endif // rununiproc_ProcessTree_h
@@ -0,0 +1,120 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ProcessorLoad.h"
+
+#include "Output.h"
+
+namespace {
+
+// From the DDK; winternl.h only exposes a version with reserved fields
+struct SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION
+{
+  LARGE_INTEGER IdleTime;
+  LARGE_INTEGER KernelTime;
+  LARGE_INTEGER UserTime;
+  LARGE_INTEGER DpcTime;
+  LARGE_INTEGER InterruptTime;
+  ULONG InterruptCount;
+};
+
+ULONG const SystemProcessorPerformanceInformation = 8;
+
+// NtQuerySystemInformation only reports on the calling thread's group, so we
+// need the Ex variant, which takes the group as its input buffer.
+using NtQuerySystemInformationExFn = LONG (WINAPI*)(ULONG, PVOID, ULONG,
+                                                    PVOID, ULONG, PULONG);
+
+NtQuerySystemInformationExFn
+GetNtQuerySystemInformationEx()
+{
+  static NtQuerySystemInformationExFn sFn =
+    reinterpret_cast<NtQuerySystemInformationExFn>(
+      GetProcAddress(GetModuleHandle(L"ntdll.dll"),
+                     "NtQuerySystemInformationEx"));
+  return sFn;
+}
+
+} // anonymous namespace
+
+bool
+SnapshotProcessorTimes(WORD aGroup, std::vector<ProcessorTimes>& aTimes)
+{
+  NtQuerySystemInformationExFn queryFn = GetNtQuerySystemInformationEx();
+  if (!queryFn) {
+    gStderr << L"Unable to resolve NtQuerySystemInformationEx" << EndLine;
+    return false;
+  }
+
+  SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION perfInfo[MAXIMUM_PROC_PER_GROUP];
+  USHORT group = aGroup;
+  ULONG returnedLen = 0;
+  LONG status = queryFn(SystemProcessorPerformanceInformation, &group,
+                        sizeof(group), perfInfo, sizeof(perfInfo),
+                        &returnedLen);
+  if (status < 0) {
+    gStderr << L"NtQuerySystemInformationEx failed with status 0x"
+            << Hex << static_cast<ULONG>(status) << Dec
+            << EndLine;
+    return false;
+  }
+
+  size_t count = returnedLen / sizeof(perfInfo[0]);
+  aTimes.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    // Kernel time includes the time spent in the idle thread
+    aTimes[i].mIdle = perfInfo[i].IdleTime.QuadPart;
+    aTimes[i].mTotal = perfInfo[i].KernelTime.QuadPart +
+                       perfInfo[i].UserTime.QuadPart;
+    aTimes[i].mDpc = perfInfo[i].DpcTime.QuadPart;
+    aTimes[i].mInterrupt = perfInfo[i].InterruptTime.QuadPart;
+    aTimes[i].mInterruptCount = perfInfo[i].InterruptCount;
+  }
+
+  return true;
+}
+
+bool
+ProcessorLoad::Sample(Topology const& aTopology, DWORD aWindowMs)
+{
+  WORD const groupCount = aTopology.GroupCount();
+  std::vector<std::vector<ProcessorTimes>> before(groupCount);
+  for (WORD group = 0; group < groupCount; ++group) {
+    if (!SnapshotProcessorTimes(group, before[group])) {
+      return false;
+    }
+  }
+
+  Sleep(aWindowMs);
+
+  mBusy.assign(groupCount, std::vector<double>());
+  for (WORD group = 0; group < groupCount; ++group) {
+    std::vector<ProcessorTimes> after;
+    if (!SnapshotProcessorTimes(group, after)) {
+      return false;
+    }
+
+    size_t count = before[group].size() < after.size() ?
+                   before[group].size() : after.size();
+    mBusy[group].resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      ULONGLONG idle = after[i].mIdle - before[group][i].mIdle;
+      ULONGLONG total = after[i].mTotal - before[group][i].mTotal;
+      mBusy[group][i] = total ? 1.0 - static_cast<double>(idle) / total : 0.0;
+    }
+  }
+
+  return true;
+}
+
+double
+ProcessorLoad::Busy(PROCESSOR_NUMBER const& aCpu) const
+{
+  if (aCpu.Group >= mBusy.size() || aCpu.Number >= mBusy[aCpu.Group].size()) {
+    return 1.0;
+  }
+  return mBusy[aCpu.Group][aCpu.Number];
+}
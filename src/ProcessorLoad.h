@@ -0,0 +1,62 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_ProcessorLoad_h
+#define rununiproc_ProcessorLoad_h
+
+#include <vector>
+
+#include <windows.h>
+
+#include "Topology.h"
+
+/**
+ * The times and interrupt count that the kernel keeps for one processor, in
+ * 100ns units.
+ */
+struct ProcessorTimes
+{
+  ULONGLONG mIdle = 0;
+  // Includes the idle time
+  ULONGLONG mTotal = 0;
+  ULONGLONG mDpc = 0;
+  ULONGLONG mInterrupt = 0;
+  ULONG mInterruptCount = 0;
+};
+
+/**
+ * Reads the times of every processor in aGroup, indexed by processor number.
+ * Reports any failure to stderr and returns false.
+ */
+bool SnapshotProcessorTimes(WORD aGroup, std::vector<ProcessorTimes>& aTimes);
+
+/**
+ * Per-processor utilization measured over a short sampling window, using the
+ * idle, kernel and user times that the kernel keeps for every processor.
+ */
+class ProcessorLoad
+{
+public:
+  ProcessorLoad() = default;
+
+  /**
+   * Takes two snapshots of every active group aWindowMs milliseconds apart.
+   * Reports any failure to stderr and returns false.
+   */
+  bool Sample(Topology const& aTopology, DWORD aWindowMs);
+
+  /**
+   * Returns the fraction of the window, from 0.0 to 1.0, that aCpu spent doing
+   * something other than idling. Unknown processors are reported as busy.
+   */
+  double Busy(PROCESSOR_NUMBER const& aCpu) const;
+
+private:
+  // Indexed by group, then by processor number within the group
+  std::vector<std::vector<double>> mBusy;
+};
+
+#endif // rununiproc_ProcessorLoad_h
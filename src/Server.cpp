@@ -0,0 +1,539 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Server.h"
+
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <wchar.h>
+
+#include "Options.h"
+#include "Output.h"
+#include "UniqueHandle.h"
+
+namespace {
+
+// Bump whenever the layout of a request or response changes
+DWORD const kProtocolVersion = 1;
+DWORD const kPipeBufferSize = 64 * 1024;
+// Far more than a command line and a typical environment need, but bounded
+// so that a client cannot make us allocate without limit
+size_t const kMaxMessageSize = 4 * 1024 * 1024;
+// How long a client may take to send its request or collect its response
+DWORD const kClientTimeoutMs = 10000;
+
+DWORD const kStdHandles[] = {
+  STD_INPUT_HANDLE,
+  STD_OUTPUT_HANDLE,
+  STD_ERROR_HANDLE
+};
+
+/**
+ * A request is this header followed by the client's current directory, its
+ * command line, its argv strings and its environment block, each null
+ * terminated (the environment block doubly so), as UTF-16.
+ */
+struct RequestHeader
+{
+  DWORD mVersion;
+  DWORD mArgc;
+  // Handle values in the client, or zero where it has none
+  ULONGLONG mStdHandles[3];
+  // Lengths in characters, including terminators
+  DWORD mCurrentDirectoryLen;
+  DWORD mCommandLineLen;
+  DWORD mArgsLen;
+  DWORD mEnvironmentLen;
+};
+
+struct Response
+{
+  DWORD mExitCode;
+};
+
+std::wstring
+PipeName(wchar_t const* aName)
+{
+  return std::wstring(L"\\\\.\\pipe\\rununiproc.serve.") +
+         (aName ? aName : L"default");
+}
+
+/**
+ * A security descriptor whose DACL grants access to our own user alone, so
+ * that other local users can neither send requests nor occupy the pipe.
+ */
+class OwnUserSecurity
+{
+public:
+  OwnUserSecurity() = default;
+
+  OwnUserSecurity(OwnUserSecurity const&) = delete;
+  OwnUserSecurity& operator=(OwnUserSecurity const&) = delete;
+
+  /**
+   * Reports any failure to stderr and returns false.
+   */
+  bool Init()
+  {
+    HANDLE rawToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &rawToken)) {
+      DWORD err = GetLastError();
+      gStderr << L"OpenProcessToken failed with error code " << err
+              << EndLine;
+      return false;
+    }
+    UniqueHandle token(rawToken);
+
+    DWORD len = 0;
+    GetTokenInformation(token.get(), TokenUser, nullptr, 0, &len);
+    mUser.resize(len);
+    if (!len || !GetTokenInformation(token.get(), TokenUser, mUser.data(), len,
+                                     &len)) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to query our user, error code " << err << EndLine;
+      return false;
+    }
+
+    PSID user = reinterpret_cast<TOKEN_USER*>(mUser.data())->User.Sid;
+    DWORD const aclLen = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) -
+                         sizeof(DWORD) + GetLengthSid(user);
+    mAcl.resize(aclLen);
+    PACL acl = reinterpret_cast<PACL>(mAcl.data());
+    if (!InitializeAcl(acl, aclLen, ACL_REVISION) ||
+        !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, user) ||
+        !InitializeSecurityDescriptor(&mDescriptor,
+                                      SECURITY_DESCRIPTOR_REVISION) ||
+        !SetSecurityDescriptorDacl(&mDescriptor, TRUE, acl, FALSE)) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to build the pipe's security descriptor, error code "
+              << err << EndLine;
+      return false;
+    }
+
+    mAttributes.nLength = sizeof(mAttributes);
+    mAttributes.lpSecurityDescriptor = &mDescriptor;
+    mAttributes.bInheritHandle = FALSE;
+    return true;
+  }
+
+  SECURITY_ATTRIBUTES* get()
+  {
+    return &mAttributes;
+  }
+
+private:
+  // A TOKEN_USER, and the ACL, both variable length
+  std::vector<char> mUser;
+  std::vector<char> mAcl;
+  SECURITY_DESCRIPTOR mDescriptor;
+  SECURITY_ATTRIBUTES mAttributes;
+};
+
+/**
+ * Waits until the overlapped operation on aPipe that aOverlapped describes
+ * completes, or cancels it once aTimeoutMs have passed. aStarted is what the
+ * call that began it returned. Returns whether it succeeded, with the last
+ * error set as for a synchronous call.
+ */
+bool
+FinishIo(HANDLE aPipe, OVERLAPPED& aOverlapped, BOOL aStarted,
+         DWORD aTimeoutMs, DWORD& aTransferred)
+{
+  // A message read that completes at once with more to come still filled
+  // the buffer
+  DWORD const err = GetLastError();
+  if (!aStarted && err != ERROR_IO_PENDING && err != ERROR_MORE_DATA) {
+    return false;
+  }
+  if (WaitForSingleObject(aOverlapped.hEvent, aTimeoutMs) != WAIT_OBJECT_0) {
+    CancelIoEx(aPipe, &aOverlapped);
+  }
+  return !!GetOverlappedResult(aPipe, &aOverlapped, &aTransferred, TRUE);
+}
+
+/**
+ * Reads one whole message of up to kMaxMessageSize bytes from aPipe, giving
+ * up if the client has not sent all of it within kClientTimeoutMs.
+ */
+bool
+ReadMessage(HANDLE aPipe, HANDLE aEvent, std::vector<char>& aMessage)
+{
+  ULONGLONG const deadline = GetTickCount64() + kClientTimeoutMs;
+  aMessage.resize(kPipeBufferSize);
+  size_t received = 0;
+  for (;;) {
+    ULONGLONG const now = GetTickCount64();
+    DWORD const timeout = now < deadline ?
+                          static_cast<DWORD>(deadline - now) : 0;
+
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = aEvent;
+    DWORD read = 0;
+    BOOL started = ReadFile(aPipe, &aMessage[received],
+                            static_cast<DWORD>(aMessage.size() - received),
+                            nullptr, &overlapped);
+    bool ok = FinishIo(aPipe, overlapped, started, timeout, read);
+    DWORD err = GetLastError();
+    received += read;
+    if (ok) {
+      aMessage.resize(received);
+      return true;
+    }
+
+    if (err == ERROR_OPERATION_ABORTED) {
+      gStderr << L"Dropping a client that did not send its request in time"
+              << EndLine;
+      return false;
+    }
+    if (err != ERROR_MORE_DATA) {
+      return false;
+    }
+    if (aMessage.size() >= kMaxMessageSize) {
+      gStderr << L"Ignoring a request of more than " << kMaxMessageSize
+              << L" bytes" << EndLine;
+      return false;
+    }
+    aMessage.resize(aMessage.size() * 2 < kMaxMessageSize ?
+                    aMessage.size() * 2 : kMaxMessageSize);
+  }
+}
+
+/**
+ * Points our standard handles at a client's for the duration of a request,
+ * so that everything that we and the child write goes to the client.
+ */
+class StdHandleSwap
+{
+public:
+  StdHandleSwap(HANDLE aClient, ULONGLONG const (&aHandles)[3])
+  {
+    for (size_t i = 0; i < 3; ++i) {
+      mSaved[i] = GetStdHandle(kStdHandles[i]);
+      HANDLE dup = nullptr;
+      // Console pseudohandles from before Windows 8 cannot be duplicated;
+      // the child shares ours instead
+      if (aHandles[i] &&
+          DuplicateHandle(aClient,
+                          reinterpret_cast<HANDLE>(
+                            static_cast<ULONG_PTR>(aHandles[i])),
+                          GetCurrentProcess(), &dup, 0, TRUE,
+                          DUPLICATE_SAME_ACCESS)) {
+        mHandles[i].reset(dup);
+        SetStdHandle(kStdHandles[i], dup);
+      }
+    }
+  }
+
+  ~StdHandleSwap()
+  {
+    gStdout << Flush;
+    gStderr << Flush;
+    for (size_t i = 0; i < 3; ++i) {
+      SetStdHandle(kStdHandles[i], mSaved[i]);
+    }
+  }
+
+private:
+  HANDLE mSaved[3];
+  UniqueHandle mHandles[3];
+};
+
+/**
+ * Checks that aLen characters at aText end with aTerminators nulls.
+ */
+bool
+IsTerminated(wchar_t const* aText, DWORD aLen, DWORD aTerminators)
+{
+  if (aLen < aTerminators) {
+    return false;
+  }
+  for (DWORD i = aLen - aTerminators; i < aLen; ++i) {
+    if (aText[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Runs the request in aMessage from the client on aPipe, returning the exit
+ * code to send back.
+ */
+DWORD
+HandleRequest(LaunchSession& aSession, HANDLE aPipe,
+              std::vector<char>& aMessage)
+{
+  RequestHeader header;
+  if (aMessage.size() < sizeof(header)) {
+    gStderr << L"Ignoring a truncated request" << EndLine;
+    return 1;
+  }
+  memcpy(&header, aMessage.data(), sizeof(header));
+
+  // Compared in 64 bits, so that bogus lengths cannot overflow
+  ULONGLONG const textLen = static_cast<ULONGLONG>(
+                              header.mCurrentDirectoryLen) +
+                            header.mCommandLineLen + header.mArgsLen +
+                            header.mEnvironmentLen;
+  if (header.mVersion != kProtocolVersion || !header.mArgc ||
+      sizeof(header) + textLen * sizeof(wchar_t) != aMessage.size()) {
+    gStderr << L"Ignoring a malformed request" << EndLine;
+    return 1;
+  }
+
+  wchar_t* currentDirectory =
+    reinterpret_cast<wchar_t*>(&aMessage[sizeof(header)]);
+  wchar_t* commandLine = currentDirectory + header.mCurrentDirectoryLen;
+  wchar_t* args = commandLine + header.mCommandLineLen;
+  wchar_t* environment = args + header.mArgsLen;
+  if (!IsTerminated(currentDirectory, header.mCurrentDirectoryLen, 1) ||
+      !IsTerminated(commandLine, header.mCommandLineLen, 1) ||
+      !IsTerminated(args, header.mArgsLen, 1) ||
+      !IsTerminated(environment, header.mEnvironmentLen, 2)) {
+    gStderr << L"Ignoring a malformed request" << EndLine;
+    return 1;
+  }
+
+  std::vector<wchar_t*> argv;
+  for (wchar_t* arg = args; arg < environment && argv.size() < header.mArgc;
+       arg += wcslen(arg) + 1) {
+    argv.push_back(arg);
+  }
+  if (argv.size() != header.mArgc) {
+    gStderr << L"Ignoring a malformed request" << EndLine;
+    return 1;
+  }
+  argv.push_back(nullptr);
+
+  ULONG clientPid;
+  if (!GetNamedPipeClientProcessId(aPipe, &clientPid)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetNamedPipeClientProcessId failed with error code " << err
+            << EndLine;
+    return 1;
+  }
+
+  UniqueHandle client(OpenProcess(PROCESS_DUP_HANDLE, FALSE, clientPid));
+  if (!client) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to open client process " << clientPid
+            << L", error code " << err << EndLine;
+    return 1;
+  }
+
+  // From here on, errors are the client's to see
+  StdHandleSwap swap(client.get(), header.mStdHandles);
+
+  // Requests run one at a time, so the process-wide state is ours to change
+  if (!SetCurrentDirectory(currentDirectory) ||
+      !SetEnvironmentStringsW(environment)) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to adopt the client's directory and environment, "
+               L"error code " << err << EndLine;
+    return 1;
+  }
+
+  int const argc = static_cast<int>(header.mArgc);
+  Options options;
+  if (!ParseOptions(argc, argv.data(), options)) {
+    PrintUsage();
+    return 1;
+  }
+  if (options.mServe) {
+    gStderr << L"--serve cannot be requested of a server." << EndLine;
+    return 1;
+  }
+
+  return static_cast<DWORD>(RunCommand(aSession, options, argc, argv.data(),
+                                       commandLine, false));
+}
+
+} // anonymous namespace
+
+int
+RunServer(LaunchSession& aSession, wchar_t const* aName)
+{
+  std::wstring const name = PipeName(aName);
+
+  // Being the first instance means that nobody else is posing as the server,
+  // and only our own user may connect, so nobody else can hold the one
+  // instance either
+  OwnUserSecurity security;
+  if (!security.Init()) {
+    return 1;
+  }
+
+  UniqueHandle pipe(CreateNamedPipe(name.c_str(), PIPE_ACCESS_DUPLEX |
+                                    FILE_FLAG_FIRST_PIPE_INSTANCE |
+                                    FILE_FLAG_OVERLAPPED,
+                                    PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE |
+                                    PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                    1, kPipeBufferSize, kPipeBufferSize, 0,
+                                    security.get()));
+  if (pipe.get() == INVALID_HANDLE_VALUE) {
+    pipe.release();
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create " << name << L", error code " << err
+            << EndLine;
+    return 1;
+  }
+
+  // The pipe is overlapped so that a client that stops talking to us cannot
+  // keep us waiting
+  UniqueHandle event(CreateEvent(nullptr, TRUE, FALSE, nullptr));
+  if (!event) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateEvent failed with error code " << err << EndLine;
+    return 1;
+  }
+
+  gStderr << L"Serving launch requests on " << name << EndLine;
+
+  std::vector<char> message;
+  for (;;) {
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = event.get();
+    DWORD transferred;
+    BOOL connected = ConnectNamedPipe(pipe.get(), &overlapped);
+    if (!connected && GetLastError() != ERROR_PIPE_CONNECTED &&
+        !FinishIo(pipe.get(), overlapped, connected, INFINITE, transferred)) {
+      DWORD err = GetLastError();
+      gStderr << L"ConnectNamedPipe failed with error code " << err
+              << EndLine;
+      return 1;
+    }
+
+    if (ReadMessage(pipe.get(), event.get(), message)) {
+      Response response = {};
+      response.mExitCode = HandleRequest(aSession, pipe.get(), message);
+      overlapped = OVERLAPPED();
+      overlapped.hEvent = event.get();
+      BOOL started = WriteFile(pipe.get(), &response, sizeof(response),
+                               nullptr, &overlapped);
+      if (FinishIo(pipe.get(), overlapped, started, kClientTimeoutMs,
+                   transferred)) {
+        // Disconnecting discards what the client has not read yet, so wait
+        // (for a while) for it to hang up once it has
+        char unused;
+        overlapped = OVERLAPPED();
+        overlapped.hEvent = event.get();
+        started = ReadFile(pipe.get(), &unused, sizeof(unused), nullptr,
+                           &overlapped);
+        FinishIo(pipe.get(), overlapped, started, kClientTimeoutMs,
+                 transferred);
+      }
+    }
+
+    DisconnectNamedPipe(pipe.get());
+  }
+}
+
+int
+RunClient(int argc, wchar_t* argv[], wchar_t const* aName)
+{
+  std::wstring const name = PipeName(aName);
+
+  // The server handles one request at a time, so wait our turn
+  UniqueHandle pipe;
+  for (;;) {
+    pipe.reset(CreateFile(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+                          nullptr, OPEN_EXISTING, 0, nullptr));
+    if (pipe.get() != INVALID_HANDLE_VALUE) {
+      break;
+    }
+    pipe.release();
+
+    DWORD err = GetLastError();
+    if (err != ERROR_PIPE_BUSY) {
+      gStderr << L"Unable to connect to " << name << L", error code " << err
+              << EndLine;
+      return 1;
+    }
+    WaitNamedPipe(name.c_str(), NMPWAIT_WAIT_FOREVER);
+  }
+
+  DWORD mode = PIPE_READMODE_MESSAGE;
+  if (!SetNamedPipeHandleState(pipe.get(), &mode, nullptr, nullptr)) {
+    DWORD err = GetLastError();
+    gStderr << L"SetNamedPipeHandleState failed with error code " << err
+            << EndLine;
+    return 1;
+  }
+
+  RequestHeader header = {};
+  header.mVersion = kProtocolVersion;
+  header.mArgc = static_cast<DWORD>(argc);
+  for (size_t i = 0; i < 3; ++i) {
+    header.mStdHandles[i] = reinterpret_cast<ULONG_PTR>(
+                              GetStdHandle(kStdHandles[i]));
+  }
+
+  std::wstring text;
+  DWORD dirLen = GetCurrentDirectory(0, nullptr);
+  text.resize(dirLen);
+  dirLen = GetCurrentDirectory(dirLen, &text[0]);
+  text.resize(dirLen + 1);
+  header.mCurrentDirectoryLen = static_cast<DWORD>(text.size());
+
+  wchar_t const* commandLine = GetCommandLineW();
+  text.append(commandLine, wcslen(commandLine) + 1);
+  header.mCommandLineLen = static_cast<DWORD>(text.size()) -
+                           header.mCurrentDirectoryLen;
+
+  size_t const argsStart = text.size();
+  for (int i = 0; i < argc; ++i) {
+    text.append(argv[i], wcslen(argv[i]) + 1);
+  }
+  header.mArgsLen = static_cast<DWORD>(text.size() - argsStart);
+
+  wchar_t* environment = GetEnvironmentStringsW();
+  if (!environment) {
+    gStderr << L"GetEnvironmentStrings failed" << EndLine;
+    return 1;
+  }
+  wchar_t const* end = environment;
+  while (*end) {
+    end += wcslen(end) + 1;
+  }
+  // An empty block is still doubly terminated
+  size_t const envLen = end == environment ? 2 : end - environment + 1;
+  size_t const envStart = text.size();
+  text.append(environment, envLen);
+  FreeEnvironmentStringsW(environment);
+  header.mEnvironmentLen = static_cast<DWORD>(text.size() - envStart);
+
+  std::vector<char> message(sizeof(header) + text.size() * sizeof(wchar_t));
+  if (message.size() > kMaxMessageSize) {
+    gStderr << L"The request is too large for the server; it is limited to "
+            << kMaxMessageSize << L" bytes" << EndLine;
+    return 1;
+  }
+  memcpy(&message[0], &header, sizeof(header));
+  memcpy(&message[sizeof(header)], text.data(),
+         text.size() * sizeof(wchar_t));
+
+  DWORD written;
+  if (!WriteFile(pipe.get(), message.data(),
+                 static_cast<DWORD>(message.size()), &written, nullptr) ||
+      written != message.size()) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to send the request, error code " << err << EndLine;
+    return 1;
+  }
+
+  Response response;
+  DWORD read;
+  if (!ReadFile(pipe.get(), &response, sizeof(response), &read, nullptr) ||
+      read != sizeof(response)) {
+    DWORD err = GetLastError();
+    gStderr << L"The server did not respond, error code " << err << EndLine;
+    return 1;
+  }
+
+  return static_cast<int>(response.mExitCode);
+}
@@ -0,0 +1,33 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Server_h
+#define rununiproc_Server_h
+
+#include <windows.h>
+
+#include "Session.h"
+
+/**
+ * Serves launch requests from --connect clients on a named pipe until
+ * killed, one request at a time, reusing aSession throughout. The pipe is
+ * named after aName, or "default" when it is null. Each request runs as if
+ * the client's own command line had been given to us, in the client's
+ * current directory and environment and with the client's standard handles,
+ * so the child's output, our errors and any stats report all reach the
+ * client directly. Reports any failure to start serving to stderr and
+ * returns 1.
+ */
+int RunServer(LaunchSession& aSession, wchar_t const* aName);
+
+/**
+ * Sends our command line to the server named aName, or "default" when it is
+ * null, and waits for it to run the command. Returns the exit code that the
+ * server sends back, or 1 if the request could not be made.
+ */
+int RunClient(int argc, wchar_t* argv[], wchar_t const* aName);
+
+#endif // rununiproc_Server_h
@@ -0,0 +1,291 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Session.h"
+
+#include <string>
+
+#include "Batch.h"
+#include "Benchmark.h"
+#include "CpuSelection.h"
+#include "CpuSets.h"
+#include "Isolation.h"
+#include "JobStats.h"
+#include "Migration.h"
+#include "Launcher.h"
+#include "Output.h"
+#include "Pmc.h"
+#include "ProcessTree.h"
+#include "StdioRelay.h"
+#include "ThreadSpreader.h"
+#include "Timings.h"
+#include "TopologyDump.h"
+#include "TraceSession.h"
+#include "UniqueHandle.h"
+
+bool
+LaunchSession::Init()
+{
+  bool const ok = mTopology.Init() &&
+                  GetEligibleProcessors(mTopology, mEligible);
+  gTimings.Mark(LaunchPhase::QueryTopology);
+  return ok;
+}
+
+PathCache*
+LaunchSession::GetPathCache()
+{
+  // The cache is only an optimization, so go without it if it will not open
+  if (!mPathCacheTried) {
+    mPathCacheTried = true;
+    mPathCacheOpen = mPathCache.Open();
+  }
+  return mPathCacheOpen ? &mPathCache : nullptr;
+}
+
+CpuReservation*
+LaunchSession::GetReservation()
+{
+  if (!mReservationOpen) {
+    mReservationOpen = mReservation.Open();
+  }
+  return mReservationOpen ? &mReservation : nullptr;
+}
+
+int
+RunCommand(LaunchSession& aSession, Options const& aOptions, int aArgc,
+           wchar_t* aArgv[], wchar_t const* aCommandLine, bool aNewSession)
+{
+  // A new session's topology query was timed as part of this launch, but a
+  // --serve daemon's requests reuse the one it made when it started
+  if (!aNewSession) {
+    gTimings.SetRecording(aOptions.mTimings != StatsFormat::None);
+    gTimings.Begin();
+    gTimings.MarkCached(LaunchPhase::QueryTopology);
+  }
+
+  Topology const& topology = aSession.GetTopology();
+  CpuSet eligible(aSession.Eligible());
+
+  // An explicit list says exactly which processors to use, whatever they are
+  if (aOptions.mCpus.mExplicit.IsEmpty()) {
+    RestrictToCoreClass(topology, aOptions.mCoreClass, eligible);
+  }
+
+  if (aOptions.mTopology != StatsFormat::None) {
+    return DumpTopology(topology, eligible, aOptions);
+  }
+
+  if (aOptions.mBatchFile) {
+    return RunBatch(aSession, aOptions, eligible);
+  }
+
+  int const cmdIndex = aOptions.mCommandIndex;
+
+  PathCache* pathCache = aOptions.mPathCache ? aSession.GetPathCache() :
+                         nullptr;
+
+  LaunchParams params;
+  if (!ResolveExecutable(aArgv[cmdIndex], params.mExePath, pathCache)) {
+    return 1;
+  }
+  gTimings.Mark(LaunchPhase::Resolve);
+
+#if defined(DEBUG)
+  gStdout << L"Launching \"" << params.mExePath << L"\"" << EndLine;
+#endif
+
+  // The claim lives until we return, which is after the child has exited,
+  // while the session keeps the table itself open for later launches
+  CpuReservation* reservation = nullptr;
+  ClaimReleaser releaser;
+  if (aOptions.mReserve) {
+    reservation = aSession.GetReservation();
+    releaser.mReservation = reservation;
+    if (!reservation ||
+        !reservation->SelectAndClaim(topology, eligible, aOptions.mPlacement,
+                                     aOptions.mCpus, params.mAffinity)) {
+      return 1;
+    }
+  } else if (!SelectAffinity(topology, eligible, aOptions.mPlacement,
+                             aOptions.mCpus, params.mAffinity)) {
+    return 1;
+  }
+  gTimings.Mark(LaunchPhase::SelectAffinity);
+
+#if defined(DEBUG)
+  gStdout << L"Pinning to CPUs " << params.mAffinity.ToString()
+          << EndLine;
+#endif
+
+  // The response file must outlive every child that reads it
+  ResponseFile responseFile;
+  bool const built = aOptions.mRawArgs ?
+    BuildRawCommandLine(params.mExePath, aCommandLine, cmdIndex + 1,
+                        params.mCmdLine) :
+    BuildCommandLine(params.mExePath, aArgc - cmdIndex - 1,
+                     aArgv + cmdIndex + 1, params.mCmdLine,
+                     aOptions.mResponseFile ? &responseFile : nullptr);
+  if (!built) {
+    return 1;
+  }
+  gTimings.Mark(LaunchPhase::BuildCommandLine);
+
+  params.mBackend = aOptions.mBackend;
+  params.mControls = aOptions.mControls;
+  if (aOptions.mNumaMemory) {
+    params.mPreferredNode = PreferredNumaNode(topology, params.mAffinity);
+  }
+
+  // Other processes get their CPU sets back once we return
+  CpuSetReservation cpuSetReservation;
+  if (aOptions.mReserveCpuSets && !aOptions.mIsolate &&
+      !cpuSetReservation.Apply(params.mAffinity)) {
+    return 1;
+  }
+
+  // --isolate moves other processes off the child's whole cores instead
+  Isolation isolation;
+  if (aOptions.mIsolate && !isolation.Apply(topology, params.mAffinity)) {
+    return 1;
+  }
+
+  // Descendants are followed through the job's notifications
+  UniqueHandle port;
+  if (aOptions.mWaitTree) {
+    port.reset(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+    if (!port) {
+      DWORD err = GetLastError();
+      gStderr << L"CreateIoCompletionPort failed with error code " << err
+              << EndLine;
+      return 1;
+    }
+    params.mCompletionPort = port.get();
+  }
+
+  TraceSession trace;
+  if (aOptions.mTraceFile && !trace.Start(aOptions.mTraceFile)) {
+    return 1;
+  }
+
+  // Relayed output is written from a thread that stays off the child's CPUs
+  StdioRelay relay;
+  StdioRelay* const relayPtr = aOptions.mRelay ? &relay : nullptr;
+  if (relayPtr &&
+      !relay.Start(topology, params.mAffinity, aOptions.mRelayFile)) {
+    return 1;
+  }
+
+  if (aOptions.mRepeat.mRuns) {
+    return RunRepeated(aOptions.mRepeat, params, aOptions.mStatsFile, relayPtr);
+  }
+
+  // Started first so that it sees the child's process and threads start
+  PmcSession pmc;
+  if (!aOptions.mPmcSources.empty() &&
+      !pmc.Start(aOptions.mPmcSources, topology, params.mAffinity)) {
+    return 1;
+  }
+
+  ThreadSpreader spreader;
+  if (aOptions.mSpreadThreads &&
+      !spreader.Init(topology, params.mAffinity, params.mBackend)) {
+    return 1;
+  }
+
+  Migrator migrator;
+  if (aOptions.mMigrate &&
+      !migrator.Init(topology, eligible, params.mAffinity,
+                     aOptions.mMigrateThreshold)) {
+    return 1;
+  }
+
+  RelayPipes pipes;
+  if (relayPtr && !relay.Connect(std::wstring(), params, pipes)) {
+    return 1;
+  }
+
+  PinnedChild child;
+  if (!CreatePinnedChild(params, child)) {
+    return 1;
+  }
+  // The child has its own copies of the pipes now
+  pipes = RelayPipes();
+
+  if (aOptions.mSpreadThreads && !spreader.Start(child)) {
+    TerminateProcess(child.mProcess.get(), 1);
+    return 1;
+  }
+  if (aOptions.mMigrate && !migrator.Start(child)) {
+    TerminateProcess(child.mProcess.get(), 1);
+    return 1;
+  }
+
+  LONGLONG const startTime = StatsTimestamp();
+  if (!ResumeChild(child)) {
+    return 1;
+  }
+
+  ProcessTree tree;
+  if (aOptions.mWaitTree &&
+      !WaitForEmptyJob(child.mJob.get(), port.get(), 0, &tree)) {
+    // As below, the child did start successfully
+    return 0;
+  }
+
+  if (WaitForSingleObject(child.mProcess.get(), INFINITE) != WAIT_OBJECT_0) {
+    DWORD err = GetLastError();
+    gStderr << L"WaitForSingleObject failed with error code " << err
+            << EndLine;
+    // Not returning 1 here since technically the process started successfully
+    return 0;
+  }
+  gTimings.Mark(LaunchPhase::WaitWakeup);
+
+  spreader.Stop();
+  migrator.Stop();
+  relay.Stop();
+  trace.Stop();
+
+  std::wstring report;
+  if (aOptions.mMigrate) {
+    report += migrator.FormatReport(aOptions.mStats);
+  }
+  if (aOptions.mIsolate && isolation.Stop()) {
+    report += isolation.FormatReport(aOptions.mStats);
+  }
+  if (aOptions.mStats != StatsFormat::None) {
+    JobStats stats;
+    if (QueryJobStats(child.mJob.get(), startTime, StatsTimestamp(), stats)) {
+      report += FormatJobStats(stats, aOptions.mStats);
+    }
+    if (aOptions.mWaitTree) {
+      report += tree.FormatReport(aOptions.mStats);
+    }
+  }
+
+  // We'll forward the child process's return code. By default the code will
+  // be 0; even if GetExitCodeProcess() failed, technically we still did start
+  // the child process successfully.
+  DWORD exitCode = 0;
+  GetChildExitCode(child, exitCode);
+
+  if (!aOptions.mPmcSources.empty() && pmc.Stop()) {
+    report += pmc.FormatReport(child.mPid, exitCode);
+  }
+
+  // Listeners see the exit phase even without --timings
+  gTimings.Mark(LaunchPhase::Exit);
+  if (aOptions.mTimings != StatsFormat::None) {
+    report += gTimings.FormatReport(aOptions.mTimings);
+  }
+
+  if (!report.empty()) {
+    WriteStatsReport(aOptions.mStatsFile, report);
+  }
+
+  return static_cast<int>(exitCode);
+}
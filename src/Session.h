@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Session_h
+#define rununiproc_Session_h
+
+#include <windows.h>
+
+#include "CpuReservation.h"
+#include "CpuSet.h"
+#include "Options.h"
+#include "PathCache.h"
+#include "Topology.h"
+
+/**
+ * What successive launches from the same process can share: the topology and
+ * eligible processors, discovered once, and the path cache and reservation
+ * table, each opened on first use. A --serve daemon keeps one session for all
+ * of its requests.
+ */
+class LaunchSession
+{
+public:
+  LaunchSession() = default;
+
+  LaunchSession(LaunchSession const&) = delete;
+  LaunchSession& operator=(LaunchSession const&) = delete;
+
+  /**
+   * Discovers the topology and the processors that we may run on. Reports
+   * any failure to stderr and returns false.
+   */
+  bool Init();
+
+  Topology const& GetTopology() const
+  {
+    return mTopology;
+  }
+
+  CpuSet const& Eligible() const
+  {
+    return mEligible;
+  }
+
+  /**
+   * Returns the path cache, or null if it could not be opened.
+   */
+  PathCache* GetPathCache();
+
+  /**
+   * Returns the reservation table, or null if it could not be opened.
+   * Launches must release their claims on it when they are done.
+   */
+  CpuReservation* GetReservation();
+
+private:
+  Topology mTopology;
+  CpuSet mEligible;
+  PathCache mPathCache;
+  bool mPathCacheTried = false;
+  bool mPathCacheOpen = false;
+  CpuReservation mReservation;
+  bool mReservationOpen = false;
+};
+
+/**
+ * Drops a launch's claims on the session's reservation table when the launch
+ * is over.
+ */
+struct ClaimReleaser
+{
+  ~ClaimReleaser()
+  {
+    if (mReservation) {
+      mReservation->Release();
+    }
+  }
+
+  CpuReservation* mReservation = nullptr;
+};
+
+/**
+ * Runs the command or batch described by aOptions, which were parsed from
+ * aArgv, itself parsed from aCommandLine. Returns the exit code for
+ * rununiproc itself. aNewSession says that aSession was initialized for this
+ * launch alone, after gTimings began timing it.
+ */
+int RunCommand(LaunchSession& aSession, Options const& aOptions, int aArgc,
+               wchar_t* aArgv[], wchar_t const* aCommandLine,
+               bool aNewSession);
+
+#endif // rununiproc_Session_h
@@ -0,0 +1,331 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "StdioRelay.h"
+
+#include "CpuSelection.h"
+#include "Output.h"
+
+#include <string.h>
+
+// Large enough that a child can write a burst of output without waiting on
+// the relay
+static DWORD const kPipeBufferSize = 1024 * 1024;
+static DWORD const kReadSize = 64 * 1024;
+// Output is written once this much has accumulated, or once the pipes go
+// quiet, whichever comes first
+static size_t const kBatchSize = 256 * 1024;
+static DWORD const kDrainTimeoutMs = 1000;
+
+static ULONG_PTR const kReadKey = 0;
+static ULONG_PTR const kConnectKey = 1;
+static ULONG_PTR const kStopKey = 2;
+
+struct StdioRelay::Stream
+{
+  // First, so that completions can be mapped back to their stream
+  OVERLAPPED mOverlapped;
+  UniqueHandle mPipe;
+  size_t mDest = 0;
+  // The UTF-8 "[tag] " prefix for each line, or empty
+  std::string mPrefix;
+  // The unterminated end of the output so far, when tagging
+  std::string mPartial;
+  char mBuf[kReadSize];
+};
+
+StdioRelay::StdioRelay() = default;
+
+StdioRelay::~StdioRelay()
+{
+  Stop();
+}
+
+bool
+StdioRelay::Start(Topology const& aTopology, CpuSet const& aAvoid,
+                  wchar_t const* aOutputPath)
+{
+  if (aOutputPath) {
+    mOutputFile.reset(CreateFile(aOutputPath, GENERIC_WRITE, FILE_SHARE_READ,
+                                 nullptr, CREATE_ALWAYS,
+                                 FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (mOutputFile.get() == INVALID_HANDLE_VALUE) {
+      mOutputFile.release();
+      DWORD err = GetLastError();
+      gStderr << L"Unable to create output file \"" << aOutputPath
+              << L"\", error code " << err << EndLine;
+      return false;
+    }
+    mDests[0] = mDests[1] = mOutputFile.get();
+  } else {
+    mDests[0] = GetStdHandle(STD_OUTPUT_HANDLE);
+    mDests[1] = GetStdHandle(STD_ERROR_HANDLE);
+  }
+
+  mPort.reset(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+  if (!mPort) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateIoCompletionPort failed with error code " << err
+            << EndLine;
+    return false;
+  }
+
+  mThread.reset(CreateThread(nullptr, 0, &RelayThread, this,
+                             CREATE_SUSPENDED, nullptr));
+  if (!mThread) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateThread failed with error code " << err << EndLine;
+    return false;
+  }
+
+  // Keep off the children's cores
+  KeepThreadOff(mThread.get(), aTopology, aAvoid);
+  ResumeThread(mThread.get());
+  return true;
+}
+
+bool
+StdioRelay::Connect(std::wstring const& aTag, LaunchParams& aParams,
+                    RelayPipes& aPipes)
+{
+  std::string prefix;
+  if (!aTag.empty()) {
+    std::wstring tag = L"[" + aTag + L"] ";
+    int srcLen = static_cast<int>(tag.size());
+    int len = WideCharToMultiByte(CP_UTF8, 0, tag.data(), srcLen, nullptr, 0,
+                                  nullptr, nullptr);
+    prefix.resize(len);
+    WideCharToMultiByte(CP_UTF8, 0, tag.data(), srcLen, &prefix[0], len,
+                        nullptr, nullptr);
+  }
+
+  // Anonymous pipes cannot be read with overlapped I/O, so use uniquely named
+  // ones instead
+  UniqueHandle* ends[] = { &aPipes.mStdOutput, &aPipes.mStdError };
+  for (size_t i = 0; i < 2; ++i) {
+    std::wstring name = L"\\\\.\\pipe\\rununiproc.relay." +
+                        std::to_wstring(GetCurrentProcessId()) + L"." +
+                        std::to_wstring(mNextPipe++);
+
+    auto stream = std::make_unique<Stream>();
+    stream->mPipe.reset(CreateNamedPipe(name.c_str(), PIPE_ACCESS_INBOUND |
+                                        FILE_FLAG_FIRST_PIPE_INSTANCE |
+                                        FILE_FLAG_OVERLAPPED,
+                                        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE |
+                                        PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                        1, 0, kPipeBufferSize, 0, nullptr));
+    if (stream->mPipe.get() == INVALID_HANDLE_VALUE) {
+      stream->mPipe.release();
+      DWORD err = GetLastError();
+      gStderr << L"CreateNamedPipe failed with error code " << err
+              << EndLine;
+      return false;
+    }
+
+    // The child's end must be inheritable to make the handle list
+    SECURITY_ATTRIBUTES inheritable = {};
+    inheritable.nLength = sizeof(inheritable);
+    inheritable.bInheritHandle = TRUE;
+    ends[i]->reset(CreateFile(name.c_str(), GENERIC_WRITE, 0, &inheritable,
+                              OPEN_EXISTING, 0, nullptr));
+    if (ends[i]->get() == INVALID_HANDLE_VALUE) {
+      ends[i]->release();
+      DWORD err = GetLastError();
+      gStderr << L"Unable to open relay pipe, error code " << err
+              << EndLine;
+      return false;
+    }
+
+    if (!CreateIoCompletionPort(stream->mPipe.get(), mPort.get(), kReadKey,
+                                0)) {
+      DWORD err = GetLastError();
+      gStderr << L"CreateIoCompletionPort failed with error code " << err
+              << EndLine;
+      return false;
+    }
+
+    // A file gets everything in the order that it arrives
+    stream->mDest = mOutputFile ? 0 : i;
+    stream->mPrefix = prefix;
+
+    // The relay thread owns the stream from here on
+    if (!PostQueuedCompletionStatus(mPort.get(), 0, kConnectKey,
+                                    &stream->mOverlapped)) {
+      DWORD err = GetLastError();
+      gStderr << L"PostQueuedCompletionStatus failed with error code " << err
+              << EndLine;
+      return false;
+    }
+    stream.release();
+  }
+
+  aParams.mStdOutput = aPipes.mStdOutput.get();
+  aParams.mStdError = aPipes.mStdError.get();
+  return true;
+}
+
+void
+StdioRelay::Stop()
+{
+  if (!mThread) {
+    return;
+  }
+
+  PostQueuedCompletionStatus(mPort.get(), 0, kStopKey, nullptr);
+  WaitForSingleObject(mThread.get(), INFINITE);
+  mThread.reset();
+  mStreams.clear();
+}
+
+DWORD WINAPI
+StdioRelay::RelayThread(LPVOID aContext)
+{
+  static_cast<StdioRelay*>(aContext)->Run();
+  return 0;
+}
+
+void
+StdioRelay::Run()
+{
+  size_t open = 0;
+  bool stopping = false;
+  bool abandoning = false;
+  while (!stopping || open) {
+    bool const pending = !mPending[0].empty() || !mPending[1].empty();
+    DWORD timeout = INFINITE;
+    if (pending) {
+      timeout = 0;
+    } else if (stopping && !abandoning) {
+      timeout = kDrainTimeoutMs;
+    }
+
+    DWORD bytes;
+    ULONG_PTR key;
+    LPOVERLAPPED overlapped;
+    BOOL ok = GetQueuedCompletionStatus(mPort.get(), &bytes, &key,
+                                        &overlapped, timeout);
+    if (!ok && !overlapped) {
+      if (GetLastError() == WAIT_TIMEOUT && pending) {
+        // The pipes have gone quiet, so write out what we have
+        Flush(0);
+        Flush(1);
+        continue;
+      }
+      if (GetLastError() != WAIT_TIMEOUT || abandoning) {
+        break;
+      }
+
+      // Cancel the reads that are left; their completions follow
+      abandoning = true;
+      for (auto& stream : mStreams) {
+        if (stream->mPipe) {
+          CancelIoEx(stream->mPipe.get(), &stream->mOverlapped);
+        }
+      }
+      continue;
+    }
+
+    if (key == kStopKey) {
+      stopping = true;
+      continue;
+    }
+
+    Stream& stream = *reinterpret_cast<Stream*>(overlapped);
+    if (key == kConnectKey) {
+      mStreams.emplace_back(&stream);
+      ++open;
+      if (!Read(stream)) {
+        Finish(stream);
+        --open;
+      }
+      continue;
+    }
+
+    if (ok) {
+      Append(stream, stream.mBuf, bytes);
+      if (Read(stream)) {
+        continue;
+      }
+    }
+
+    // Every writer has closed the pipe
+    Finish(stream);
+    --open;
+  }
+
+  Flush(0);
+  Flush(1);
+}
+
+bool
+StdioRelay::Read(Stream& aStream)
+{
+  // Even a read that completes at once posts its completion to the port
+  memset(&aStream.mOverlapped, 0, sizeof(aStream.mOverlapped));
+  return ReadFile(aStream.mPipe.get(), aStream.mBuf, kReadSize, nullptr,
+                  &aStream.mOverlapped) ||
+         GetLastError() == ERROR_IO_PENDING;
+}
+
+void
+StdioRelay::Append(Stream& aStream, char const* aData, size_t aLen)
+{
+  std::string& pending = mPending[aStream.mDest];
+  if (aStream.mPrefix.empty()) {
+    pending.append(aData, aLen);
+  } else {
+    char const* end = aData + aLen;
+    for (char const* line = aData; line < end;) {
+      char const* newline =
+        static_cast<char const*>(memchr(line, '\n', end - line));
+      if (!newline) {
+        aStream.mPartial.append(line, end - line);
+        break;
+      }
+
+      pending += aStream.mPrefix;
+      pending += aStream.mPartial;
+      pending.append(line, newline + 1 - line);
+      aStream.mPartial.clear();
+      line = newline + 1;
+    }
+  }
+
+  if (pending.size() >= kBatchSize) {
+    Flush(aStream.mDest);
+  }
+}
+
+void
+StdioRelay::Finish(Stream& aStream)
+{
+  if (!aStream.mPartial.empty()) {
+    std::string& pending = mPending[aStream.mDest];
+    pending += aStream.mPrefix;
+    pending += aStream.mPartial;
+    pending += '\n';
+    aStream.mPartial.clear();
+  }
+  aStream.mPipe.reset();
+}
+
+void
+StdioRelay::Flush(size_t aDest)
+{
+  std::string& pending = mPending[aDest];
+  size_t offset = 0;
+  while (offset < pending.size()) {
+    DWORD written;
+    if (!WriteFile(mDests[aDest], pending.data() + offset,
+                   static_cast<DWORD>(pending.size() - offset), &written,
+                   nullptr) || !written) {
+      // Nowhere to report this but the destination itself; drop the output
+      break;
+    }
+    offset += written;
+  }
+  pending.clear();
+}
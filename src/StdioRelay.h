@@ -0,0 +1,97 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_StdioRelay_h
+#define rununiproc_StdioRelay_h
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "Launcher.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+/**
+ * The write ends of the pipes that carry one child's output, for its
+ * LaunchParams. Close them once the child has been created, or the relay
+ * will not see the pipes break when the child exits.
+ */
+struct RelayPipes
+{
+  UniqueHandle mStdOutput;
+  UniqueHandle mStdError;
+};
+
+/**
+ * Relays children's stdout and stderr through large pipes, so that a child
+ * writing to a slow console or file does not stall on its pinned processor.
+ * A single thread, kept off the children's processors, reads every pipe with
+ * overlapped I/O and writes the output in batches, either to our own
+ * standard handles or to a file. Output that is tagged is written a whole line
+ * at a time with the tag in front, so that the output of several children
+ * does not interleave within lines.
+ */
+class StdioRelay
+{
+public:
+  StdioRelay();
+  ~StdioRelay();
+
+  StdioRelay(StdioRelay const&) = delete;
+  StdioRelay& operator=(StdioRelay const&) = delete;
+
+  /**
+   * Starts relaying to aOutputPath, which receives both streams, or to our
+   * own stdout and stderr if it is null. The relay thread runs on processors
+   * outside aAvoid when there are any. Reports any failure to stderr and
+   * returns false.
+   */
+  bool Start(Topology const& aTopology, CpuSet const& aAvoid,
+             wchar_t const* aOutputPath);
+
+  /**
+   * Creates the pipes for one child, and points aParams at their write ends
+   * in aPipes. When aTag is not empty, each line of the child's output is
+   * prefixed with "[aTag] ". Reports any failure to stderr and returns false.
+   */
+  bool Connect(std::wstring const& aTag, LaunchParams& aParams,
+               RelayPipes& aPipes);
+
+  /**
+   * Waits for every connected pipe to be closed by its writers, writes out
+   * what remains and stops the relay thread. Pipes that are still held open
+   * a while after this is called, such as by a detached grandchild, are
+   * abandoned.
+   */
+  void Stop();
+
+private:
+  struct Stream;
+
+  static DWORD WINAPI RelayThread(LPVOID aContext);
+
+  void Run();
+  bool Read(Stream& aStream);
+  void Append(Stream& aStream, char const* aData, size_t aLen);
+  void Finish(Stream& aStream);
+  void Flush(size_t aDest);
+
+  UniqueHandle mPort;
+  UniqueHandle mThread;
+  UniqueHandle mOutputFile;
+  // Where stdout and stderr output goes
+  HANDLE mDests[2] = {};
+  unsigned int mNextPipe = 0;
+  // Only touched by the relay thread once it is running
+  std::vector<std::unique_ptr<Stream>> mStreams;
+  std::string mPending[2];
+};
+
+#endif // rununiproc_StdioRelay_h
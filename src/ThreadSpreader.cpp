@@ -0,0 +1,207 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ThreadSpreader.h"
+
+#include <unordered_set>
+
+#include <tlhelp32.h>
+
+#include "CpuSelection.h"
+#include "CpuSets.h"
+#include "Output.h"
+
+// How often to look for new threads. Each look snapshots every thread on the
+// machine, so the interval doubles while none appear, and drops back once
+// one does.
+static DWORD const kMinWatchIntervalMs = 10;
+static DWORD const kMaxWatchIntervalMs = 320;
+
+ThreadSpreader::~ThreadSpreader()
+{
+  Stop();
+}
+
+bool
+ThreadSpreader::Init(Topology const& aTopology, CpuSet const& aAffinity,
+                     AffinityBackend aBackend)
+{
+  mTopology = &aTopology;
+  mAffinity = aAffinity;
+  mBackend = aBackend;
+  for (Core const& core : aTopology.Cores()) {
+    CpuSet target = core.mProcessors;
+    target &= aAffinity;
+    if (!target.IsEmpty()) {
+      mTargets.push_back(target);
+    }
+  }
+
+  if (mTargets.size() < 2) {
+    gStderr << L"--spread-threads needs CPUs on more than one core; use "
+               L"--cpus to choose them." << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ThreadSpreader::Pin(HANDLE aThread, DWORD aThreadId)
+{
+  mSeenThreads.insert(aThreadId);
+
+  CpuSet const& target = mTargets[mNextTarget];
+  mNextTarget = (mNextTarget + 1) % mTargets.size();
+
+  PROCESSOR_NUMBER ideal;
+  target.First(ideal);
+
+  if (mBackend == AffinityBackend::CpuSets) {
+    if (!SelectThreadCpuSets(aThread, target)) {
+      return false;
+    }
+  } else {
+    // A core never spans processor groups
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = ideal.Group;
+    affinity.Mask = target.GroupMask(ideal.Group);
+    if (!SetThreadGroupAffinity(aThread, &affinity, nullptr)) {
+      DWORD err = GetLastError();
+      gStderr << L"Unable to set affinity of thread " << aThreadId
+              << L", error code " << err << EndLine;
+      return false;
+    }
+  }
+
+  // Not fatal: the affinity alone keeps the thread on its core
+  SetThreadIdealProcessorEx(aThread, &ideal, nullptr);
+
+#if defined(DEBUG)
+  gStdout << L"Pinned thread " << aThreadId << L" to CPUs "
+          << target.ToString() << EndLine;
+#endif
+
+  return true;
+}
+
+bool
+ThreadSpreader::Start(PinnedChild const& aChild)
+{
+  HANDLE mainThread = aChild.mMainThread.get();
+  if (!Pin(mainThread, GetThreadId(mainThread))) {
+    return false;
+  }
+
+  mJob = aChild.mJob.get();
+  mStopEvent.reset(CreateEvent(nullptr, TRUE, FALSE, nullptr));
+  if (!mStopEvent) {
+    DWORD err = GetLastError();
+    gStderr << L"CreateEvent failed with error code " << err << EndLine;
+    return false;
+  }
+
+  mWatchThread.reset(CreateThread(nullptr, 0, &WatchThread, this,
+                                  CREATE_SUSPENDED, nullptr));
+  if (!mWatchThread) {
+    DWORD err = GetLastError();
+    gStderr << L"Unable to create thread watcher, error code " << err
+            << EndLine;
+    return false;
+  }
+
+  KeepThreadOff(mWatchThread.get(), *mTopology, mAffinity);
+  ResumeThread(mWatchThread.get());
+  return true;
+}
+
+void
+ThreadSpreader::Stop()
+{
+  if (!mWatchThread) {
+    return;
+  }
+
+  SetEvent(mStopEvent.get());
+  WaitForSingleObject(mWatchThread.get(), INFINITE);
+  mWatchThread.reset();
+}
+
+DWORD WINAPI
+ThreadSpreader::WatchThread(LPVOID aContext)
+{
+  auto self = static_cast<ThreadSpreader*>(aContext);
+  DWORD interval = kMinWatchIntervalMs;
+  while (WaitForSingleObject(self->mStopEvent.get(), interval) ==
+         WAIT_TIMEOUT) {
+    if (self->PinNewThreads()) {
+      interval = kMinWatchIntervalMs;
+    } else if (interval < kMaxWatchIntervalMs) {
+      interval *= 2;
+    }
+  }
+  return 0;
+}
+
+bool
+ThreadSpreader::PinNewThreads()
+{
+  // Room for the ids of this many processes in the job
+  size_t capacity = 64;
+  std::vector<BYTE> buf;
+  JOBOBJECT_BASIC_PROCESS_ID_LIST* list;
+  while (true) {
+    buf.assign(sizeof(JOBOBJECT_BASIC_PROCESS_ID_LIST) +
+               capacity * sizeof(ULONG_PTR), 0);
+    list = reinterpret_cast<JOBOBJECT_BASIC_PROCESS_ID_LIST*>(buf.data());
+    if (QueryInformationJobObject(mJob, JobObjectBasicProcessIdList, list,
+                                  static_cast<DWORD>(buf.size()), nullptr)) {
+      break;
+    }
+    if (GetLastError() != ERROR_MORE_DATA) {
+      return false;
+    }
+    capacity *= 2;
+  }
+
+  std::unordered_set<DWORD> pids;
+  for (DWORD i = 0; i < list->NumberOfProcessIdsInList; ++i) {
+    pids.insert(static_cast<DWORD>(list->ProcessIdList[i]));
+  }
+  if (pids.empty()) {
+    return false;
+  }
+
+  UniqueHandle snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0));
+  if (snapshot.get() == INVALID_HANDLE_VALUE) {
+    snapshot.release();
+    return false;
+  }
+
+  bool found = false;
+  THREADENTRY32 entry = {};
+  entry.dwSize = sizeof(entry);
+  for (BOOL ok = Thread32First(snapshot.get(), &entry); ok;
+       ok = Thread32Next(snapshot.get(), &entry)) {
+    if (!pids.count(entry.th32OwnerProcessID) ||
+        mSeenThreads.count(entry.th32ThreadID)) {
+      continue;
+    }
+
+    UniqueHandle thread(OpenThread(THREAD_SET_INFORMATION |
+                                   THREAD_QUERY_INFORMATION, FALSE,
+                                   entry.th32ThreadID));
+    if (!thread) {
+      // It has probably exited already
+      mSeenThreads.insert(entry.th32ThreadID);
+      continue;
+    }
+
+    Pin(thread.get(), entry.th32ThreadID);
+    found = true;
+  }
+  return found;
+}
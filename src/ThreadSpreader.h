@@ -0,0 +1,76 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_ThreadSpreader_h
+#define rununiproc_ThreadSpreader_h
+
+#include <unordered_set>
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+#include "Launcher.h"
+#include "Topology.h"
+#include "UniqueHandle.h"
+
+/**
+ * Pins each thread of a child's job to its own core within the child's
+ * affinity, handing out cores round-robin in the order that threads are
+ * discovered. The main thread is pinned before the child is resumed; other
+ * threads are found by a background thread, kept off the child's cores, that
+ * snapshots the system's threads every few milliseconds, backing off while
+ * the child starts none. A new thread may therefore run anywhere in the
+ * child's affinity for a while before it is pinned.
+ */
+class ThreadSpreader
+{
+public:
+  ThreadSpreader() = default;
+  ~ThreadSpreader();
+
+  ThreadSpreader(ThreadSpreader const&) = delete;
+  ThreadSpreader& operator=(ThreadSpreader const&) = delete;
+
+  /**
+   * Splits aAffinity into one target per core. Reports any failure to stderr
+   * and returns false.
+   */
+  bool Init(Topology const& aTopology, CpuSet const& aAffinity,
+            AffinityBackend aBackend);
+
+  /**
+   * Pins aChild's main thread, which must still be suspended, and starts
+   * watching aChild's job for new threads. Reports any failure to stderr and
+   * returns false.
+   */
+  bool Start(PinnedChild const& aChild);
+
+  /**
+   * Stops watching for new threads.
+   */
+  void Stop();
+
+private:
+  static DWORD WINAPI WatchThread(LPVOID aContext);
+
+  // Returns true if any new threads were found
+  bool PinNewThreads();
+  bool Pin(HANDLE aThread, DWORD aThreadId);
+
+  Topology const* mTopology = nullptr;
+  CpuSet mAffinity;
+  std::vector<CpuSet> mTargets;
+  size_t mNextTarget = 0;
+  AffinityBackend mBackend = AffinityBackend::Job;
+  HANDLE mJob = nullptr;
+  // Only touched by the watch thread once it is running
+  std::unordered_set<DWORD> mSeenThreads;
+  UniqueHandle mStopEvent;
+  UniqueHandle mWatchThread;
+};
+
+#endif // rununiproc_ThreadSpreader_h
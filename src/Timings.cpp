@@ -0,0 +1,162 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Timings.h"
+
+#include <TraceLoggingProvider.h>
+
+#include "Output.h"
+
+// {ca01d1a4-dc98-457c-a106-b269cec0e0a9}
+TRACELOGGING_DEFINE_PROVIDER(gProvider, "rununiproc",
+                             (0xca01d1a4, 0xdc98, 0x457c, 0xa1, 0x06, 0xb2,
+                              0x69, 0xce, 0xc0, 0xe0, 0xa9));
+
+LaunchTimings gTimings;
+
+namespace {
+
+// Indexed by LaunchPhase
+wchar_t const* const kPhaseNames[] = {
+  L"start",
+  L"query_topology",
+  L"resolve",
+  L"select_affinity",
+  L"build_command_line",
+  L"create_job",
+  L"attribute_list",
+  L"create_process",
+  L"assign_to_job",
+  L"process_controls",
+  L"resume",
+  L"wait_wakeup",
+  L"exit"
+};
+
+static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) ==
+              static_cast<size_t>(LaunchPhase::Count),
+              "Every launch phase needs a name");
+
+double
+ToMs(LONGLONG aTicks)
+{
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  return static_cast<double>(aTicks) * 1000.0 /
+         static_cast<double>(frequency.QuadPart);
+}
+
+} // anonymous namespace
+
+LaunchTimings::~LaunchTimings()
+{
+  if (mRegistered) {
+    TraceLoggingUnregister(gProvider);
+  }
+}
+
+void
+LaunchTimings::Init()
+{
+  // Failing to register only means that nobody can listen
+  mRegistered = SUCCEEDED(TraceLoggingRegister(gProvider));
+}
+
+bool
+LaunchTimings::IsListening() const
+{
+  return mRecording ||
+         (mRegistered && TraceLoggingProviderEnabled(gProvider, 0, 0));
+}
+
+void
+LaunchTimings::Begin()
+{
+  for (size_t i = 0; i < kPhaseCount; ++i) {
+    mTimestamps[i] = 0;
+    mCached[i] = false;
+  }
+  Mark(LaunchPhase::Start);
+}
+
+void
+LaunchTimings::Mark(LaunchPhase aPhase)
+{
+  if (!IsListening()) {
+    return;
+  }
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  size_t const index = static_cast<size_t>(aPhase);
+  mTimestamps[index] = now.QuadPart;
+
+  // Relative to the start, so that events from many machines can be
+  // aggregated without their clocks agreeing
+  LONGLONG const start = mTimestamps[static_cast<size_t>(LaunchPhase::Start)];
+  TraceLoggingWrite(gProvider, "LaunchPhase",
+                    TraceLoggingWideString(kPhaseNames[index], "Phase"),
+                    TraceLoggingFloat64(start ? ToMs(now.QuadPart - start) :
+                                                0.0, "ElapsedMs"));
+}
+
+void
+LaunchTimings::MarkCached(LaunchPhase aPhase)
+{
+  mCached[static_cast<size_t>(aPhase)] = true;
+  Mark(aPhase);
+}
+
+std::wstring
+LaunchTimings::FormatReport(StatsFormat aFormat) const
+{
+  StringWriter stream;
+  stream << SetFixed(3);
+
+  LONGLONG const start = mTimestamps[static_cast<size_t>(LaunchPhase::Start)];
+  if (aFormat == StatsFormat::Json) {
+    stream << L"{\"timings_ms\":{";
+  } else {
+    stream << L"Launch timings       since start    in phase (ms)\n";
+  }
+
+  // Phases that did not happen, such as resolving a batch command, are left
+  // out, and the next phase is timed from the last one that did
+  LONGLONG previous = start;
+  bool first = true;
+  for (size_t i = 1; i < kPhaseCount; ++i) {
+    LONGLONG const timestamp = mTimestamps[i];
+    if (!timestamp || !start) {
+      continue;
+    }
+
+    if (aFormat == StatsFormat::Json) {
+      stream << (first ? L"\"" : L",\"") << kPhaseNames[i] << L"\":"
+             << ToMs(timestamp - start);
+    } else {
+      stream << L"  " << AlignLeft << SetWidth(20) << kPhaseNames[i]
+             << AlignRight << SetWidth(10) << ToMs(timestamp - start)
+             << SetWidth(12) << ToMs(timestamp - previous)
+             << (mCached[i] ? L" (cached)\n" : L"\n");
+    }
+    previous = timestamp;
+    first = false;
+  }
+
+  if (aFormat == StatsFormat::Json) {
+    stream << L"},\"cached\":[";
+    first = true;
+    for (size_t i = 1; i < kPhaseCount; ++i) {
+      if (mCached[i] && mTimestamps[i]) {
+        stream << (first ? L"\"" : L",\"") << kPhaseNames[i] << L'"';
+        first = false;
+      }
+    }
+    stream << L"]}\n";
+  }
+
+  return stream.str();
+}
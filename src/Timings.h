@@ -0,0 +1,97 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Timings_h
+#define rununiproc_Timings_h
+
+#include <string>
+
+#include <windows.h>
+
+#include "JobStats.h"
+
+/**
+ * The steps of a launch, in the order that they finish.
+ */
+enum class LaunchPhase
+{
+  Start,
+  QueryTopology,
+  Resolve,
+  SelectAffinity,
+  BuildCommandLine,
+  CreateJob,
+  AttributeList,
+  CreateProcess,
+  AssignToJob,
+  ProcessControls,
+  Resume,
+  WaitWakeup,
+  Exit,
+  Count
+};
+
+/**
+ * Timestamps the end of each launch phase, for --timings and for the
+ * rununiproc TraceLogging provider. Marks cost a QueryPerformanceCounter call
+ * when either is listening, and nothing more than a check otherwise.
+ */
+class LaunchTimings
+{
+public:
+  LaunchTimings() = default;
+  ~LaunchTimings();
+
+  LaunchTimings(LaunchTimings const&) = delete;
+  LaunchTimings& operator=(LaunchTimings const&) = delete;
+
+  /**
+   * Registers the TraceLogging provider. Without it, phases are only
+   * recorded for --timings.
+   */
+  void Init();
+
+  /**
+   * Keeps the timestamps of every phase for FormatReport.
+   */
+  void SetRecording(bool aRecording)
+  {
+    mRecording = aRecording;
+  }
+
+  /**
+   * Starts timing a new launch, forgetting the previous one's phases.
+   */
+  void Begin();
+
+  void Mark(LaunchPhase aPhase);
+
+  /**
+   * Marks aPhase as skipped because an earlier launch's result was reused.
+   * It is reported as taking no time, and labelled as cached.
+   */
+  void MarkCached(LaunchPhase aPhase);
+
+  /**
+   * Formats the time at which each recorded phase of the current launch
+   * finished and how long it took.
+   */
+  std::wstring FormatReport(StatsFormat aFormat) const;
+
+private:
+  bool IsListening() const;
+
+  static size_t const kPhaseCount = static_cast<size_t>(LaunchPhase::Count);
+
+  LONGLONG mTimestamps[kPhaseCount] = {};
+  bool mCached[kPhaseCount] = {};
+  bool mRecording = false;
+  bool mRegistered = false;
+};
+
+extern LaunchTimings gTimings;
+
+#endif // rununiproc_Timings_h
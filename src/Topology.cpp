@@ -0,0 +1,194 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Topology.h"
+
+#include <memory>
+
+#include "Output.h"
+
+bool
+Topology::Init()
+{
+  DWORD bufLen = 0;
+  if (GetLogicalProcessorInformationEx(RelationAll, nullptr, &bufLen) ||
+      GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+    gStderr << L"GetLogicalProcessorInformationEx for sizing failed"
+            << EndLine;
+    return false;
+  }
+
+  auto buf = std::make_unique<char[]>(bufLen);
+  if (!GetLogicalProcessorInformationEx(RelationAll,
+        reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buf.get()),
+        &bufLen)) {
+    DWORD err = GetLastError();
+    gStderr << L"GetLogicalProcessorInformationEx failed with error code "
+            << err << EndLine;
+    return false;
+  }
+
+  return InitFromInformation(buf.get(), bufLen);
+}
+
+bool
+Topology::InitFromInformation(void const* aInfo, DWORD aLength)
+{
+  char const* const buf = static_cast<char const*>(aInfo);
+
+  mGroupMasks.clear();
+  mCores.clear();
+  mCaches.clear();
+  mNumaNodes.clear();
+
+  for (DWORD offset = 0; offset < aLength;) {
+    auto info =
+      reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX const*>(
+        buf + offset);
+    switch (info->Relationship) {
+      case RelationGroup: {
+        GROUP_RELATIONSHIP const& groups = info->Group;
+        for (WORD group = 0; group < groups.ActiveGroupCount; ++group) {
+          mGroupMasks.push_back(groups.GroupInfo[group].ActiveProcessorMask);
+        }
+        break;
+      }
+      case RelationProcessorCore: {
+        PROCESSOR_RELATIONSHIP const& processor = info->Processor;
+        Core core;
+        core.mSmt = !!(processor.Flags & LTP_PC_SMT);
+        // Reserved, and therefore zero, before Windows 10
+        core.mEfficiencyClass = processor.EfficiencyClass;
+        for (WORD i = 0; i < processor.GroupCount; ++i) {
+          GROUP_AFFINITY const& groupMask = processor.GroupMask[i];
+          core.mProcessors.SetGroupMask(groupMask.Group, groupMask.Mask);
+        }
+        mCores.push_back(core);
+        break;
+      }
+      case RelationCache: {
+        // Only caches that hold data are interesting for placement decisions
+        CACHE_RELATIONSHIP const& cacheInfo = info->Cache;
+        if (cacheInfo.Type != CacheUnified && cacheInfo.Type != CacheData) {
+          break;
+        }
+        if (cacheInfo.Level != 2 && cacheInfo.Level != 3) {
+          break;
+        }
+        Cache cache;
+        cache.mLevel = cacheInfo.Level;
+        cache.mSize = cacheInfo.CacheSize;
+        cache.mProcessors.SetGroupMask(cacheInfo.GroupMask.Group,
+                                       cacheInfo.GroupMask.Mask);
+        mCaches.push_back(cache);
+        break;
+      }
+      case RelationNumaNode: {
+        // Without RelationNumaNodeEx the system reports each node against a
+        // single group, so GroupMask is sufficient.
+        NUMA_NODE_RELATIONSHIP const& nodeInfo = info->NumaNode;
+        NumaNode node;
+        node.mNumber = nodeInfo.NodeNumber;
+        node.mProcessors.SetGroupMask(nodeInfo.GroupMask.Group,
+                                      nodeInfo.GroupMask.Mask);
+        mNumaNodes.push_back(node);
+        break;
+      }
+      default:
+        break;
+    }
+    offset += info->Size;
+  }
+
+  if (mGroupMasks.empty()) {
+    gStderr << L"No active processor groups were reported." << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+CpuSet
+Topology::AllProcessors() const
+{
+  CpuSet result;
+  for (WORD group = 0; group < GroupCount(); ++group) {
+    result.SetGroupMask(group, mGroupMasks[group]);
+  }
+  return result;
+}
+
+CpuSet
+Topology::L3Domain(unsigned int aIndex) const
+{
+  unsigned int index = 0;
+  for (Cache const& cache : mCaches) {
+    if (cache.mLevel != 3) {
+      continue;
+    }
+    if (index++ == aIndex) {
+      return cache.mProcessors;
+    }
+  }
+  return CpuSet();
+}
+
+CpuSet
+Topology::NumaNodeProcessors(DWORD aNumber) const
+{
+  for (NumaNode const& node : mNumaNodes) {
+    if (node.mNumber == aNumber) {
+      return node.mProcessors;
+    }
+  }
+  return CpuSet();
+}
+
+BYTE
+Topology::MaxEfficiencyClass() const
+{
+  BYTE result = 0;
+  for (Core const& core : mCores) {
+    if (core.mEfficiencyClass > result) {
+      result = core.mEfficiencyClass;
+    }
+  }
+  return result;
+}
+
+CpuSet
+Topology::EfficiencyClassProcessors(BYTE aClass) const
+{
+  CpuSet result;
+  for (Core const& core : mCores) {
+    if (core.mEfficiencyClass == aClass) {
+      result |= core.mProcessors;
+    }
+  }
+  return result;
+}
+
+NumaNode const*
+Topology::NumaNodeOf(PROCESSOR_NUMBER const& aCpu) const
+{
+  for (NumaNode const& node : mNumaNodes) {
+    if (node.mProcessors.Contains(aCpu)) {
+      return &node;
+    }
+  }
+  return nullptr;
+}
+
+Core const*
+Topology::CoreOf(PROCESSOR_NUMBER const& aCpu) const
+{
+  for (Core const& core : mCores) {
+    if (core.mProcessors.Contains(aCpu)) {
+      return &core;
+    }
+  }
+  return nullptr;
+}
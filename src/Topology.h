@@ -0,0 +1,140 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_Topology_h
+#define rununiproc_Topology_h
+
+#include <vector>
+
+#include <windows.h>
+
+#include "CpuSet.h"
+
+/**
+ * A physical processor core and the logical processors (SMT siblings) that
+ * it exposes.
+ */
+struct Core
+{
+  CpuSet mProcessors;
+  bool mSmt = false;
+  // Higher classes are faster; every core is class 0 on non-hybrid machines
+  BYTE mEfficiencyClass = 0;
+};
+
+/**
+ * A data or unified cache and the logical processors that share it.
+ */
+struct Cache
+{
+  BYTE mLevel = 0;
+  DWORD mSize = 0;
+  CpuSet mProcessors;
+};
+
+struct NumaNode
+{
+  DWORD mNumber = 0;
+  CpuSet mProcessors;
+};
+
+/**
+ * Describes the logical processors that are present on this machine, across
+ * every active processor group, along with how they are arranged into cores,
+ * caches and NUMA nodes.
+ */
+class Topology
+{
+public:
+  Topology() = default;
+
+  /**
+   * Queries the system via GetLogicalProcessorInformationEx. Reports any
+   * failure to stderr and returns false.
+   */
+  bool Init();
+
+  /**
+   * As Init, but from aLength bytes of SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX
+   * records in the format that GetLogicalProcessorInformationEx returns for
+   * RelationAll, so that other machines' topologies can be simulated.
+   */
+  bool InitFromInformation(void const* aInfo, DWORD aLength);
+
+  WORD GroupCount() const
+  {
+    return static_cast<WORD>(mGroupMasks.size());
+  }
+
+  KAFFINITY ActiveMask(WORD aGroup) const
+  {
+    return aGroup < mGroupMasks.size() ? mGroupMasks[aGroup] : 0;
+  }
+
+  /**
+   * Returns the set of every active logical processor in every group.
+   */
+  CpuSet AllProcessors() const;
+
+  std::vector<Core> const& Cores() const
+  {
+    return mCores;
+  }
+
+  /**
+   * Level 2 and level 3 caches, in the order reported by the system.
+   */
+  std::vector<Cache> const& Caches() const
+  {
+    return mCaches;
+  }
+
+  std::vector<NumaNode> const& NumaNodes() const
+  {
+    return mNumaNodes;
+  }
+
+  /**
+   * Returns the processors sharing the aIndex-th L3 cache, or an empty set
+   * when there is no such cache.
+   */
+  CpuSet L3Domain(unsigned int aIndex) const;
+
+  /**
+   * Returns the processors belonging to NUMA node aNumber, or an empty set
+   * when there is no such node.
+   */
+  CpuSet NumaNodeProcessors(DWORD aNumber) const;
+
+  /**
+   * Returns the highest efficiency class of any core. This is zero unless the
+   * machine has a hybrid processor with more than one kind of core.
+   */
+  BYTE MaxEfficiencyClass() const;
+
+  /**
+   * Returns the processors whose cores have efficiency class aClass.
+   */
+  CpuSet EfficiencyClassProcessors(BYTE aClass) const;
+
+  /**
+   * Returns the NUMA node containing aCpu, or nullptr if it is unknown.
+   */
+  NumaNode const* NumaNodeOf(PROCESSOR_NUMBER const& aCpu) const;
+
+  /**
+   * Returns the core containing aCpu, or nullptr if it is unknown.
+   */
+  Core const* CoreOf(PROCESSOR_NUMBER const& aCpu) const;
+
+private:
+  std::vector<KAFFINITY> mGroupMasks;
+  std::vector<Core> mCores;
+  std::vector<Cache> mCaches;
+  std::vector<NumaNode> mNumaNodes;
+};
+
+#endif // rununiproc_Topology_h
@@ -0,0 +1,157 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TopologyDump.h"
+
+#include <string>
+
+#include "CpuSelection.h"
+#include "Output.h"
+
+namespace {
+
+void
+WriteMask(TextWriter& aStream, KAFFINITY aMask)
+{
+  aStream << L"0x" << Hex << static_cast<unsigned long long>(aMask) << Dec;
+}
+
+void
+WriteJson(TextWriter& aStream, Topology const& aTopology,
+          DWORD_PTR aProcessMask, DWORD_PTR aSystemMask,
+          CpuSet const& aEligible, CpuSet const* aSelected)
+{
+  aStream << L"{\"groups\":[";
+  for (WORD group = 0; group < aTopology.GroupCount(); ++group) {
+    CpuSet processors;
+    processors.SetGroupMask(group, aTopology.ActiveMask(group));
+    aStream << (group ? L"," : L"") << L"{\"group\":" << group
+            << L",\"active_mask\":\"";
+    WriteMask(aStream, aTopology.ActiveMask(group));
+    aStream << L"\",\"processors\":" << processors.Count() << L'}';
+  }
+
+  aStream << L"],\"cores\":[";
+  bool first = true;
+  for (Core const& core : aTopology.Cores()) {
+    aStream << (first ? L"" : L",") << L"{\"processors\":\""
+            << core.mProcessors.ToString() << L"\",\"smt\":"
+            << (core.mSmt ? L"true" : L"false")
+            << L",\"efficiency_class\":" << core.mEfficiencyClass << L'}';
+    first = false;
+  }
+
+  aStream << L"],\"caches\":[";
+  first = true;
+  for (Cache const& cache : aTopology.Caches()) {
+    aStream << (first ? L"" : L",") << L"{\"level\":" << cache.mLevel
+            << L",\"size\":" << cache.mSize << L",\"processors\":\""
+            << cache.mProcessors.ToString() << L"\"}";
+    first = false;
+  }
+
+  aStream << L"],\"numa_nodes\":[";
+  first = true;
+  for (NumaNode const& node : aTopology.NumaNodes()) {
+    aStream << (first ? L"" : L",") << L"{\"node\":" << node.mNumber
+            << L",\"processors\":\"" << node.mProcessors.ToString()
+            << L"\"}";
+    first = false;
+  }
+
+  aStream << L"],\"process_affinity_mask\":\"";
+  WriteMask(aStream, aProcessMask);
+  aStream << L"\",\"system_affinity_mask\":\"";
+  WriteMask(aStream, aSystemMask);
+  aStream << L"\",\"eligible\":\"" << aEligible.ToString()
+          << L"\",\"selected\":";
+  if (aSelected) {
+    aStream << L'"' << aSelected->ToString() << L'"';
+  } else {
+    aStream << L"null";
+  }
+  aStream << L"}\n";
+}
+
+void
+WriteText(TextWriter& aStream, Topology const& aTopology,
+          DWORD_PTR aProcessMask, DWORD_PTR aSystemMask,
+          CpuSet const& aEligible, CpuSet const* aSelected)
+{
+  aStream << L"Processor groups: " << aTopology.GroupCount() << L"\n";
+  for (WORD group = 0; group < aTopology.GroupCount(); ++group) {
+    aStream << L"  group " << group << L": active mask ";
+    WriteMask(aStream, aTopology.ActiveMask(group));
+    aStream << L"\n";
+  }
+
+  aStream << L"Cores: " << aTopology.Cores().size() << L"\n";
+  for (Core const& core : aTopology.Cores()) {
+    aStream << L"  " << core.mProcessors.ToString();
+    if (core.mSmt) {
+      aStream << L" (SMT)";
+    }
+    if (aTopology.MaxEfficiencyClass()) {
+      aStream << L" efficiency class " << core.mEfficiencyClass;
+    }
+    aStream << L"\n";
+  }
+
+  aStream << L"Caches: " << aTopology.Caches().size() << L"\n";
+  for (Cache const& cache : aTopology.Caches()) {
+    aStream << L"  L" << cache.mLevel << L' ' << cache.mSize / 1024
+            << L" KB: " << cache.mProcessors.ToString() << L"\n";
+  }
+
+  aStream << L"NUMA nodes: " << aTopology.NumaNodes().size() << L"\n";
+  for (NumaNode const& node : aTopology.NumaNodes()) {
+    aStream << L"  node " << node.mNumber << L": "
+            << node.mProcessors.ToString() << L"\n";
+  }
+
+  aStream << L"Process affinity mask: ";
+  WriteMask(aStream, aProcessMask);
+  aStream << L"\nSystem affinity mask: ";
+  WriteMask(aStream, aSystemMask);
+  aStream << L"\nEligible CPUs: " << aEligible.ToString() << L"\n"
+          << L"Selected CPUs: "
+          << (aSelected ? aSelected->ToString() : std::wstring(L"none"))
+          << L"\n";
+}
+
+} // anonymous namespace
+
+int
+DumpTopology(Topology const& aTopology, CpuSet const& aEligible,
+             Options const& aOptions)
+{
+  // Failing to select is part of the answer, not an error, so check first
+  // rather than have SelectAffinity report it
+  CpuSet selected;
+  bool const haveSelection =
+    CanSatisfyAffinity(aTopology, aEligible, aOptions.mPlacement,
+                       aOptions.mCpus) &&
+    SelectAffinity(aTopology, aEligible, aOptions.mPlacement, aOptions.mCpus,
+                   selected);
+
+  // Only meaningful for our own group: both are zero when we span several,
+  // or if the call fails
+  DWORD_PTR processMask = 0;
+  DWORD_PTR systemMask = 0;
+  GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+
+  StringWriter stream;
+  if (aOptions.mTopology == StatsFormat::Json) {
+    WriteJson(stream, aTopology, processMask, systemMask, aEligible,
+              haveSelection ? &selected : nullptr);
+  } else {
+    WriteText(stream, aTopology, processMask, systemMask, aEligible,
+              haveSelection ? &selected : nullptr);
+  }
+
+  gStdout << stream.str() << Flush;
+  return 0;
+}
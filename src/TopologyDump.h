@@ -0,0 +1,24 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_TopologyDump_h
+#define rununiproc_TopologyDump_h
+
+#include "CpuSet.h"
+#include "Options.h"
+#include "Topology.h"
+
+/**
+ * Writes aTopology to stdout, in the format given by aOptions.mTopology, for
+ * --topology: its processor groups, cores, caches and NUMA nodes, our
+ * process and system affinity masks, the processors in aEligible, and those
+ * that aOptions would pin a child to, or "none" if they cannot be chosen.
+ * Returns the exit code for rununiproc itself, which is always zero.
+ */
+int DumpTopology(Topology const& aTopology, CpuSet const& aEligible,
+                 Options const& aOptions);
+
+#endif // rununiproc_TopologyDump_h
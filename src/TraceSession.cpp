@@ -0,0 +1,110 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TraceSession.h"
+
+#include "Output.h"
+
+TraceSession::~TraceSession()
+{
+  Stop();
+}
+
+bool
+TraceSession::Start(wchar_t const* aPath)
+{
+  // The kernel logger resolves relative paths against its own directory
+  DWORD len = GetFullPathName(aPath, 0, nullptr, nullptr);
+  if (!len) {
+    DWORD err = GetLastError();
+    gStderr << L"Invalid trace file name \"" << aPath << L"\", error code "
+            << err << EndLine;
+    return false;
+  }
+  mPath.resize(len);
+  len = GetFullPathName(aPath, len, &mPath[0], nullptr);
+  mPath.resize(len);
+
+  TraceSetInformationFn setInfo = GetTraceSetInformation();
+  if (!GetTraceQueryInformation() || !setInfo) {
+    // The system logger mode that we rely on is also new in Windows 8
+    gStderr << L"Tracing requires Windows 8." << EndLine;
+    return false;
+  }
+
+  // System logger sessions are few, so free any that killed instances left
+  StopOrphanedKernelSessions();
+
+  std::wstring sessionName;
+  if (!MakeKernelSessionName(L"trace", sessionName)) {
+    return false;
+  }
+  EVENT_TRACE_PROPERTIES* props =
+    InitTraceProperties(mProperties, sessionName, mPath.c_str(),
+                        EVENT_TRACE_FLAG_PROCESS | EVENT_TRACE_FLAG_THREAD |
+                        EVENT_TRACE_FLAG_IMAGE_LOAD |
+                        EVENT_TRACE_FLAG_CSWITCH |
+                        EVENT_TRACE_FLAG_DISPATCHER |
+                        EVENT_TRACE_FLAG_PROFILE);
+  props->MaximumFileSize = kMaxTraceFileMb;
+
+  {
+    ExitCleanup::AutoLock lock;
+    if (!StartKernelSession(sessionName, props, mSession)) {
+      return false;
+    }
+    Register();
+  }
+
+  // Stacks are what make scheduling events explainable, but a trace without
+  // them is still useful
+  ClassicEventId stackEvents[3] = {};
+  stackEvents[0].EventGuid = kThreadEventGuid;
+  stackEvents[0].Type = kOpcodeContextSwitch;
+  stackEvents[1].EventGuid = kThreadEventGuid;
+  stackEvents[1].Type = kOpcodeReadyThread;
+  stackEvents[2].EventGuid = kPerfInfoEventGuid;
+  stackEvents[2].Type = kOpcodeSampledProfile;
+  ULONG result = setInfo(mSession, kTraceStackTracingInfo, stackEvents,
+                         sizeof(stackEvents));
+  if (result != ERROR_SUCCESS) {
+    gStderr << L"Unable to enable stack walking for the trace, error code "
+            << result << EndLine;
+  }
+
+  return true;
+}
+
+bool
+TraceSession::Stop()
+{
+  if (!mSession) {
+    return true;
+  }
+
+  RunCleanup();
+  auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(mProperties.data());
+  ULONG eventsLost = 0;
+  if (!CheckKernelSessionStopped(mStopResult, props, eventsLost)) {
+    return false;
+  }
+
+  if (eventsLost) {
+    gStderr << L"Trace \"" << mPath << L"\" lost " << eventsLost
+            << L" events." << EndLine;
+    return false;
+  }
+
+  return true;
+}
+
+void
+TraceSession::Cleanup()
+{
+  auto props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(mProperties.data());
+  mStopResult = StopKernelSession(mSession, props);
+  mSession = 0;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_TraceSession_h
+#define rununiproc_TraceSession_h
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "Etw.h"
+#include "ExitCleanup.h"
+
+/**
+ * Records a kernel ETW trace to an .etl file for as long as it is running:
+ * process, thread and image load events so that the trace can be decoded,
+ * and context switch, ready thread and sampled profile events (with stacks)
+ * to explain how the child was scheduled. The session is stopped when this
+ * is destroyed, when we are interrupted, or failing both by the next
+ * instance to start a kernel session, and stops writing once the file
+ * reaches kMaxTraceFileMb.
+ *
+ * Requires Windows 8 and administrator rights.
+ */
+class TraceSession : private ExitCleanup
+{
+public:
+  TraceSession() = default;
+  ~TraceSession();
+
+  TraceSession(TraceSession const&) = delete;
+  TraceSession& operator=(TraceSession const&) = delete;
+
+  /**
+   * Starts tracing to aPath, replacing any existing file. Reports any failure
+   * to stderr and returns false.
+   */
+  bool Start(wchar_t const* aPath);
+
+  /**
+   * Stops tracing and flushes the trace file. Reports any failure, or any
+   * events that were lost, to stderr and returns false.
+   */
+  bool Stop();
+
+  // Plenty for minutes of tracing, while keeping a runaway trace from filling
+  // the disk
+  static ULONG const kMaxTraceFileMb = 4096;
+
+private:
+  void Cleanup() override;
+
+  std::wstring mPath;
+  // EVENT_TRACE_PROPERTIES followed by the session and file names
+  std::vector<BYTE> mProperties;
+  TRACEHANDLE mSession = 0;
+  ULONG mStopResult = ERROR_SUCCESS;
+};
+
+#endif // rununiproc_TraceSession_h
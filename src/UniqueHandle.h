@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef rununiproc_UniqueHandle_h
+#define rununiproc_UniqueHandle_h
+
+#include <memory>
+#include <type_traits>
+
+#include <windows.h>
+
+struct HandleDeleter
+{
+  void operator()(HANDLE aHandle)
+  {
+    if (aHandle) {
+      ::CloseHandle(aHandle);
+    }
+  }
+};
+
+struct MappedViewDeleter
+{
+  void operator()(void* aView)
+  {
+    if (aView) {
+      ::UnmapViewOfFile(aView);
+    }
+  }
+};
+
+struct RegKeyDeleter
+{
+  void operator()(HKEY aKey)
+  {
+    if (aKey) {
+      ::RegCloseKey(aKey);
+    }
+  }
+};
+
+using UniqueHandle = std::unique_ptr<std::remove_pointer<HANDLE>::type,
+                                     HandleDeleter>;
+using UniqueRegKey = std::unique_ptr<std::remove_pointer<HKEY>::type,
+                                     RegKeyDeleter>;
+
+/**
+ * An initialized proc thread attribute list. The handful of attributes that
+ * we set fit in inline storage, so launching a child does not normally touch
+ * the heap for them.
+ */
+class ProcThreadAttributeList
+{
+public:
+  ProcThreadAttributeList() = default;
+  ProcThreadAttributeList(ProcThreadAttributeList const&) = delete;
+  ProcThreadAttributeList& operator=(ProcThreadAttributeList const&) = delete;
+
+  ~ProcThreadAttributeList()
+  {
+    if (mList) {
+      ::DeleteProcThreadAttributeList(mList);
+    }
+  }
+
+  bool Init(DWORD aCount)
+  {
+    SIZE_T size = 0;
+    if (!::InitializeProcThreadAttributeList(nullptr, aCount, 0, &size) &&
+        ::GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+      return false;
+    }
+
+    void* storage = mInline;
+    if (size > sizeof(mInline)) {
+      mHeap = std::make_unique<void*[]>((size + sizeof(void*) - 1) /
+                                        sizeof(void*));
+      storage = mHeap.get();
+    }
+
+    auto list = static_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(storage);
+    if (!::InitializeProcThreadAttributeList(list, aCount, 0, &size)) {
+      return false;
+    }
+    mList = list;
+    return true;
+  }
+
+  LPPROC_THREAD_ATTRIBUTE_LIST get() const
+  {
+    return mList;
+  }
+
+private:
+  void* mInline[32];
+  std::unique_ptr<void*[]> mHeap;
+  LPPROC_THREAD_ATTRIBUTE_LIST mList = nullptr;
+};
+
+template <typename T>
+using MappedViewPtr = std::unique_ptr<T, MappedViewDeleter>;
+
+#endif // rununiproc_UniqueHandle_h